@@ -17,6 +17,7 @@
 
 
 #include "bsp.h"
+#include "vexriscv.h"
 #include "i2c.h"
 #include "i2cDemo.h"
 #include "soc.h"
@@ -38,15 +39,39 @@
 #define READ_ACCESS_CALI
 //#define WRITE_ACCESS_CALI
 
+#define DDR_CALI_FAST_SEARCH		//coarse scan plus per lane binary refinement, comment out for the linear sweeps
+
+#define DDR_CALI_BURST			//merge address/data phases and cache configuration registers, comment out for the legacy access
+
+//#define DDR_CALI_DRIFT_TRACK	//read eye drift tracking after the calibration (DDR_DriftTrack / DDR_DriftTask)
+
+#define DDR_CALI_PERSIST		//keep the trained values in SPI flash and restore them on warm boot (DDR_CaliBoot)
+
 //#define DEUBG_MASSAGE
 //********************************************************************
 
 #define mem ((volatile uint32_t*)0x00001000)
 #define BRUST 16
 
+#define READ_LEVEL_START	0x00	//read delay range swept by the read leveling
+#define READ_LEVEL_END		0xA0	//exclusive
+
+#define DDR_ADDR_INVALID	0xFFFFFFFF
+#define DDR_LANE_MASK		((1 << MAX_SLICE) - 1)
+#define DDR_CACHE_ENTRIES	((4*MAX_SLICE)+3)
+
 int MemoryTest_Train(int size);
+int MemoryTest_TrainLanes(int size);
+int MemoryTest_LanesAt(volatile uint32_t *buf, int size);
+
+#ifdef DDR_CALI_BURST
+void DDR_BurstWrite(uint32_t Addr, uint32_t Data);
+uint32_t DDR_BurstRead(uint32_t Addr);
+#endif
+void DDR_CaliCacheInvalidate(void);
 
 void DDR_AccessTimingCali(void);
+void DDR_CaliI2cInit(void);
 void ddr_cmd_issue(int num);
 void ctrl_update_req(void);
 
@@ -140,6 +165,11 @@ void print(uint8_t * data) {
   uart_writeStr(BSP_UART_TERMINAL, data);
 }
 
+uint32_t DDR_LastAddr = DDR_ADDR_INVALID;	//address currently held by the bridge address register
+uint32_t DDR_I2cTransactions;				//number of I2C transactions (start to stop)
+uint32_t DDR_SkippedWrites;					//writes dropped by the register cache
+uint32_t DDR_CachedReads;					//reads served by the register cache
+
 /*******************************************************************************
 *
 * @brief This function checks for an acknowledgment (ACK) from an I2C device.
@@ -154,6 +184,7 @@ uint8_t checkAck(void){
 
 	if(i2c_rxAck(DDR_I2C_CH)==0){
 	    	i2c_masterStopBlocking(DDR_I2C_CH);
+	    	DDR_LastAddr = DDR_ADDR_INVALID;
 	    //	uart_writeStr(UART_A, "\rGet Ack Fail\n");
 	    	return 0;
 	}
@@ -183,6 +214,7 @@ void WriteDDRArray(uint8_t *data, uint32_t size)
     unsigned char buf;
     int out;
 
+	DDR_I2cTransactions++;
 	i2c_masterStartBlocking(DDR_I2C_CH);
 
     for(int i = 0;i < size;i++){
@@ -212,6 +244,7 @@ void WriteDDRAddr(uint32_t addr)
    buf[4] = (addr >> 16) & 0xFF;
    buf[5] = (addr >> 24) & 0xFF;
 
+   DDR_LastAddr = addr;
    WriteDDRArray(buf, 6);
 
 }
@@ -250,8 +283,12 @@ void WriteDDRData(uint32_t data)
 
 void WriteDDR_Addr_Data(uint32_t Addr, uint32_t Data)
 {
+#ifdef DDR_CALI_BURST
+    DDR_BurstWrite(Addr, Data);
+#else
     WriteDDRAddr(Addr);
     WriteDDRData(Data);
+#endif
 }
 
 /*******************************************************************************
@@ -267,6 +304,7 @@ uint32_t ReadDDRData(void)
 {
     uint32_t outdata=0;
 
+    DDR_I2cTransactions++;
     i2c_masterStartBlocking(DDR_I2C_CH);
 
 	i2c_txByte(DDR_I2C_CH, (0x41<<1)+1);
@@ -297,9 +335,201 @@ uint32_t ReadDDRData(void)
 ******************************************************************************/
 uint32_t ReadAddrData(uint32_t Addr)
 {
+#ifdef DDR_CALI_BURST
+    return DDR_BurstRead(Addr);
+#else
     WriteDDRAddr(Addr);
     return ReadDDRData();
+#endif
+}
+
+/*******************************************************************************
+*
+* @brief This function returns the register cache slot of a DDR controller
+*        register. Only configuration registers which are never modified by the
+*        controller itself are cached: per slice 0x00, 0x02, 0x05 and 0x0B, plus
+*        0x45, 0x59 and 0x480. Status and trigger registers (0x01, 0x0C, 0x0F,
+*        0x412, 0x483, 0x53, 0x5B, ...) always go to the bus.
+*
+* @param Addr  Register address.
+*
+* @return      Cache slot index, or -1 if the register is not cached.
+*
+******************************************************************************/
+int DDR_CacheIndex(uint32_t Addr)
+{
+	if(Addr < (0x10 * MAX_SLICE))
+	{
+		switch(Addr & 0x0F)
+		{
+		case 0x00: return (Addr >> 4)*4 + 0;
+		case 0x02: return (Addr >> 4)*4 + 1;
+		case 0x05: return (Addr >> 4)*4 + 2;
+		case 0x0B: return (Addr >> 4)*4 + 3;
+		default:   return -1;
+		}
+	}
+
+	switch(Addr)
+	{
+	case 0x045: return (4*MAX_SLICE) + 0;
+	case 0x059: return (4*MAX_SLICE) + 1;
+	case 0x480: return (4*MAX_SLICE) + 2;
+	default:    return -1;
+	}
+}
+
+uint32_t DDR_CacheData[DDR_CACHE_ENTRIES];
+uint8_t  DDR_CacheValid[DDR_CACHE_ENTRIES];
+
+/*******************************************************************************
+*
+* @brief This function invalidates the register cache and the cached bridge
+*        address. To be called whenever the controller may have been reset or
+*        reprogrammed behind the back of this file.
+*
+******************************************************************************/
+void DDR_CaliCacheInvalidate(void)
+{
+	for(int i = 0; i < DDR_CACHE_ENTRIES; i++)
+		DDR_CacheValid[i] = 0;
+
+	DDR_LastAddr = DDR_ADDR_INVALID;
+}
+
+#ifdef DDR_CALI_BURST
+/*******************************************************************************
+*
+* @brief This function sends a bridge register access (device address, bridge
+*        register, 32-bit value) inside an already started transaction.
+*
+* @param Reg   Bridge register, 0x01 for the address and 0x00 for the data.
+* @param Value 32-bit value.
+*
+* @return      Returns 1 on success, 0 if the bridge did not acknowledge (the
+*              transaction is then already stopped).
+*
+******************************************************************************/
+uint8_t DDR_TxReg(uint8_t Reg, uint32_t Value)
+{
+	uint8_t buf[6];
+
+	buf[0] = 0x41<<1;
+	buf[1] = Reg;
+	buf[2] = Value & 0xFF;
+	buf[3] = (Value >> 8) & 0xFF;
+	buf[4] = (Value >> 16) & 0xFF;
+	buf[5] = (Value >> 24) & 0xFF;
+
+	for(int i = 0;i < 6;i++){
+		i2c_txByte(DDR_I2C_CH, buf[i]);
+		i2c_txNackBlocking(DDR_I2C_CH);
+		if(!checkAck())	return 0;
+	}
+
+	return 1;
+}
+
+/*******************************************************************************
+*
+* @brief This function writes a 32-bit value to a DDR controller register in a
+*        single I2C transaction. The address phase is skipped when the bridge
+*        already holds the address, otherwise it is chained to the data phase
+*        with a repeated start. Writes to cached registers which would not
+*        change their value are dropped.
+*
+* @param Addr  Register address.
+* @param Data  32-bit value.
+*
+******************************************************************************/
+void DDR_BurstWrite(uint32_t Addr, uint32_t Data)
+{
+	int idx = DDR_CacheIndex(Addr);
+
+	if((idx >= 0) && DDR_CacheValid[idx] && (DDR_CacheData[idx] == Data))
+	{
+		DDR_SkippedWrites++;
+		return;
+	}
+
+	if(idx >= 0)
+		DDR_CacheValid[idx] = 0;
+
+	DDR_I2cTransactions++;
+	i2c_masterStartBlocking(DDR_I2C_CH);
+
+	if(Addr != DDR_LastAddr)
+	{
+		DDR_LastAddr = Addr;
+		if(!DDR_TxReg(0x01, Addr))	return;
+		i2c_masterRestartBlocking(DDR_I2C_CH);
+	}
+
+	if(!DDR_TxReg(0x00, Data))	return;
+
+	i2c_masterStopBlocking(DDR_I2C_CH);
+
+	if(idx >= 0)
+	{
+		DDR_CacheData[idx] = Data;
+		DDR_CacheValid[idx] = 1;
+	}
+}
+
+/*******************************************************************************
+*
+* @brief This function reads a 32-bit value from a DDR controller register in a
+*        single I2C transaction, the address phase being skipped or chained with
+*        a repeated start as in DDR_BurstWrite. Cached registers are served
+*        without any bus access once known.
+*
+* @param Addr  Register address.
+*
+* @return      32-bit value, 0 if the bridge did not acknowledge.
+*
+******************************************************************************/
+uint32_t DDR_BurstRead(uint32_t Addr)
+{
+	int idx = DDR_CacheIndex(Addr);
+	uint32_t outdata = 0;
+
+	if((idx >= 0) && DDR_CacheValid[idx])
+	{
+		DDR_CachedReads++;
+		return DDR_CacheData[idx];
+	}
+
+	DDR_I2cTransactions++;
+	i2c_masterStartBlocking(DDR_I2C_CH);
+
+	if(Addr != DDR_LastAddr)
+	{
+		DDR_LastAddr = Addr;
+		if(!DDR_TxReg(0x01, Addr))	return 0;
+		i2c_masterRestartBlocking(DDR_I2C_CH);
+	}
+
+	i2c_txByte(DDR_I2C_CH, (0x41<<1)+1);
+	i2c_txNackBlocking(DDR_I2C_CH);
+	if(!checkAck())	return 0;
+
+	for(int i = 0; i < 4; i++){
+		i2c_txByte(DDR_I2C_CH, 0xFF);
+		if(i != 3) i2c_txAckBlocking(DDR_I2C_CH); else i2c_txNackBlocking(DDR_I2C_CH);
+		outdata |= i2c_rxData(DDR_I2C_CH) << (i*8);
+	}
+
+	i2c_masterStopBlocking(DDR_I2C_CH);
+
+	if(idx >= 0)
+	{
+		DDR_CacheData[idx] = outdata;
+		DDR_CacheValid[idx] = 1;
+	}
+
+	return outdata;
 }
+#endif
 
 /*******************************************************************************
 *
@@ -410,6 +640,73 @@ int MemoryTest_Train(int size)
 	return 1;
 }
 
+/*******************************************************************************
+*
+* @brief This function performs the same LFSR memory test as MemoryTest_Train
+*        but reports the result per byte lane, so that all the slices can be
+*        calibrated from the same test bursts. Byte n of a 32-bit word belongs
+*        to slice (n % MAX_SLICE).
+*
+* @param buf  Scratch area, destroyed. Each burst is invalidated from the data
+*             cache before the readback, so that the DDR itself is compared.
+* @param size Size of the memory test in 32-bit words.
+*
+* @return Bitmask of the failing slices, 0 if the memory test passes.
+*
+******************************************************************************/
+
+int MemoryTest_LanesAt(volatile uint32_t *buf, int size)
+{
+	int n,Byte;
+	int fail=0;
+	uint32_t buff[BRUST];
+	uint32_t diff;
+	static uint32_t seed;
+
+	if(seed==0)	seed=0x123ABC99;
+
+	if(size <=BRUST) size=BRUST;
+
+	for(int i=0;i<(size/BRUST);i++)
+	{
+		for(n=0;n<BRUST;n++)
+		{
+			buff[n]= lfsr1_32bits(seed,2)  & 0xFFFFFFFF;
+			seed=buff[n];
+			buf[(i*BRUST)+n]=buff[n];
+		}
+
+		data_cache_invalidate_range((const void *)&buf[i*BRUST], BRUST*sizeof(uint32_t));
+
+		for(n=0;n<BRUST;n++)
+		{
+			diff = buf[(i*BRUST)+n] ^ buff[n];
+
+			for(Byte=0;Byte<4;Byte++)
+			{
+				if((diff >> (Byte*8)) & 0xFF)
+					fail |= 1 << (Byte % MAX_SLICE);
+			}
+		}
+
+		if(fail == DDR_LANE_MASK)
+			break;
+	}
+
+	return fail;
+}
+
+/*******************************************************************************
+*
+* @brief Same as MemoryTest_LanesAt on the calibration scratch area (mem).
+*
+******************************************************************************/
+
+int MemoryTest_TrainLanes(int size)
+{
+	return MemoryTest_LanesAt(mem, size);
+}
+
 #ifdef LPDDR3_DEVICE
 
 /*******************************************************************************
@@ -696,6 +993,7 @@ void CA_Training(void)
 #endif
 
 #ifdef READ_ACCESS_CALI
+#ifndef DDR_CALI_FAST_SEARCH
 /*******************************************************************************
 *
 * @brief This function performs Read Leveling Calibration for DDR3 or LPDDR3 memory.
@@ -930,42 +1228,802 @@ void GateLeveling_soft(void)
     WriteDDR_Addr_Data(0x59, 0x00);
     WriteDDR_Addr_Data(0x0480, 0x20a0a0);
 }
-#endif
+#else
+//**************************Fast Search*******************************
+#define READ_LEVEL_STEP		2		//final resolution, same as the linear sweep
+#define READ_LEVEL_COARSE	0x10	//coarse scan step, has to be a multiple of READ_LEVEL_STEP
+
+#define GATE_FINE_RANGE		0x80	//fine taps per coarse step
+#define GATE_FINE_END		0x7C	//last fine tap used by the linear sweep
+#define GATE_STEP			4		//final resolution, same as the linear sweep
+#define GATE_COARSE			32		//coarse scan step, has to be a multiple of GATE_STEP
+//********************************************************************
+
+uint32_t DDR_CaliPoints;	//number of test points evaluated by the last search
 
 /*******************************************************************************
 *
-* @brief This function performs Access Timing Calibration for DDR3 or LPDDR3 memory.
-*        It configures I2C parameters and calls specific calibration functions
-*        based on preprocessor directives.
+* @brief This function refines an edge on every selected slice in parallel with
+*        a binary search. Each probe programs all the slices at once, so the
+*        number of probes only depends on the widest interval.
+*
+* @param lo     Per slice value known to be in state 0, updated.
+* @param hi     Per slice value known to be in state 1, updated.
+* @param lanes  Bitmask of the slices to refine. The other slices are driven
+*               with hi, which has to be set for every slice.
+* @param step   Resolution of the search, lo and hi are multiples of it.
+* @param probe  Programs the per slice values and returns the bitmask of the
+*               slices in state 1.
 *
 ******************************************************************************/
-void DDR_AccessTimingCali(void)
+void DDR_LaneBisect(int *lo, int *hi, int lanes, int step, int (*probe)(const int *val))
 {
+	int val[4];
+	int active,state,Byte;
 
-	//I2C init
-	I2c_Config i2c;
-	i2c.samplingClockDivider = 3;
-	i2c.timeout = I2C_CTRL_HZ/1000;    //1 ms;
-	i2c.tsuDat  = I2C_CTRL_HZ/2000000; //500 ns
+	for(;;)
+	{
+		active = 0;
 
-	i2c.tLow  = I2C_CTRL_HZ/800000;  //1.25 us
-	i2c.tHigh = I2C_CTRL_HZ/800000; //1.25 us
-	i2c.tBuf  = I2C_CTRL_HZ/400000;  //2.5 us
+		for(Byte = 0; Byte < MAX_SLICE; Byte++)
+		{
+			if(((lanes >> Byte) & 1) && (hi[Byte] - lo[Byte] > step))
+			{
+				val[Byte] = lo[Byte] + ((hi[Byte] - lo[Byte]) / step / 2) * step;
+				active |= 1 << Byte;
+			}
+			else
+			{
+				val[Byte] = hi[Byte];
+			}
+		}
 
-	i2c_applyConfig(DDR_I2C_CH, &i2c);
+		if(!active)
+			break;
 
+		state = probe(val);
 
-	#ifdef WRITE_ACCESS_CALI
-		#ifdef LPDDR3_DEVICE
-			CA_Training();
-		#endif
-		WriteLeveling_soft();
-	#endif
+		for(Byte = 0; Byte < MAX_SLICE; Byte++)
+		{
+			if((active >> Byte) & 1)
+			{
+				if((state >> Byte) & 1)	hi[Byte] = val[Byte];
+				else					lo[Byte] = val[Byte];
+			}
+		}
+	}
+}
 
-	#ifdef READ_ACCESS_CALI
-		GateLeveling_soft();
-		ReadLeveling_PatternCali();
-	#endif
+/*******************************************************************************
+*
+* @brief This function programs a read delay per slice and runs the lane test.
+*
+* @param val  Per slice read delay.
+*
+* @return     Bitmask of the failing slices.
+*
+******************************************************************************/
+int ReadLeveling_ProbeFail(const int *val)
+{
+	for(int bank=0;bank<MAX_SLICE;bank++)
+	{
+		WriteDDR_Addr_Data((bank*0x10)+0x05,(ReadAddrData((bank*0x10)+0x05)& 0xFFFFFF00)|(val[bank]&0xFF));
+		WriteDDR_Addr_Data((bank*0x10)+0x00,(ReadAddrData((bank*0x10)+0x00)& 0xFF00FFFF)|((val[bank]&0xFF)<<16));
+	}
+
+	ctrl_update_req();
+	DDR_CaliPoints++;
+
+	return MemoryTest_TrainLanes(128*16);
+}
+
+/*******************************************************************************
+*
+* @brief Same as ReadLeveling_ProbeFail, returning the passing slices.
+*
+******************************************************************************/
+int ReadLeveling_ProbePass(const int *val)
+{
+	return (~ReadLeveling_ProbeFail(val)) & DDR_LANE_MASK;
 }
 
+/*******************************************************************************
+*
+* @brief This function performs Read Leveling Calibration for DDR3 or LPDDR3 memory.
+*        A coarse scan locates the passing window of every slice, then both
+*        window edges are refined by binary search. Each slice gets the center
+*        of its own window.
+*
+******************************************************************************/
+void ReadLeveling_PatternCali(void)
+{
+    int rng,bank,fail,check,lanes;
+    uint32_t buff[8];
+    int val[4];
+    int FirstPass[4]={-1,-1,-1,-1},LastPass[4]={-1,-1,-1,-1};
+    int lo[4],hi[4],result[4];
+    int Done=1;
+
+    DDR_CaliPoints=0;
+
+    for(bank=0;bank<MAX_SLICE;bank++)
+    {
+   		buff[bank]=ReadAddrData((bank*0x10)+0x05);
+   		buff[bank+4]=ReadAddrData((bank*0x10)+0x00);
+    }
+
+    //Coarse scan, all the slices share the same delay
+    for (rng = READ_LEVEL_START; rng < READ_LEVEL_END; rng+=READ_LEVEL_COARSE)
+    {
+    	for(bank=0;bank<MAX_SLICE;bank++)
+    		val[bank]=rng;
+
+    	fail=ReadLeveling_ProbeFail(val);
+
+    	for(bank=0;bank<MAX_SLICE;bank++)
+    	{
+    		if(!((fail>>bank)&1))
+    		{
+    			if(FirstPass[bank]==-1)
+    				FirstPass[bank]=rng;
+
+    			LastPass[bank]=rng;
+    		}
+    	}
+    }
+
+    //Left edges : lo fails, hi passes. The slices not refined keep their current delay
+    lanes=0;
+    for(bank=0;bank<MAX_SLICE;bank++)
+    {
+    	lo[bank]=hi[bank]=buff[bank]&0xFF;
+
+    	if(FirstPass[bank]>READ_LEVEL_START)
+    	{
+    		lo[bank]=FirstPass[bank]-READ_LEVEL_COARSE;
+    		hi[bank]=FirstPass[bank];
+    		lanes|=1<<bank;
+    	}
+    }
+    DDR_LaneBisect(lo,hi,lanes,READ_LEVEL_STEP,ReadLeveling_ProbePass);
+    for(bank=0;bank<MAX_SLICE;bank++)
+    	if((lanes>>bank)&1)	FirstPass[bank]=hi[bank];
+
+    //Right edges : lo passes, hi fails (or is out of range)
+    lanes=0;
+    for(bank=0;bank<MAX_SLICE;bank++)
+    {
+    	lo[bank]=hi[bank]=buff[bank]&0xFF;
+
+    	if(LastPass[bank]!=-1)
+    	{
+    		lo[bank]=LastPass[bank];
+    		hi[bank]=LastPass[bank]+READ_LEVEL_COARSE;
+    		if(hi[bank]>READ_LEVEL_END)	hi[bank]=READ_LEVEL_END;
+    		lanes|=1<<bank;
+    	}
+    }
+    DDR_LaneBisect(lo,hi,lanes,READ_LEVEL_STEP,ReadLeveling_ProbeFail);
+    for(bank=0;bank<MAX_SLICE;bank++)
+    	if((lanes>>bank)&1)	LastPass[bank]=lo[bank];
+
+    for(bank=0;bank<MAX_SLICE;bank++)
+    {
+    	result[bank]=((LastPass[bank]+FirstPass[bank])/2) & ~(READ_LEVEL_STEP-1);
+    	check=LastPass[bank]-FirstPass[bank];
+
+    	if((LastPass[bank]==(-1)) || (FirstPass[bank]==(-1)) || (check<0x10))
+    		Done=0;
+    }
+
+    if(!Done)
+    {
+		for(bank=0;bank<MAX_SLICE;bank++)
+		{
+			WriteDDR_Addr_Data((bank*0x10)+0x05,buff[0+bank]);
+			WriteDDR_Addr_Data((bank*0x10)+0x00,buff[4+bank]);
+		}
+
+		print("Read Level Fail !!\n\r");
+    }
+    else
+    {
+    	for(bank=0;bank<MAX_SLICE;bank++)
+		{
+   			 WriteDDR_Addr_Data((bank*0x10)+0x05,(buff[0+bank]& 0xFFFFFF00)|(result[bank]&0xFF));
+   			 WriteDDR_Addr_Data((bank*0x10)+0x00,(buff[4+bank]& 0xFF00FFFF)|((result[bank]&0xFF)<<16));
+		}
+
+    	print("Read Level Done !!\n\r");
+    }
+
+    bsp_printf("Read Level points: %d\n\r", DDR_CaliPoints);
+
+    #ifdef DEUBG_MASSAGE
+    for(bank=0;bank<MAX_SLICE;bank++)
+    {
+    	print("slice FirstPass= 0x");
+    	print_hex(FirstPass[bank],2);
+    	print(" LastPass= 0x");
+    	print_hex(LastPass[bank],2);
+    	print(" Result= 0x");
+    	print_hex(result[bank],2);
+    	print("\n\r");
+    }
+	#endif
+
+	ctrl_update_req();
+}
+
+/*******************************************************************************
+*
+* @brief This function programs a gate delay per slice, as a linear position
+*        (coarse * GATE_FINE_RANGE + fine), issues the calibration read and
+*        samples the gate training result.
+*
+* @param val  Per slice gate position.
+*
+* @return     Bitmask of the slices reporting a result of 1.
+*
+******************************************************************************/
+int GateLeveling_Probe(const int *val)
+{
+	int Byte,valc,valf;
+	int state=0;
+
+	for (Byte = 0; Byte < MAX_SLICE; Byte++)
+	{
+		valc = val[Byte] / GATE_FINE_RANGE;
+		valf = val[Byte] % GATE_FINE_RANGE;
+		WriteDDR_Addr_Data(0x02 + (0x10 * Byte), (ReadAddrData(0x02 + (0x10 * Byte)) & 0xDFFFFFF8) | ((valc & 0xE) >> 1) | ((valc & 0x1) << 29));
+		WriteDDR_Addr_Data(0x05 + (0x10 * Byte), (ReadAddrData(0x05 + (0x10 * Byte)) & 0x00FFFFFF) | ((valf & 0xFF) << 24));
+	}
+
+	ctrl_update_req();
+
+	#ifdef LPDDR3_DEVICE
+	LPDDR_Write_CMD(0x08, 32, 0x00);    //MR32 DQ calibration pattern A 0xAA
+	#else
+	DDR3_READ_CMD();
+	#endif
+
+	for (Byte = 0; Byte < MAX_SLICE; Byte++)
+	{
+		if(((ReadAddrData(0x0C + (0x10 * Byte)) >> 16) & 0xFF) == 1)
+			state |= 1 << Byte;
+	}
+
+	DDR_CaliPoints++;
+
+	return state;
+}
+
+/*******************************************************************************
+*
+* @brief This function returns the current gate position of a slice, in the
+*        linear form used by GateLeveling_Probe.
+*
+******************************************************************************/
+int GateLeveling_Current(int Byte)
+{
+	uint32_t reg2 = ReadAddrData(0x02 + (0x10 * Byte));
+	int valc = ((reg2 & 0x7) << 1) | ((reg2 >> 29) & 0x1);
+	int valf = (ReadAddrData(0x05 + (0x10 * Byte)) >> 24) & 0xFF;
+
+	return valc * GATE_FINE_RANGE + valf;
+}
+
+/*******************************************************************************
+*
+* @brief This function performs Gate Leveling calibration for DDR3 or LPDDR3 memory.
+*        The rising edge of the gate training result is located by a coarse
+*        scan, then refined by binary search on every slice in parallel. As in
+*        the linear sweep, the scan ends with the coarse delay in which every
+*        slice has seen an edge, and each slice keeps its last rising edge.
+*
+******************************************************************************/
+
+void GateLeveling_soft(void)
+{
+    int pos,Byte,state,found=0;
+    int val[4];
+    int lo[4],hi[4];
+    unsigned char rising_edge_c[4] = { 0xFF,0xFF,0xFF,0xFF };
+    unsigned char rising_edge_f[4] = { 0xFF,0xFF,0xFF,0xFF };
+    int LastState = -1;
+
+    DDR_CaliPoints=0;
+
+    WriteDDR_Addr_Data(0x0480, 0x210A0A0);
+
+	#ifndef LPDDR3_DEVICE
+    //DDR3*********************
+    ddr_Write_MRS_Op(3, 0x0004);
+	//*************************
+	#endif
+
+    WriteDDR_Addr_Data(0x59, 0x14);
+
+    for (Byte = 0; Byte < MAX_SLICE; Byte++)
+    {
+    	WriteDDR_Addr_Data(0x0B+(0x10*Byte), (ReadAddrData(0x0B+(0x10*Byte))) | (1 << 12));
+    	lo[Byte] = hi[Byte] = GateLeveling_Current(Byte);
+    }
+
+    //Coarse scan, a 0 to 1 transition brackets the edge between two points
+    for (pos = GATE_TRAINING_COARSE_START * GATE_FINE_RANGE;
+    	 pos <= GATE_TRAINING_COARSE_END * GATE_FINE_RANGE + GATE_FINE_END; pos += GATE_COARSE)
+    {
+    	for (Byte = 0; Byte < MAX_SLICE; Byte++)
+    		val[Byte] = pos;
+
+    	state = GateLeveling_Probe(val);
+
+    	for (Byte = 0; Byte < MAX_SLICE; Byte++)
+    	{
+    		if ((LastState != -1) && !((LastState >> Byte) & 1) && ((state >> Byte) & 1))
+    		{
+    			lo[Byte] = pos - GATE_COARSE;
+    			hi[Byte] = pos;
+    			found |= 1 << Byte;
+    		}
+    	}
+
+    	LastState = state;
+
+    	if ((found == DDR_LANE_MASK) && ((pos % GATE_FINE_RANGE) + GATE_COARSE > GATE_FINE_END))
+    		break;
+    }
+
+    DDR_LaneBisect(lo, hi, found, GATE_STEP, GateLeveling_Probe);
+
+    for (Byte = 0; Byte < MAX_SLICE; Byte++)
+    {
+		if (!((found >> Byte) & 1))
+		{
+			//Fail
+		}
+		else
+		{
+			rising_edge_c[Byte] = hi[Byte] / GATE_FINE_RANGE;
+			rising_edge_f[Byte] = hi[Byte] % GATE_FINE_RANGE;
+
+			if (rising_edge_f[Byte] < GATE_OFFSET)   //64 = 1/4 cycle offset
+			{
+				rising_edge_f[Byte] += GATE_OFFSET;
+				rising_edge_c[Byte] -=1;
+			}
+			else
+			{
+				rising_edge_f[Byte] -= GATE_OFFSET;
+			}
+
+			WriteDDR_Addr_Data(0x02 + (0x10 * Byte), (ReadAddrData(0x02 + (0x10 * Byte)) & 0xDFFFFFF8) | ((rising_edge_c[Byte] & 0xE) >> 1) | ((rising_edge_c[Byte] & 0x1) << 29));
+			WriteDDR_Addr_Data(0x05 + (0x10 * Byte), (ReadAddrData(0x05 + (0x10 * Byte)) & 0x00FFFFFF) | rising_edge_f[Byte] << 24);
+		}
+    }
+
+    print("Gate Level Done !!\n\r");
+    bsp_printf("Gate Level points: %d\n\r", DDR_CaliPoints);
+
+    #ifdef DEUBG_MASSAGE
+    for (Byte = 0; Byte < MAX_SLICE; Byte++)
+    {
+    	print("rising_edge_c =  ");
+    	print_hex(rising_edge_c[Byte],4);
+    	print(" rising_edge_f =  ");
+    	print_hex(rising_edge_f[Byte],4);
+    	print("\n\r");
+    }
+	#endif
+
+    ctrl_update_req();
+
+    for (Byte = 0; Byte < MAX_SLICE; Byte++)
+    	WriteDDR_Addr_Data(0x0B+(0x10*Byte), (ReadAddrData(0x0B+(0x10*Byte))) &0xFFFFEFFF);
+
+	#ifndef LPDDR3_DEVICE
+    //DDR3*********************
+    ddr_Write_MRS_Op(3, 0x0000);
+	//*************************
+	#endif
+
+    WriteDDR_Addr_Data(0x59, 0x00);
+    WriteDDR_Addr_Data(0x0480, 0x20a0a0);
+}
+#endif
+#endif
+
+/*******************************************************************************
+*
+* @brief This function configures the I2C channel used to reach the DDR
+*        controller (400 kHz class timings).
+*
+******************************************************************************/
+void DDR_CaliI2cInit(void)
+{
+	//I2C init
+	I2c_Config i2c;
+	i2c.samplingClockDivider = 3;
+	i2c.timeout = I2C_CTRL_HZ/1000;    //1 ms;
+	i2c.tsuDat  = I2C_CTRL_HZ/2000000; //500 ns
+
+	i2c.tLow  = I2C_CTRL_HZ/800000;  //1.25 us
+	i2c.tHigh = I2C_CTRL_HZ/800000; //1.25 us
+	i2c.tBuf  = I2C_CTRL_HZ/400000;  //2.5 us
+
+	i2c_applyConfig(DDR_I2C_CH, &i2c);
+}
+
+/*******************************************************************************
+*
+* @brief This function performs Access Timing Calibration for DDR3 or LPDDR3 memory.
+*        It configures I2C parameters and calls specific calibration functions
+*        based on preprocessor directives.
+*
+******************************************************************************/
+void DDR_AccessTimingCali(void)
+{
+	uint32_t startTime;
+
+	DDR_CaliI2cInit();
+
+	DDR_CaliCacheInvalidate();
+	DDR_I2cTransactions = 0;
+	DDR_SkippedWrites = 0;
+	DDR_CachedReads = 0;
+	startTime = clint_getTimeLow(BSP_CLINT);
+
+
+	#ifdef WRITE_ACCESS_CALI
+		#ifdef LPDDR3_DEVICE
+			CA_Training();
+		#endif
+		WriteLeveling_soft();
+	#endif
+
+	#ifdef READ_ACCESS_CALI
+		GateLeveling_soft();
+		ReadLeveling_PatternCali();
+	#endif
+
+	bsp_printf("DDR calibration: %d ms, %d I2C transactions, %d writes skipped, %d reads cached\n\r",
+			(clint_getTimeLow(BSP_CLINT) - startTime) / (BSP_CLINT_HZ / 1000),
+			DDR_I2cTransactions, DDR_SkippedWrites, DDR_CachedReads);
+}
+
+#ifdef DDR_CALI_DRIFT_TRACK
+//**************************Drift Tracking****************************
+#ifndef DDR_DRIFT_SCRATCH
+#define DDR_DRIFT_SCRATCH		((volatile uint32_t*)0x00002000)	//reserved, never used by the application
+#endif
+#define DDR_DRIFT_WORDS			(16*16)	//words tested per probe
+#define DDR_DRIFT_MARGIN		0x06	//probe offset around the trained read delay, inside the 0x10 minimum window
+#define DDR_DRIFT_STEP			2		//delay nudge applied when a side of the eye fails
+#define DDR_DRIFT_PERIOD_MS		1000	//DDR_DriftTask period
+#ifndef DDR_DRIFT_QUIESCE
+#define DDR_DRIFT_QUIESCE()				//stops the other DDR masters (DMA) before a probe, defined by the application
+#define DDR_DRIFT_RESUME()				//restarts them after the probe
+#endif
+//********************************************************************
+
+int DDR_DriftCenter[4];			//read delay currently applied per slice
+uint32_t DDR_DriftChecks;		//DDR_DriftTrack calls
+uint32_t DDR_DriftNudges;		//delay adjustments applied
+uint32_t DDR_DriftLost;			//checks where both sides of the eye failed
+
+/*******************************************************************************
+*
+* @brief This function programs the read delay of every slice.
+*
+* @param val  Per slice read delay.
+*
+******************************************************************************/
+void DDR_DriftSetReadDelay(const int *val)
+{
+	for(int bank=0;bank<MAX_SLICE;bank++)
+	{
+		WriteDDR_Addr_Data((bank*0x10)+0x05,(ReadAddrData((bank*0x10)+0x05)& 0xFFFFFF00)|(val[bank]&0xFF));
+		WriteDDR_Addr_Data((bank*0x10)+0x00,(ReadAddrData((bank*0x10)+0x00)& 0xFF00FFFF)|((val[bank]&0xFF)<<16));
+	}
+
+	ctrl_update_req();
+}
+
+/*******************************************************************************
+*
+* @brief This function captures the trained read delays as the reference of the
+*        drift tracking. To be called once the calibration (or its restore from
+*        flash) is done.
+*
+******************************************************************************/
+void DDR_DriftInit(void)
+{
+	for(int bank=0;bank<MAX_SLICE;bank++)
+		DDR_DriftCenter[bank] = ReadAddrData((bank*0x10)+0x05) & 0xFF;
+
+	DDR_DriftChecks = 0;
+	DDR_DriftNudges = 0;
+	DDR_DriftLost = 0;
+}
+
+/*******************************************************************************
+*
+* @brief This function checks the read eye margin of every slice and follows its
+*        drift. The read delay is moved DDR_DRIFT_MARGIN below then above the
+*        current point, the scratch area being tested at each side. When only
+*        one side fails, the eye moved away from it and the delay is nudged by
+*        DDR_DRIFT_STEP the other way. The delays are always left on the
+*        (possibly nudged) center, applied through ctrl_update_req.
+*
+* @note  While the delay is off center, reads from DDR are not reliable. The
+*        probes therefore run with the DDR traffic quiesced: interrupts are
+*        masked (which also holds the scheduler) and DDR_DRIFT_QUIESCE has to
+*        stop every other DDR master, such as the DMA channels. The code and the
+*        stack of this function must not be in DDR. The DDR_DRIFT_SCRATCH area
+*        must not be used by the application.
+*
+* @return Bitmask of the slices which were nudged.
+*
+******************************************************************************/
+int DDR_DriftTrack(void)
+{
+	int val[4];
+	int failLow,failHigh,nudged=0;
+	int bank;
+	uint32_t mie;
+
+	DDR_DriftChecks++;
+
+	DDR_DRIFT_QUIESCE();
+	mie = csr_read_clear(mstatus, MSTATUS_MIE) & MSTATUS_MIE;
+
+	for(bank=0;bank<MAX_SLICE;bank++)
+		val[bank] = DDR_DriftCenter[bank] - DDR_DRIFT_MARGIN;
+	DDR_DriftSetReadDelay(val);
+	failLow = MemoryTest_LanesAt(DDR_DRIFT_SCRATCH, DDR_DRIFT_WORDS);
+
+	for(bank=0;bank<MAX_SLICE;bank++)
+		val[bank] = DDR_DriftCenter[bank] + DDR_DRIFT_MARGIN;
+	DDR_DriftSetReadDelay(val);
+	failHigh = MemoryTest_LanesAt(DDR_DRIFT_SCRATCH, DDR_DRIFT_WORDS);
+
+	for(bank=0;bank<MAX_SLICE;bank++)
+	{
+		int low = (failLow >> bank) & 1;
+		int high = (failHigh >> bank) & 1;
+
+		if(low && high)
+		{
+			DDR_DriftLost++;
+		}
+		else if(low && (DDR_DriftCenter[bank] + DDR_DRIFT_MARGIN + DDR_DRIFT_STEP < READ_LEVEL_END))
+		{
+			DDR_DriftCenter[bank] += DDR_DRIFT_STEP;
+			nudged |= 1 << bank;
+		}
+		else if(high && (DDR_DriftCenter[bank] - DDR_DRIFT_MARGIN - DDR_DRIFT_STEP >= READ_LEVEL_START))
+		{
+			DDR_DriftCenter[bank] -= DDR_DRIFT_STEP;
+			nudged |= 1 << bank;
+		}
+
+		val[bank] = DDR_DriftCenter[bank];
+	}
+
+	DDR_DriftSetReadDelay(val);
+
+	if(mie) csr_set(mstatus, MSTATUS_MIE);
+	DDR_DRIFT_RESUME();
+
+	if(nudged)
+		DDR_DriftNudges++;
+
+	return nudged;
+}
+
+#ifdef INC_FREERTOS_H
+/*******************************************************************************
+*
+* @brief FreeRTOS task running DDR_DriftTrack every DDR_DRIFT_PERIOD_MS. It is
+*        meant to run at a low priority, just above the idle task. It has to be
+*        the only user of the DDR calibration I2C channel.
+*
+* @param arg  Unused.
+*
+******************************************************************************/
+void DDR_DriftTask(void *arg)
+{
+	(void)arg;
+
+	DDR_DriftInit();
+
+	for(;;)
+	{
+		DDR_DriftTrack();
+		vTaskDelay(pdMS_TO_TICKS(DDR_DRIFT_PERIOD_MS));
+	}
+}
+#endif
+#endif
+
+#ifdef DDR_CALI_PERSIST
+#include "spiFlash.h"
+
+//**************************Calibration Record************************
+#ifndef DDR_CALI_FLASH_SPI
+#define DDR_CALI_FLASH_SPI		SYSTEM_SPI_0_IO_CTRL
+#endif
+#ifndef DDR_CALI_FLASH_CS
+#define DDR_CALI_FLASH_CS		0
+#endif
+#ifndef DDR_CALI_FLASH_ADDR
+#define DDR_CALI_FLASH_ADDR		0x003F0000	//dedicated 4 KB sector, away from the bitstream and user software
+#endif
+#ifndef DDR_CALI_BOARD_ID
+#define DDR_CALI_BOARD_ID		0			//set per board/assembly variant, a change forces a new training
+#endif
+#ifndef DDR_CALI_TEMPERATURE
+#define DDR_CALI_TEMPERATURE()	0			//hook to a temperature sensor (any unit), 0 disables the check
+#endif
+#define DDR_CALI_TEMP_DELTA		10			//retrain when the temperature moved more than this since the training
+
+#define DDR_CALI_MAGIC			0x44444331	//"DDC1"
+#define DDR_CALI_VERSION		1
+#define DDR_CALI_REGS			((3*MAX_SLICE)+1)	//per slice 0x00, 0x02, 0x05 then 0x45
+//********************************************************************
+
+typedef struct {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t boardId;
+	int32_t  temperature;
+	uint32_t regs[DDR_CALI_REGS];
+	uint32_t crc;
+} DDR_CaliRecord;
+
+/*******************************************************************************
+*
+* @brief This function returns the DDR controller address of a register saved
+*        in the calibration record.
+*
+* @param idx   Index inside DDR_CaliRecord.regs.
+*
+* @return      Register address.
+*
+******************************************************************************/
+uint32_t DDR_CaliRegAddr(int idx)
+{
+	static const uint8_t offset[3] = {0x00, 0x02, 0x05};
+
+	if(idx == (3*MAX_SLICE))
+		return 0x45;
+
+	return (0x10 * (idx / 3)) + offset[idx % 3];
+}
+
+/*******************************************************************************
+*
+* @brief This function computes the CRC-32 (IEEE 802.3) of a buffer.
+*
+* @param data  Buffer.
+* @param size  Size in bytes.
+*
+* @return      CRC-32 value.
+*
+******************************************************************************/
+uint32_t DDR_CaliCrc32(const uint8_t *data, uint32_t size)
+{
+	uint32_t crc = 0xFFFFFFFF;
+
+	for(uint32_t i = 0; i < size; i++)
+	{
+		crc ^= data[i];
+		for(int n = 0; n < 8; n++)
+			crc = (crc >> 1) ^ (0xEDB88320 & -(crc & 1));
+	}
+
+	return ~crc;
+}
+
+/*******************************************************************************
+*
+* @brief This function saves the values currently programmed in the DDR
+*        controller as the calibration record in SPI flash.
+*
+******************************************************************************/
+void DDR_CaliSave(void)
+{
+	DDR_CaliRecord rec;
+
+	rec.magic = DDR_CALI_MAGIC;
+	rec.version = DDR_CALI_VERSION;
+	rec.boardId = DDR_CALI_BOARD_ID;
+	rec.temperature = DDR_CALI_TEMPERATURE();
+
+	for(int i = 0; i < DDR_CALI_REGS; i++)
+		rec.regs[i] = ReadAddrData(DDR_CaliRegAddr(i));
+
+	rec.crc = DDR_CaliCrc32((uint8_t *)&rec, sizeof(rec) - sizeof(rec.crc));
+
+	spiFlash_erase4k(DDR_CALI_FLASH_SPI, DDR_CALI_FLASH_CS, DDR_CALI_FLASH_ADDR);
+	spiFlash_m2f(DDR_CALI_FLASH_SPI, DDR_CALI_FLASH_CS, DDR_CALI_FLASH_ADDR, (u32)&rec, sizeof(rec));
+}
+
+/*******************************************************************************
+*
+* @brief This function restores the calibration record from SPI flash and checks
+*        the result with a short memory test.
+*
+* @return      Returns 1 if the record was applied and the memory test passed,
+*              0 if the record is missing, corrupted, outdated (version, board
+*              ID or temperature) or if the memory test failed.
+*
+******************************************************************************/
+int DDR_CaliRestore(void)
+{
+	DDR_CaliRecord rec;
+	int32_t temperature = DDR_CALI_TEMPERATURE();
+
+	spiFlash_f2m(DDR_CALI_FLASH_SPI, DDR_CALI_FLASH_CS, DDR_CALI_FLASH_ADDR, (u32)&rec, sizeof(rec));
+
+	if((rec.magic != DDR_CALI_MAGIC) || (rec.version != DDR_CALI_VERSION))
+		return 0;
+
+	if(rec.crc != DDR_CaliCrc32((uint8_t *)&rec, sizeof(rec) - sizeof(rec.crc)))
+		return 0;
+
+	if(rec.boardId != DDR_CALI_BOARD_ID)
+		return 0;
+
+	if((temperature - rec.temperature > DDR_CALI_TEMP_DELTA) || (rec.temperature - temperature > DDR_CALI_TEMP_DELTA))
+		return 0;
+
+	for(int i = 0; i < DDR_CALI_REGS; i++)
+	{
+		#ifndef LPDDR3_DEVICE
+		if(i == (3*MAX_SLICE))	break;
+		#endif
+		WriteDDR_Addr_Data(DDR_CaliRegAddr(i), rec.regs[i]);
+	}
+
+	ctrl_update_req();
+
+	//The lane test invalidates each burst before the readback, so that a
+	//line left cached by the probes can't hide a bad calibration
+	return MemoryTest_TrainLanes(128*16) == 0;
+}
+
+/*******************************************************************************
+*
+* @brief This function brings up the DDR access timing at boot. The calibration
+*        record saved in SPI flash is applied when it is still valid, otherwise
+*        the full training is run and its result saved for the next boot.
+*
+******************************************************************************/
+void DDR_CaliBoot(void)
+{
+	spiFlash_init(DDR_CALI_FLASH_SPI, DDR_CALI_FLASH_CS);
+	spiFlash_wake(DDR_CALI_FLASH_SPI, DDR_CALI_FLASH_CS);
+	spiFlash_exit4ByteAddr(DDR_CALI_FLASH_SPI, DDR_CALI_FLASH_CS);
+
+	DDR_CaliI2cInit();
+	DDR_CaliCacheInvalidate();
+
+	if(DDR_CaliRestore())
+	{
+		print("DDR calibration restored\n\r");
+		return;
+	}
+
+	DDR_AccessTimingCali();
+
+	if(MemoryTest_TrainLanes(128*16) == 0)
+	{
+		DDR_CaliSave();
+		print("DDR calibration saved\n\r");
+	}
+}
+#endif
+
 #endif /* SRC_DDRCALI_I2C_H_ */
@@ -0,0 +1,539 @@
+/*******************************************************************************
+*
+* @file ddrMemTest.h
+*
+* @brief Header file for the DDR memory test and bandwidth benchmark suite. The
+*        tests run on a window of the DDR (DDR_SADDR..DDR_EADDR) and report the
+*        first failing address. The benchmarks report STREAM-like bandwidth in
+*        MB/s and the dependent load latency in ns, both timed with mcycle.
+*
+*        Every loop works on 32-bit aligned words and is unrolled by
+*        DDR_MEMTEST_UNROLL words, the data cache is invalidated before each
+*        verification pass so that the values really come from the DDR.
+*
+* Functions:
+* - DDR_TestWalkingBits: Walking ones and walking zeros on the data bus.
+* - DDR_TestAddressInAddress: Each word holds its own address, then its complement.
+* - DDR_TestMovingInversions: March test with a pattern and its complement.
+* - DDR_TestLfsr: Pseudo random pattern write and verify.
+* - DDR_BenchStream: Copy, scale, add and triad bandwidth.
+* - DDR_BenchLatency: Pointer chase latency on a random cyclic chain.
+* - DDR_BenchInvalidate: Cost of a DMA completion range invalidate against a
+*                        whole data cache invalidate.
+* - DDR_MemTestSuite: Runs all the tests and benchmarks and prints the results.
+*
+******************************************************************************/
+#pragma once
+
+#include "bsp.h"
+#include "riscv.h"
+#include "vexriscv.h"
+
+//**************************Main Control******************************
+#ifndef DDR_SADDR
+#define DDR_SADDR				0x01300000	//same window as sdHostDemo.h
+#define DDR_EADDR				0xf7ffffff
+#endif
+
+#define DDR_MEMTEST_BASE		DDR_SADDR
+#define DDR_MEMTEST_SIZE		0x00100000	//bytes tested, has to fit in DDR_SADDR..DDR_EADDR
+#define DDR_MEMTEST_CPU_HZ		SYSTEM_CLINT_HZ	//mcycle frequency
+#define DDR_MEMTEST_REPEAT		4			//benchmark runs, the best one is reported
+#define DDR_STREAM_WORDS		0x10000		//words per STREAM array, well above the data cache size
+#define DDR_CHASE_STRIDE		64			//bytes between two pointer chase nodes
+#define DDR_CHASE_NODES			0x4000
+#define DDR_CHASE_STEPS			0x10000
+#define DDR_INVAL_HOT_BYTES		2048		//working set kept in the data cache by the application
+#define DDR_INVAL_MAX_BYTES		4096		//largest DMA buffer benchmarked
+//********************************************************************
+
+#define DDR_MEMTEST_UNROLL		8
+#define DDR_MEMTEST_WORDS		((DDR_MEMTEST_SIZE / 4) & ~(DDR_MEMTEST_UNROLL - 1))
+
+typedef struct {
+	uint32_t errors;
+	uint32_t addr;		//first failing address
+	uint32_t expected;
+	uint32_t actual;
+} DDR_MemTestResult;
+
+/*******************************************************************************
+*
+* @brief This function records a mismatch, keeping the first failing address.
+*
+******************************************************************************/
+static inline void DDR_MemTestFail(DDR_MemTestResult *res, volatile uint32_t *addr, uint32_t expected, uint32_t actual)
+{
+	if(res->errors++ == 0)
+	{
+		res->addr = (uint32_t)addr;
+		res->expected = expected;
+		res->actual = actual;
+	}
+}
+
+#define DDR_CHECK(res, p, i, exp)	do { uint32_t v_ = (p)[i]; if(v_ != (exp)) DDR_MemTestFail(res, &(p)[i], exp, v_); } while(0)
+
+/*******************************************************************************
+*
+* @brief This function walks a single one, then a single zero, across the 32
+*        data bits of a few words spread over the window.
+*
+* @param base  Tested window base address.
+* @param words Tested window size in 32-bit words.
+* @param res   Result, accumulated.
+*
+******************************************************************************/
+void DDR_TestWalkingBits(uint32_t base, uint32_t words, DDR_MemTestResult *res)
+{
+	volatile uint32_t *p;
+	uint32_t pattern;
+
+	for(uint32_t spot = 0; spot < 4; spot++)
+	{
+		p = (volatile uint32_t *)base + (words / 4) * spot;
+
+		for(int bit = 0; bit < 32; bit++)
+		{
+			pattern = 1u << bit;
+			p[0] = pattern;
+			p[1] = ~pattern;
+			data_cache_invalidate_all();
+			DDR_CHECK(res, p, 0, pattern);
+			DDR_CHECK(res, p, 1, ~pattern);
+		}
+	}
+}
+
+/*******************************************************************************
+*
+* @brief This function writes each word with its own address, then with the
+*        complement of its address, and verifies both. It catches shorted or
+*        stuck address lines and aliasing.
+*
+* @param base  Tested window base address.
+* @param words Tested window size in 32-bit words, multiple of DDR_MEMTEST_UNROLL.
+* @param res   Result, accumulated.
+*
+******************************************************************************/
+void DDR_TestAddressInAddress(uint32_t base, uint32_t words, DDR_MemTestResult *res)
+{
+	volatile uint32_t *p = (volatile uint32_t *)base;
+	uint32_t a;
+
+	for(uint32_t inv = 0; inv < 2; inv++)
+	{
+		uint32_t mask = inv ? 0xFFFFFFFF : 0;
+
+		for(uint32_t i = 0; i < words; i += DDR_MEMTEST_UNROLL)
+		{
+			a = (uint32_t)&p[i];
+			p[i+0] = (a +  0) ^ mask;
+			p[i+1] = (a +  4) ^ mask;
+			p[i+2] = (a +  8) ^ mask;
+			p[i+3] = (a + 12) ^ mask;
+			p[i+4] = (a + 16) ^ mask;
+			p[i+5] = (a + 20) ^ mask;
+			p[i+6] = (a + 24) ^ mask;
+			p[i+7] = (a + 28) ^ mask;
+		}
+
+		data_cache_invalidate_all();
+
+		for(uint32_t i = 0; i < words; i += DDR_MEMTEST_UNROLL)
+		{
+			a = (uint32_t)&p[i];
+			DDR_CHECK(res, p, i+0, (a +  0) ^ mask);
+			DDR_CHECK(res, p, i+1, (a +  4) ^ mask);
+			DDR_CHECK(res, p, i+2, (a +  8) ^ mask);
+			DDR_CHECK(res, p, i+3, (a + 12) ^ mask);
+			DDR_CHECK(res, p, i+4, (a + 16) ^ mask);
+			DDR_CHECK(res, p, i+5, (a + 20) ^ mask);
+			DDR_CHECK(res, p, i+6, (a + 24) ^ mask);
+			DDR_CHECK(res, p, i+7, (a + 28) ^ mask);
+		}
+	}
+}
+
+/*******************************************************************************
+*
+* @brief This function runs a moving inversions march: fill with the pattern,
+*        then ascending read pattern / write complement, then descending read
+*        complement / write pattern, and a final read.
+*
+* @param base    Tested window base address.
+* @param words   Tested window size in 32-bit words, multiple of DDR_MEMTEST_UNROLL.
+* @param pattern Background pattern.
+* @param res     Result, accumulated.
+*
+******************************************************************************/
+void DDR_TestMovingInversions(uint32_t base, uint32_t words, uint32_t pattern, DDR_MemTestResult *res)
+{
+	volatile uint32_t *p = (volatile uint32_t *)base;
+	uint32_t inv = ~pattern;
+
+	for(uint32_t i = 0; i < words; i += DDR_MEMTEST_UNROLL)
+	{
+		p[i+0] = pattern; p[i+1] = pattern; p[i+2] = pattern; p[i+3] = pattern;
+		p[i+4] = pattern; p[i+5] = pattern; p[i+6] = pattern; p[i+7] = pattern;
+	}
+
+	data_cache_invalidate_all();
+
+	for(uint32_t i = 0; i < words; i++)
+	{
+		DDR_CHECK(res, p, i, pattern);
+		p[i] = inv;
+	}
+
+	data_cache_invalidate_all();
+
+	for(uint32_t i = words; i-- > 0;)
+	{
+		DDR_CHECK(res, p, i, inv);
+		p[i] = pattern;
+	}
+
+	data_cache_invalidate_all();
+
+	for(uint32_t i = 0; i < words; i += DDR_MEMTEST_UNROLL)
+	{
+		DDR_CHECK(res, p, i+0, pattern); DDR_CHECK(res, p, i+1, pattern);
+		DDR_CHECK(res, p, i+2, pattern); DDR_CHECK(res, p, i+3, pattern);
+		DDR_CHECK(res, p, i+4, pattern); DDR_CHECK(res, p, i+5, pattern);
+		DDR_CHECK(res, p, i+6, pattern); DDR_CHECK(res, p, i+7, pattern);
+	}
+}
+
+/*******************************************************************************
+*
+* @brief This function returns the next value of a 32-bit xorshift generator.
+*
+******************************************************************************/
+static inline uint32_t DDR_Xorshift(uint32_t x)
+{
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	return x;
+}
+
+/*******************************************************************************
+*
+* @brief This function fills the window with a pseudo random sequence and
+*        verifies it, exercising random data transitions on every bit.
+*
+* @param base  Tested window base address.
+* @param words Tested window size in 32-bit words, multiple of DDR_MEMTEST_UNROLL.
+* @param seed  Non zero seed.
+* @param res   Result, accumulated.
+*
+******************************************************************************/
+void DDR_TestLfsr(uint32_t base, uint32_t words, uint32_t seed, DDR_MemTestResult *res)
+{
+	volatile uint32_t *p = (volatile uint32_t *)base;
+	uint32_t x = seed;
+
+	for(uint32_t i = 0; i < words; i += DDR_MEMTEST_UNROLL)
+	{
+		x = DDR_Xorshift(x); p[i+0] = x;
+		x = DDR_Xorshift(x); p[i+1] = x;
+		x = DDR_Xorshift(x); p[i+2] = x;
+		x = DDR_Xorshift(x); p[i+3] = x;
+		x = DDR_Xorshift(x); p[i+4] = x;
+		x = DDR_Xorshift(x); p[i+5] = x;
+		x = DDR_Xorshift(x); p[i+6] = x;
+		x = DDR_Xorshift(x); p[i+7] = x;
+	}
+
+	data_cache_invalidate_all();
+
+	x = seed;
+	for(uint32_t i = 0; i < words; i += DDR_MEMTEST_UNROLL)
+	{
+		x = DDR_Xorshift(x); DDR_CHECK(res, p, i+0, x);
+		x = DDR_Xorshift(x); DDR_CHECK(res, p, i+1, x);
+		x = DDR_Xorshift(x); DDR_CHECK(res, p, i+2, x);
+		x = DDR_Xorshift(x); DDR_CHECK(res, p, i+3, x);
+		x = DDR_Xorshift(x); DDR_CHECK(res, p, i+4, x);
+		x = DDR_Xorshift(x); DDR_CHECK(res, p, i+5, x);
+		x = DDR_Xorshift(x); DDR_CHECK(res, p, i+6, x);
+		x = DDR_Xorshift(x); DDR_CHECK(res, p, i+7, x);
+	}
+}
+
+/*******************************************************************************
+*
+* @brief This function converts a byte count moved in a cycle count into MB/s.
+*
+******************************************************************************/
+static inline uint32_t DDR_MBps(uint32_t bytes, uint32_t cycles)
+{
+	return (uint32_t)(((uint64_t)bytes * DDR_MEMTEST_CPU_HZ) / (cycles ? cycles : 1) / 1000000);
+}
+
+typedef struct {
+	uint32_t copy;		//MB/s
+	uint32_t scale;
+	uint32_t add;
+	uint32_t triad;
+} DDR_StreamResult;
+
+/*******************************************************************************
+*
+* @brief This function measures the STREAM kernels on three arrays of words
+*        placed back to back from base: copy c=a, scale b=s*c, add c=a+b and
+*        triad a=b+s*c. Each kernel keeps its best run over DDR_MEMTEST_REPEAT.
+*
+* @param base  Base address of the three arrays (3 * words * 4 bytes).
+* @param words Words per array, multiple of DDR_MEMTEST_UNROLL.
+* @param res   Bandwidth of each kernel, in MB/s.
+*
+******************************************************************************/
+void DDR_BenchStream(uint32_t base, uint32_t words, DDR_StreamResult *res)
+{
+	uint32_t *a = (uint32_t *)base;
+	uint32_t *b = a + words;
+	uint32_t *c = b + words;
+	const uint32_t s = 3;
+	uint32_t best[4] = {0xFFFFFFFF, 0xFFFFFFFF, 0xFFFFFFFF, 0xFFFFFFFF};
+	uint32_t t, i;
+
+	for(i = 0; i < words; i++)
+	{
+		a[i] = 1;
+		b[i] = 2;
+		c[i] = 0;
+	}
+
+	for(int r = 0; r < DDR_MEMTEST_REPEAT; r++)
+	{
+		data_cache_invalidate_all();
+		t = csr_read(mcycle);
+		for(i = 0; i < words; i += DDR_MEMTEST_UNROLL)
+		{
+			c[i+0] = a[i+0]; c[i+1] = a[i+1]; c[i+2] = a[i+2]; c[i+3] = a[i+3];
+			c[i+4] = a[i+4]; c[i+5] = a[i+5]; c[i+6] = a[i+6]; c[i+7] = a[i+7];
+		}
+		t = csr_read(mcycle) - t;
+		if(t < best[0]) best[0] = t;
+
+		data_cache_invalidate_all();
+		t = csr_read(mcycle);
+		for(i = 0; i < words; i += DDR_MEMTEST_UNROLL)
+		{
+			b[i+0] = s*c[i+0]; b[i+1] = s*c[i+1]; b[i+2] = s*c[i+2]; b[i+3] = s*c[i+3];
+			b[i+4] = s*c[i+4]; b[i+5] = s*c[i+5]; b[i+6] = s*c[i+6]; b[i+7] = s*c[i+7];
+		}
+		t = csr_read(mcycle) - t;
+		if(t < best[1]) best[1] = t;
+
+		data_cache_invalidate_all();
+		t = csr_read(mcycle);
+		for(i = 0; i < words; i += DDR_MEMTEST_UNROLL)
+		{
+			c[i+0] = a[i+0]+b[i+0]; c[i+1] = a[i+1]+b[i+1]; c[i+2] = a[i+2]+b[i+2]; c[i+3] = a[i+3]+b[i+3];
+			c[i+4] = a[i+4]+b[i+4]; c[i+5] = a[i+5]+b[i+5]; c[i+6] = a[i+6]+b[i+6]; c[i+7] = a[i+7]+b[i+7];
+		}
+		t = csr_read(mcycle) - t;
+		if(t < best[2]) best[2] = t;
+
+		data_cache_invalidate_all();
+		t = csr_read(mcycle);
+		for(i = 0; i < words; i += DDR_MEMTEST_UNROLL)
+		{
+			a[i+0] = b[i+0]+s*c[i+0]; a[i+1] = b[i+1]+s*c[i+1]; a[i+2] = b[i+2]+s*c[i+2]; a[i+3] = b[i+3]+s*c[i+3];
+			a[i+4] = b[i+4]+s*c[i+4]; a[i+5] = b[i+5]+s*c[i+5]; a[i+6] = b[i+6]+s*c[i+6]; a[i+7] = b[i+7]+s*c[i+7];
+		}
+		t = csr_read(mcycle) - t;
+		if(t < best[3]) best[3] = t;
+	}
+
+	res->copy  = DDR_MBps(2 * 4 * words, best[0]);
+	res->scale = DDR_MBps(2 * 4 * words, best[1]);
+	res->add   = DDR_MBps(3 * 4 * words, best[2]);
+	res->triad = DDR_MBps(3 * 4 * words, best[3]);
+}
+
+/*******************************************************************************
+*
+* @brief This function measures the dependent load latency. The nodes, spaced
+*        by stride bytes, are linked into a single random cycle (Sattolo
+*        shuffle) so that neither the cache nor the DDR page hits help, then
+*        the chain is followed steps times.
+*
+* @param base   Base address of the nodes (nodes * stride bytes).
+* @param nodes  Number of nodes.
+* @param stride Bytes between two nodes, multiple of 4.
+* @param steps  Number of loads, multiple of DDR_MEMTEST_UNROLL.
+*
+* @return Average latency of a load, in tenths of ns.
+*
+******************************************************************************/
+uint32_t DDR_BenchLatency(uint32_t base, uint32_t nodes, uint32_t stride, uint32_t steps)
+{
+	uint32_t i, j, tmp, x = 0x2545F491;
+	uint32_t t;
+	volatile uint32_t *node;
+	uint32_t p;
+
+	//Slot i holds the index of the node following node i
+	for(i = 0; i < nodes; i++)
+		*(uint32_t *)(base + i * stride) = i;
+
+	for(i = nodes - 1; i > 0; i--)
+	{
+		x = DDR_Xorshift(x);
+		j = x % i;
+		tmp = *(uint32_t *)(base + i * stride);
+		*(uint32_t *)(base + i * stride) = *(uint32_t *)(base + j * stride);
+		*(uint32_t *)(base + j * stride) = tmp;
+	}
+
+	for(i = 0; i < nodes; i++)
+		*(uint32_t *)(base + i * stride) = base + *(uint32_t *)(base + i * stride) * stride;
+
+	data_cache_invalidate_all();
+
+	p = base;
+	t = csr_read(mcycle);
+	for(i = 0; i < steps; i += DDR_MEMTEST_UNROLL)
+	{
+		node = (volatile uint32_t *)p; p = *node;
+		node = (volatile uint32_t *)p; p = *node;
+		node = (volatile uint32_t *)p; p = *node;
+		node = (volatile uint32_t *)p; p = *node;
+		node = (volatile uint32_t *)p; p = *node;
+		node = (volatile uint32_t *)p; p = *node;
+		node = (volatile uint32_t *)p; p = *node;
+		node = (volatile uint32_t *)p; p = *node;
+	}
+	t = csr_read(mcycle) - t;
+
+	return (uint32_t)(((uint64_t)t * 10000000000ull) / DDR_MEMTEST_CPU_HZ / steps);
+}
+
+/*******************************************************************************
+*
+* @brief This function measures what a DMA completion costs the CPU when it
+*        invalidates only the destination buffer (data_cache_invalidate_range)
+*        instead of the whole data cache. The application working set is hot
+*        in the cache before the completion and read again right after it, so
+*        the reload of the lines lost by the whole invalidate is accounted.
+*
+* @param base  Base address of the working set, followed by the DMA buffer.
+* @param bytes Size of the DMA buffer.
+* @param range Best cycle count with the range invalidate.
+* @param all   Best cycle count with the whole invalidate.
+*
+******************************************************************************/
+void DDR_BenchInvalidate(uint32_t base, uint32_t bytes, uint32_t *range, uint32_t *all)
+{
+	volatile uint32_t *hot = (volatile uint32_t *)base;
+	volatile uint32_t *dst = (volatile uint32_t *)(base + DDR_INVAL_HOT_BYTES);
+	uint32_t best[2] = {0xFFFFFFFF, 0xFFFFFFFF};
+	uint32_t t, i, r, m;
+
+	for(r = 0; r < DDR_MEMTEST_REPEAT; r++)
+	{
+		for(m = 0; m < 2; m++)
+		{
+			for(i = 0; i < DDR_INVAL_HOT_BYTES / 4; i++) (void)hot[i];
+			for(i = 0; i < bytes / 4; i++) (void)dst[i];
+
+			t = csr_read(mcycle);
+			if(m == 0)
+			{
+				data_cache_invalidate_range((const void *)dst, bytes);
+			}
+			else
+			{
+				data_cache_invalidate_all();
+			}
+			for(i = 0; i < DDR_INVAL_HOT_BYTES / 4; i += DATA_CACHE_LINE_BYTES / 4) (void)hot[i];
+			t = csr_read(mcycle) - t;
+
+			if(t < best[m]) best[m] = t;
+		}
+	}
+
+	*range = best[0];
+	*all = best[1];
+}
+
+/*******************************************************************************
+*
+* @brief This function prints the outcome of a test.
+*
+******************************************************************************/
+void DDR_MemTestReport(const char *name, DDR_MemTestResult *res)
+{
+	if(res->errors == 0)
+	{
+		bsp_printf("%s: pass\n\r", name);
+	}
+	else
+	{
+		bsp_printf("%s: %d errors, first at 0x%x expected 0x%x read 0x%x\n\r",
+				name, res->errors, res->addr, res->expected, res->actual);
+	}
+}
+
+/*******************************************************************************
+*
+* @brief This function runs all the tests on DDR_MEMTEST_SIZE bytes from
+*        DDR_MEMTEST_BASE, then the benchmarks, and prints the results.
+*
+* @return Total number of errors.
+*
+******************************************************************************/
+uint32_t DDR_MemTestSuite(void)
+{
+	DDR_MemTestResult res;
+	DDR_StreamResult stream;
+	uint32_t errors = 0;
+	uint32_t latency;
+	uint32_t size, range, all;
+
+	bsp_printf("DDR test 0x%x - 0x%x\n\r", DDR_MEMTEST_BASE, DDR_MEMTEST_BASE + DDR_MEMTEST_WORDS * 4 - 1);
+
+	res.errors = 0;
+	DDR_TestWalkingBits(DDR_MEMTEST_BASE, DDR_MEMTEST_WORDS, &res);
+	DDR_MemTestReport("Walking ones/zeros", &res);
+	errors += res.errors;
+
+	res.errors = 0;
+	DDR_TestAddressInAddress(DDR_MEMTEST_BASE, DDR_MEMTEST_WORDS, &res);
+	DDR_MemTestReport("Address in address", &res);
+	errors += res.errors;
+
+	res.errors = 0;
+	DDR_TestMovingInversions(DDR_MEMTEST_BASE, DDR_MEMTEST_WORDS, 0x00000000, &res);
+	DDR_TestMovingInversions(DDR_MEMTEST_BASE, DDR_MEMTEST_WORDS, 0x55555555, &res);
+	DDR_TestMovingInversions(DDR_MEMTEST_BASE, DDR_MEMTEST_WORDS, 0x33333333, &res);
+	DDR_TestMovingInversions(DDR_MEMTEST_BASE, DDR_MEMTEST_WORDS, 0x0F0F0F0F, &res);
+	DDR_MemTestReport("Moving inversions", &res);
+	errors += res.errors;
+
+	res.errors = 0;
+	DDR_TestLfsr(DDR_MEMTEST_BASE, DDR_MEMTEST_WORDS, 0x123ABC99, &res);
+	DDR_TestLfsr(DDR_MEMTEST_BASE, DDR_MEMTEST_WORDS, 0xDEADBEEF, &res);
+	DDR_MemTestReport("LFSR", &res);
+	errors += res.errors;
+
+	DDR_BenchStream(DDR_MEMTEST_BASE, DDR_STREAM_WORDS, &stream);
+	bsp_printf("STREAM copy %d MB/s, scale %d MB/s, add %d MB/s, triad %d MB/s\n\r",
+			stream.copy, stream.scale, stream.add, stream.triad);
+
+	latency = DDR_BenchLatency(DDR_MEMTEST_BASE, DDR_CHASE_NODES, DDR_CHASE_STRIDE, DDR_CHASE_STEPS);
+	bsp_printf("Load latency %d.%d ns\n\r", latency / 10, latency % 10);
+
+	for(size = 64; size <= DDR_INVAL_MAX_BYTES; size <<= 2)
+	{
+		DDR_BenchInvalidate(DDR_MEMTEST_BASE, size, &range, &all);
+		bsp_printf("DMA completion %d B: range invalidate %d cycles, whole invalidate %d cycles\n\r",
+				size, range, all);
+	}
+
+	return errors;
+}
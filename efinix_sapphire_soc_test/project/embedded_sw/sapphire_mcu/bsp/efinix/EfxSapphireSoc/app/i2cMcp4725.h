@@ -11,3 +11,7 @@
 #define SYSTEM_I2C_0_IO_CTRL
 #define PLIC_I2C_INTERRUPT SYSTEM_PLIC_SYSTEM_I2C_0_IO_INTERRUPT
 #define CORE_HZ SYSTEM_CLINT_HZ
+
+#define MCP4725_ADDRESS MCP4725_ADDRESS_DEFAULT
+#define MCP4725_TIMER_CTRL SYSTEM_USER_TIMER_0_CTRL
+#define MCP4725_TIMER_INTERRUPT SYSTEM_PLIC_SYSTEM_USER_TIMER_0_INTERRUPTS_0
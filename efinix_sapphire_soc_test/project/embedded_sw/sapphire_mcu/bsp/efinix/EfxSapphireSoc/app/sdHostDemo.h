@@ -68,6 +68,8 @@
 #define MAX_BLK_BUF             0x100
 #define DATA_WIDTH              0x2 //0x0 : 1-bit mode; 
                                     //0x2 : 4-bit mode;
+//#define SD_PIO_LEGACY_PACING      //Non DMA reads paced by 1us per word, as before, for throughput comparison
+//#define SD_TRACE_EN               //Record the SD commands into a RAM ring, see sd_trace.h
 
 /************************** INTC Header File *****************************/
 #define INT_ENABLE                0xffffffcf
@@ -39,7 +39,8 @@
 * - dmasg_interrupt_pending_clear: Clears pending interrupts for a DMA channel.
 * - dmasg_busy: Checks the status of a DMA channel.
 * - dmasg_buffer: Specifies the buffer mapping of a DMA channel.
-* - dmasg_priority: Sets the priority and weight of a DMA channel.
+* - dmasg_priority: Sets the priority of a DMA channel.
+* - dmasg_priority_weight: Sets the priority and weight of a DMA channel.
 * - dmasg_progress_bytes: Retrieves the number of bytes transferred for the current descriptor.
 *
 ******************************************************************************/
@@ -71,6 +72,7 @@
 #define DMASG_CHANNEL_STATUS_LINKED_LIST_START                  BIT_4
 #define DMASG_CHANNEL_FIFO                                      0x40
 #define DMASG_CHANNEL_PRIORITY                                  0x44
+#define DMASG_CHANNEL_PRIORITY_WEIGHT_SHIFT                     8
 #define DMASG_CHANNEL_INTERRUPT_ENABLE                          0x50
 #define DMASG_CHANNEL_INTERRUPT_PENDING                         0x54
 #define DMASG_CHANNEL_PROGRESS_BYTES                            0x60
@@ -342,12 +344,11 @@ static void dmasg_linked_list_sg_start(u32 base, u32 channel){
 
 /*******************************************************************************
 *
-* @brief This function sets the priority and weight of a DMA channel.
+* @brief This function sets the priority of a DMA channel.
 *
 * @param base: Base address of the DMA controller
 * @param channel: DMA channel ID
 * @param priority: Priority of the channel
-* @param weight: Weight of the channel
 *
 *******************************************************************************/  
     static void dmasg_priority(u32 base, u32 channel, u32 priority){
@@ -355,6 +356,23 @@ static void dmasg_linked_list_sg_start(u32 base, u32 channel){
         write_u32(priority,  ca+DMASG_CHANNEL_PRIORITY);
     }
 
+/*******************************************************************************
+*
+* @brief This function sets the priority and weight of a DMA channel.
+*
+* @param base: Base address of the DMA controller
+* @param channel: DMA channel ID
+* @param priority: Priority of the channel, higher priorities are served first
+* @param weight: Number of extra bursts granted in a row to the channel
+*                before the arbitration moves on to the next channel of the
+*                same priority
+*
+*******************************************************************************/
+    static void dmasg_priority_weight(u32 base, u32 channel, u32 priority, u32 weight){
+        u32 ca = dmasg_ca(base, channel);
+        write_u32(priority | weight << DMASG_CHANNEL_PRIORITY_WEIGHT_SHIFT,  ca+DMASG_CHANNEL_PRIORITY);
+    }
+
 /*******************************************************************************
 *
 * @brief This function snoops how many bytes were transferred for the current descriptor.
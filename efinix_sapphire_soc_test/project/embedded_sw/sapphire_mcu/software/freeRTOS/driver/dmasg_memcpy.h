@@ -0,0 +1,374 @@
+/*******************************************************************************
+*
+* @file dmasg_memcpy.h
+*
+* @brief Header file for an asynchronous memcpy/memset service running on dmasg
+*        memory to memory channels. Requests return a handle which can be
+*        polled or waited on. Each channel owns a request queue, so several
+*        copies can be outstanding at once, the least loaded channel being
+*        picked for each new request.
+*
+*        Requests smaller than a threshold are executed by the CPU right away,
+*        as the DMA setup cost dominates small transfers. The threshold can be
+*        measured at boot with dma_copy_calibrate.
+*
+*        A request is executed as one or several rounds of at most
+*        DMA_COPY_ROUND descriptors taken from a dmasg_pool. A memset copies a
+*        DMA_MEMSET_BLOCK bytes pattern block of the channel repeatedly.
+*
+*        Progress is made either by dma_copy_poll from the application or by
+*        dma_copy_isr from the channel completion interrupt. The thread side
+*        (submit, poll, wait) masks MIE while it touches a queue, so the two
+*        never advance a queue nor start a channel at the same time.
+*
+* Functions:
+* - dma_copy_init: Initializes the service over a set of DMA channels.
+* - dma_memcpy_async: Queues a memory copy.
+* - dma_memset_async: Queues a memory fill.
+* - dma_copy_done: Checks if a request completed.
+* - dma_copy_wait: Waits for the completion of a request.
+* - dma_copy_poll: Makes the queues progress.
+* - dma_copy_isr: Makes a channel progress, to be called from its interrupt.
+* - dma_copy_calibrate: Measures the CPU / DMA size threshold.
+*
+******************************************************************************/
+#pragma once
+
+#include <string.h>
+#include "type.h"
+#include "io.h"
+#include "riscv.h"
+#include "vexriscv.h"
+#include "dmasg.h"
+#include "dmasg_pool.h"
+
+#define DMA_COPY_MAX_CHANNELS           4       // up to 7, encoded in the handle
+#define DMA_COPY_QUEUE_DEPTH            8       // requests per channel, power of two
+#define DMA_COPY_POOL_SIZE              64      // descriptors shared by all the channels
+#define DMA_COPY_ROUND                  16      // maximum descriptors per round
+#define DMA_COPY_BURST                  64      // bytes per burst
+#define DMA_MEMSET_BLOCK                1024    // memset pattern block per channel
+#define DMA_COPY_THRESHOLD_DEFAULT      1024    // bytes, until dma_copy_calibrate is called
+
+#define DMA_HANDLE_DONE                 0       // handle of a request completed by the CPU
+
+    typedef u32 dma_handle;
+
+    struct dma_copy_request {
+        u32 dst;
+        u32 src;
+        u32 bytes;
+        u32 value;
+        u32 fill;
+    };
+
+    struct dma_copy_channel {
+        // Pattern of the running memset, read by the DMA
+        u8 pattern[DMA_MEMSET_BLOCK] __attribute__ ((aligned (DMASG_POOL_ALIGN)));
+        u32 channel;
+        struct dma_copy_request queue[DMA_COPY_QUEUE_DEPTH];
+        // Queue indexes, free running
+        u32 rd;
+        u32 wr;
+        // Bytes of the oldest request already handed to the DMA
+        u32 offset;
+        // Sequence number of the last queued and of the last completed request
+        u32 issued;
+        volatile u32 completed;
+        struct dmasg_chain chain;
+    };
+
+    struct dma_copy_engine {
+        u32 base;
+        u32 channelCount;
+        // Requests below this size are done by the CPU
+        u32 threshold;
+        struct dmasg_pool pool;
+        struct dmasg_pool_slot slots[DMA_COPY_POOL_SIZE];
+        struct dma_copy_channel ch[DMA_COPY_MAX_CHANNELS];
+        // Statistics
+        u32 cpuRequests;
+        u32 dmaRequests;
+    };
+
+/*******************************************************************************
+*
+* @brief This function initializes the service over a set of DMA channels. The
+*        channels are configured as memory to memory with their channel
+*        completion interrupt enabled (the PLIC routing is left to the
+*        application).
+*
+* @param engine: Service context
+* @param base: Base address of the DMA controller
+* @param channels: DMA channel IDs
+* @param count: Number of channels, up to DMA_COPY_MAX_CHANNELS
+*
+*******************************************************************************/
+    static void dma_copy_init(struct dma_copy_engine *engine, u32 base, const u32 *channels, u32 count){
+        if(count > DMA_COPY_MAX_CHANNELS) count = DMA_COPY_MAX_CHANNELS;
+        engine->base = base;
+        engine->channelCount = count;
+        engine->threshold = DMA_COPY_THRESHOLD_DEFAULT;
+        engine->cpuRequests = 0;
+        engine->dmaRequests = 0;
+        dmasg_pool_init(&engine->pool, engine->slots, DMA_COPY_POOL_SIZE);
+        for(u32 i = 0; i < count; i++){
+            struct dma_copy_channel *q = &engine->ch[i];
+            q->channel = channels[i];
+            q->rd = q->wr = 0;
+            q->offset = 0;
+            q->issued = q->completed = 0;
+            dmasg_chain_init(&q->chain, &engine->pool);
+            dmasg_input_memory(base, q->channel, 0, DMA_COPY_BURST);
+            dmasg_output_memory(base, q->channel, 0, DMA_COPY_BURST);
+            dmasg_interrupt_config(base, q->channel, DMASG_CHANNEL_INTERRUPT_CHANNEL_COMPLETION_MASK);
+        }
+    }
+
+/*******************************************************************************
+*
+* @brief This function appends the next descriptors of a request to the chain
+*        of its channel.
+*
+* @return Number of descriptors appended, 0 if the pool is empty
+*
+*******************************************************************************/
+    static u32 dma_copy_round_(struct dma_copy_channel *q, struct dma_copy_request *r){
+        u32 appended = 0;
+        if(r->fill && q->offset == 0){
+            memset(q->pattern, r->value, r->bytes < DMA_MEMSET_BLOCK ? r->bytes : DMA_MEMSET_BLOCK);
+        }
+        while(q->offset < r->bytes && appended < DMA_COPY_ROUND && dmasg_pool_available(q->chain.pool)){
+            u32 remaining = r->bytes - q->offset;
+            u32 chunk;
+            if(r->fill){
+                chunk = remaining < DMA_MEMSET_BLOCK ? remaining : DMA_MEMSET_BLOCK;
+                dmasg_chain_memory(&q->chain, (u32) q->pattern, r->dst + q->offset, chunk, DMASG_DESCRIPTOR_CONTROL_NO_COMPLETION);
+            } else {
+                chunk = remaining < DMASG_DESCRIPTOR_MAX_BYTES ? remaining : DMASG_DESCRIPTOR_MAX_BYTES;
+                dmasg_chain_memory(&q->chain, r->src + q->offset, r->dst + q->offset, chunk, DMASG_DESCRIPTOR_CONTROL_NO_COMPLETION);
+            }
+            q->offset += chunk;
+            appended++;
+        }
+        return appended;
+    }
+
+/*******************************************************************************
+*
+* @brief This function makes the queue of a channel progress: completes the
+*        finished round/request and starts the next round.
+*
+*******************************************************************************/
+    static void dma_copy_progress_(struct dma_copy_engine *engine, struct dma_copy_channel *q){
+        while(1){
+            if(q->chain.head && !dmasg_chain_done(&q->chain)) return;
+            if(q->rd == q->wr) return;
+
+            struct dma_copy_request *r = &q->queue[q->rd & (DMA_COPY_QUEUE_DEPTH-1)];
+            if(q->offset == r->bytes){
+                data_cache_invalidate_range((void *) r->dst, r->bytes);
+                q->offset = 0;
+                q->rd++;
+                q->completed++;
+                continue;
+            }
+
+            if(dma_copy_round_(q, r) == 0) return;
+            dmasg_chain_start(&q->chain, engine->base, q->channel);
+            return;
+        }
+    }
+
+/*******************************************************************************
+*
+* @brief This function makes all the queues progress.
+*
+* @param engine: Service context
+*
+*******************************************************************************/
+    static void dma_copy_poll(struct dma_copy_engine *engine){
+        for(u32 i = 0; i < engine->channelCount; i++){
+            u32 mie = csr_read_clear(mstatus, MSTATUS_MIE) & MSTATUS_MIE;
+            dma_copy_progress_(engine, &engine->ch[i]);
+            if(mie) csr_set(mstatus, MSTATUS_MIE);
+        }
+    }
+
+/*******************************************************************************
+*
+* @brief This function makes a channel progress, to be called from the channel
+*        completion interrupt handler.
+*
+* @param engine: Service context
+* @param index: Index of the channel in the array given to dma_copy_init
+*
+*******************************************************************************/
+    static void dma_copy_isr(struct dma_copy_engine *engine, u32 index){
+        struct dma_copy_channel *q = &engine->ch[index];
+        dmasg_interrupt_pending_clear(engine->base, q->channel, 0xFFFFFFFF);
+        dma_copy_progress_(engine, q);
+    }
+
+/*******************************************************************************
+*
+* @brief This function queues a request on the least loaded channel, without
+*        looking at the threshold.
+*
+* @return Handle of the request, DMA_HANDLE_DONE if every queue is full (the
+*         request is then done by the CPU)
+*
+*******************************************************************************/
+    static dma_handle dma_copy_submit_(struct dma_copy_engine *engine, u32 dst, u32 src, u32 value, u32 bytes, u32 fill){
+        struct dma_copy_channel *best = 0;
+        u32 bestIndex = 0;
+        dma_handle handle;
+
+        //dma_copy_isr advances the same queues and starts the same channels
+        u32 mie = csr_read_clear(mstatus, MSTATUS_MIE) & MSTATUS_MIE;
+        for(u32 i = 0; i < engine->channelCount; i++){
+            struct dma_copy_channel *q = &engine->ch[i];
+            if(q->wr - q->rd == DMA_COPY_QUEUE_DEPTH) continue;
+            if(!best || q->wr - q->rd < best->wr - best->rd){
+                best = q;
+                bestIndex = i;
+            }
+        }
+
+        if(!best){
+            if(mie) csr_set(mstatus, MSTATUS_MIE);
+            if(fill) memset((void *) dst, value, bytes); else memcpy((void *) dst, (void *) src, bytes);
+            engine->cpuRequests++;
+            return DMA_HANDLE_DONE;
+        }
+
+        struct dma_copy_request *r = &best->queue[best->wr & (DMA_COPY_QUEUE_DEPTH-1)];
+        r->dst = dst;
+        r->src = src;
+        r->value = value;
+        r->bytes = bytes;
+        r->fill = fill;
+        best->issued++;
+        asm volatile ("" : : : "memory");
+        best->wr++;
+        engine->dmaRequests++;
+
+        dma_copy_progress_(engine, best);
+        handle = (best->issued << 3) | (bestIndex + 1);
+        if(mie) csr_set(mstatus, MSTATUS_MIE);
+        return handle;
+    }
+
+/*******************************************************************************
+*
+* @brief This function queues a memory copy. The buffers must not overlap.
+*
+* @param engine: Service context
+* @param dst: Destination address
+* @param src: Source address
+* @param bytes: Number of bytes
+*
+* @return Handle of the request, DMA_HANDLE_DONE if it was done by the CPU
+*
+*******************************************************************************/
+    static dma_handle dma_memcpy_async(struct dma_copy_engine *engine, void *dst, const void *src, u32 bytes){
+        if(bytes == 0) return DMA_HANDLE_DONE;
+        if(bytes < engine->threshold){
+            memcpy(dst, src, bytes);
+            engine->cpuRequests++;
+            return DMA_HANDLE_DONE;
+        }
+        return dma_copy_submit_(engine, (u32) dst, (u32) src, 0, bytes, 0);
+    }
+
+/*******************************************************************************
+*
+* @brief This function queues a memory fill.
+*
+* @param engine: Service context
+* @param dst: Destination address
+* @param value: Byte value
+* @param bytes: Number of bytes
+*
+* @return Handle of the request, DMA_HANDLE_DONE if it was done by the CPU
+*
+*******************************************************************************/
+    static dma_handle dma_memset_async(struct dma_copy_engine *engine, void *dst, u8 value, u32 bytes){
+        if(bytes == 0) return DMA_HANDLE_DONE;
+        if(bytes < engine->threshold){
+            memset(dst, value, bytes);
+            engine->cpuRequests++;
+            return DMA_HANDLE_DONE;
+        }
+        return dma_copy_submit_(engine, (u32) dst, 0, value, bytes, 1);
+    }
+
+/*******************************************************************************
+*
+* @brief This function checks if a request completed.
+*
+* @param engine: Service context
+* @param handle: Handle returned by dma_memcpy_async or dma_memset_async
+*
+* @return 1 if the request completed, 0 otherwise
+*
+*******************************************************************************/
+    static u32 dma_copy_done(struct dma_copy_engine *engine, dma_handle handle){
+        if(handle == DMA_HANDLE_DONE) return 1;
+        struct dma_copy_channel *q = &engine->ch[(handle & 7) - 1];
+        return (s32) ((q->completed << 3) - (handle & ~7)) >= 0;
+    }
+
+/*******************************************************************************
+*
+* @brief This function waits for the completion of a request, making the queues
+*        progress meanwhile.
+*
+* @param engine: Service context
+* @param handle: Handle returned by dma_memcpy_async or dma_memset_async
+*
+*******************************************************************************/
+    static void dma_copy_wait(struct dma_copy_engine *engine, dma_handle handle){
+        while(!dma_copy_done(engine, handle)){
+            dma_copy_poll(engine);
+        }
+    }
+
+/*******************************************************************************
+*
+* @brief This function measures the size from which the DMA is faster than the
+*        CPU, and sets it as the threshold of the service. Copies of doubling
+*        sizes are timed with mcycle on both, from a cold cache.
+*
+* @param engine: Service context
+* @param scratch: Scratch area, destroyed
+* @param bytes: Size of the scratch area, split in a source and a destination
+*
+* @return The new threshold in bytes, 0xFFFFFFFF if the CPU always won
+*
+*******************************************************************************/
+    static u32 dma_copy_calibrate(struct dma_copy_engine *engine, void *scratch, u32 bytes){
+        u8 *src = (u8 *) scratch;
+        u8 *dst = src + bytes / 2;
+        u32 threshold = 0xFFFFFFFF;
+
+        for(u32 size = 64; size <= bytes / 2; size <<= 1){
+            data_cache_invalidate_all();
+            u32 t = csr_read(mcycle);
+            memcpy(dst, src, size);
+            u32 cpu = csr_read(mcycle) - t;
+
+            data_cache_invalidate_all();
+            t = csr_read(mcycle);
+            dma_copy_wait(engine, dma_copy_submit_(engine, (u32) dst, (u32) src, 0, size, 0));
+            u32 dma = csr_read(mcycle) - t;
+
+            if(dma < cpu){
+                threshold = size;
+                break;
+            }
+        }
+
+        engine->threshold = threshold;
+        return threshold;
+    }
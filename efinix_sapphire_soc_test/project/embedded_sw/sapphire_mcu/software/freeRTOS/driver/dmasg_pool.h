@@ -0,0 +1,344 @@
+/*******************************************************************************
+*
+* @file dmasg_pool.h
+*
+* @brief Header file for a fixed size dmasg descriptor pool and a linked list
+*        chain builder. Descriptors are stored in 64 bytes aligned slots owned
+*        by the application (no malloc), free slots are linked through their
+*        next field so that allocation and release are O(1).
+*
+*        A chain ends on a shared terminator descriptor whose status is always
+*        COMPLETED, which makes the DMA stop there. Completed descriptors are
+*        given back to the pool by dmasg_chain_reclaim, so a chain can be
+*        reclaimed while the DMA is still working on its end.
+*
+* Functions:
+* - dmasg_pool_init: Initializes a pool over an array of slots.
+* - dmasg_pool_alloc: Takes a descriptor from the pool.
+* - dmasg_pool_free: Gives a descriptor back to the pool.
+* - dmasg_pool_available: Returns the number of free descriptors.
+* - dmasg_chain_init: Initializes an empty chain.
+* - dmasg_chain_memory: Appends a memory to memory segment.
+* - dmasg_chain_s2m: Appends a stream to memory segment.
+* - dmasg_chain_m2s: Appends a memory to stream segment.
+* - dmasg_chain_start: Terminates the chain and starts it on a channel.
+* - dmasg_chain_reclaim: Gives the completed descriptors back to the pool.
+* - dmasg_chain_done: Checks if every descriptor of the chain completed.
+* - dmasg_chain_release: Gives every descriptor back to the pool.
+*
+******************************************************************************/
+#pragma once
+
+#include "type.h"
+#include "io.h"
+#include "vexriscv.h"
+#include "dmasg.h"
+
+#define DMASG_POOL_ALIGN                64
+#define DMASG_DESCRIPTOR_MAX_BYTES      (DMASG_DESCRIPTOR_CONTROL_BYTES + 1)
+
+/******************************************************************************
+*
+* A descriptor padded to its own 64 bytes aligned slot. Declare the storage of
+* a pool as an array of this type.
+*
+******************************************************************************/
+    struct dmasg_pool_slot {
+        struct dmasg_descriptor descriptor;
+        u32 reserved[(DMASG_POOL_ALIGN - sizeof(struct dmasg_descriptor)) / 4];
+    } __attribute__ ((aligned (DMASG_POOL_ALIGN)));
+
+    struct dmasg_pool {
+        // First free descriptor, the others are linked through their next field
+        struct dmasg_descriptor *free;
+        // Number of free descriptors
+        u32 available;
+        // Total number of descriptors
+        u32 count;
+    };
+
+    struct dmasg_chain {
+        struct dmasg_pool *pool;
+        // Oldest descriptor not reclaimed yet, 0 when the chain is empty
+        struct dmasg_descriptor *head;
+        // Last appended descriptor
+        struct dmasg_descriptor *tail;
+        // Number of descriptors held by the chain
+        u32 count;
+        // Number of bytes described by the chain
+        u32 bytes;
+    };
+
+    // Shared end of chain marker, its status is never cleared
+    static struct dmasg_pool_slot dmasg_pool_terminator = {
+        .descriptor = { .status = DMASG_DESCRIPTOR_STATUS_COMPLETED }
+    };
+
+/*******************************************************************************
+*
+* @brief This function initializes a pool over an array of slots.
+*
+* @param pool: Pool to initialize
+* @param slots: Storage of the descriptors, 64 bytes aligned by its type
+* @param count: Number of slots
+*
+*******************************************************************************/
+    static void dmasg_pool_init(struct dmasg_pool *pool, struct dmasg_pool_slot *slots, u32 count){
+        pool->free = 0;
+        for(u32 i = count; i-- > 0;){
+            slots[i].descriptor.next = (u32) pool->free;
+            pool->free = &slots[i].descriptor;
+        }
+        pool->available = count;
+        pool->count = count;
+    }
+
+/*******************************************************************************
+*
+* @brief This function takes a descriptor from the pool.
+*
+* @param pool: Pool
+*
+* @return The descriptor, or 0 if the pool is empty
+*
+*******************************************************************************/
+    static struct dmasg_descriptor *dmasg_pool_alloc(struct dmasg_pool *pool){
+        struct dmasg_descriptor *d = pool->free;
+        if(d){
+            pool->free = (struct dmasg_descriptor *) (u32) d->next;
+            pool->available--;
+        }
+        return d;
+    }
+
+/*******************************************************************************
+*
+* @brief This function gives a descriptor back to the pool.
+*
+* @param pool: Pool
+* @param descriptor: Descriptor previously returned by dmasg_pool_alloc
+*
+*******************************************************************************/
+    static void dmasg_pool_free(struct dmasg_pool *pool, struct dmasg_descriptor *descriptor){
+        descriptor->next = (u32) pool->free;
+        pool->free = descriptor;
+        pool->available++;
+    }
+
+/*******************************************************************************
+*
+* @brief This function returns the number of free descriptors of the pool.
+*
+* @param pool: Pool
+*
+* @return Number of free descriptors
+*
+*******************************************************************************/
+    static u32 dmasg_pool_available(struct dmasg_pool *pool){
+        return pool->available;
+    }
+
+/*******************************************************************************
+*
+* @brief This function initializes an empty chain.
+*
+* @param chain: Chain to initialize
+* @param pool: Pool providing the descriptors of the chain
+*
+*******************************************************************************/
+    static void dmasg_chain_init(struct dmasg_chain *chain, struct dmasg_pool *pool){
+        chain->pool = pool;
+        chain->head = 0;
+        chain->tail = 0;
+        chain->count = 0;
+        chain->bytes = 0;
+    }
+
+/*******************************************************************************
+*
+* @brief This function appends a segment to a chain, split on the maximum size
+*        of a descriptor.
+*
+* @param chain: Chain
+* @param from: Source address, 0 for a stream source
+* @param to: Destination address, 0 for a stream destination
+* @param bytes: Size of the segment
+* @param control: DMASG_DESCRIPTOR_CONTROL_END_OF_PACKET and/or
+*                 DMASG_DESCRIPTOR_CONTROL_NO_COMPLETION, END_OF_PACKET is only
+*                 set on the last descriptor of the segment
+*
+* @return 0 on success, -1 if the pool ran out of descriptors (the chain is
+*         then left unchanged)
+*
+*******************************************************************************/
+    static int dmasg_chain_segment_(struct dmasg_chain *chain, u32 from, u32 to, u32 bytes, u32 control){
+        u32 needed = (bytes + DMASG_DESCRIPTOR_MAX_BYTES - 1) / DMASG_DESCRIPTOR_MAX_BYTES;
+        if(bytes == 0 || needed > chain->pool->available) return -1;
+
+        while(bytes){
+            u32 chunk = bytes > DMASG_DESCRIPTOR_MAX_BYTES ? DMASG_DESCRIPTOR_MAX_BYTES : bytes;
+            struct dmasg_descriptor *d = dmasg_pool_alloc(chain->pool);
+            d->status = 0;
+            d->control = (chunk - 1) | (control & DMASG_DESCRIPTOR_CONTROL_NO_COMPLETION);
+            if(chunk == bytes) d->control |= control & DMASG_DESCRIPTOR_CONTROL_END_OF_PACKET;
+            d->from = from;
+            d->to = to;
+            d->next = (u32) &dmasg_pool_terminator.descriptor;
+            if(chain->tail) chain->tail->next = (u32) d; else chain->head = d;
+            chain->tail = d;
+            chain->count++;
+            chain->bytes += chunk;
+            if(from) from += chunk;
+            if(to) to += chunk;
+            bytes -= chunk;
+        }
+        return 0;
+    }
+
+/*******************************************************************************
+*
+* @brief This function appends a memory to memory segment to a chain.
+*
+* @param chain: Chain
+* @param from: Source address
+* @param to: Destination address
+* @param bytes: Size of the segment
+* @param control: See dmasg_chain_segment_
+*
+* @return 0 on success, -1 if the pool ran out of descriptors
+*
+*******************************************************************************/
+    static int dmasg_chain_memory(struct dmasg_chain *chain, u32 from, u32 to, u32 bytes, u32 control){
+        return dmasg_chain_segment_(chain, from, to, bytes, control);
+    }
+
+/*******************************************************************************
+*
+* @brief This function appends a stream to memory segment to a chain.
+*
+* @param chain: Chain
+* @param to: Destination address
+* @param bytes: Size of the segment
+* @param control: See dmasg_chain_segment_
+*
+* @return 0 on success, -1 if the pool ran out of descriptors
+*
+*******************************************************************************/
+    static int dmasg_chain_s2m(struct dmasg_chain *chain, u32 to, u32 bytes, u32 control){
+        return dmasg_chain_segment_(chain, 0, to, bytes, control);
+    }
+
+/*******************************************************************************
+*
+* @brief This function appends a memory to stream segment to a chain.
+*
+* @param chain: Chain
+* @param from: Source address
+* @param bytes: Size of the segment
+* @param control: See dmasg_chain_segment_
+*
+* @return 0 on success, -1 if the pool ran out of descriptors
+*
+*******************************************************************************/
+    static int dmasg_chain_m2s(struct dmasg_chain *chain, u32 from, u32 bytes, u32 control){
+        return dmasg_chain_segment_(chain, from, 0, bytes, control);
+    }
+
+/*******************************************************************************
+*
+* @brief This function starts a chain on a DMA channel. The channel input and
+*        output have to be configured beforehand (memory or stream). The last
+*        descriptor always reports its completion, so that the end of the chain
+*        can be detected.
+*
+* @param chain: Chain, not empty
+* @param base: Base address of the DMA controller
+* @param channel: DMA channel ID
+*
+*******************************************************************************/
+    static void dmasg_chain_start(struct dmasg_chain *chain, u32 base, u32 channel){
+        chain->tail->control &= ~DMASG_DESCRIPTOR_CONTROL_NO_COMPLETION;
+        asm volatile ("" : : : "memory");
+        dmasg_linked_list_start(base, channel, (u32) chain->head);
+    }
+
+/*******************************************************************************
+*
+* @brief This function checks the completion of a descriptor, reading its status
+*        from memory.
+*
+*******************************************************************************/
+    static u32 dmasg_descriptor_completed_(struct dmasg_descriptor *d){
+        data_cache_invalidate_address(&d->status);
+        return ((volatile struct dmasg_descriptor *) d)->status & DMASG_DESCRIPTOR_STATUS_COMPLETED;
+    }
+
+/*******************************************************************************
+*
+* @brief This function gives the completed descriptors of a chain back to its
+*        pool, from the oldest one up to the first one still pending. The DMA
+*        does not write back the status of NO_COMPLETION descriptors, those are
+*        reclaimed together with the next descriptor reporting its completion.
+*
+* @param chain: Chain
+*
+* @return Number of descriptors reclaimed
+*
+*******************************************************************************/
+    static u32 dmasg_chain_reclaim(struct dmasg_chain *chain){
+        u32 reclaimed = 0;
+        while(chain->head){
+            struct dmasg_descriptor *last = chain->head;
+            while((last->control & DMASG_DESCRIPTOR_CONTROL_NO_COMPLETION) && last != chain->tail){
+                last = (struct dmasg_descriptor *) (u32) last->next;
+            }
+            if(!dmasg_descriptor_completed_(last)) break;
+
+            struct dmasg_descriptor *d;
+            do {
+                d = chain->head;
+                chain->head = d == chain->tail ? 0 : (struct dmasg_descriptor *) (u32) d->next;
+                chain->bytes -= (d->control & DMASG_DESCRIPTOR_CONTROL_BYTES) + 1;
+                chain->count--;
+                dmasg_pool_free(chain->pool, d);
+                reclaimed++;
+            } while(d != last);
+            if(!chain->head) chain->tail = 0;
+        }
+        return reclaimed;
+    }
+
+/*******************************************************************************
+*
+* @brief This function checks if every descriptor of a chain completed, after
+*        reclaiming them.
+*
+* @param chain: Chain
+*
+* @return 1 if the chain is empty, 0 otherwise
+*
+*******************************************************************************/
+    static u32 dmasg_chain_done(struct dmasg_chain *chain){
+        dmasg_chain_reclaim(chain);
+        return chain->head == 0;
+    }
+
+/*******************************************************************************
+*
+* @brief This function gives every descriptor of a chain back to its pool,
+*        completed or not. The channel has to be stopped (see dmasg_stop and
+*        dmasg_busy) if the chain was started.
+*
+* @param chain: Chain
+*
+*******************************************************************************/
+    static void dmasg_chain_release(struct dmasg_chain *chain){
+        while(chain->head){
+            struct dmasg_descriptor *d = chain->head;
+            chain->head = d == chain->tail ? 0 : (struct dmasg_descriptor *) (u32) d->next;
+            dmasg_pool_free(chain->pool, d);
+        }
+        chain->tail = 0;
+        chain->count = 0;
+        chain->bytes = 0;
+    }
@@ -0,0 +1,195 @@
+/*******************************************************************************
+*
+* @file dmasg_ring.h
+*
+* @brief Header file for a gapless stream to memory capture in a circular
+*        buffer. The channel runs in direct mode with self restart, so the DMA
+*        wraps around the buffer by itself without any software intervention.
+*        The half completion interrupt reports the first half of the buffer and
+*        the descriptor completion interrupt the second half, each one being
+*        handed to the application callback while the DMA fills the other one.
+*
+*        The application gives each half back with dmasg_ring_release once
+*        processed. A half not released before the DMA comes back to it is an
+*        overrun, detected from the completed/released half counters and from
+*        the DMA write position (dmasg_progress_bytes) at release time.
+*
+* Functions:
+* - dmasg_ring_init: Initializes a ring capture context.
+* - dmasg_ring_start: Configures the channel and starts the capture.
+* - dmasg_ring_stop: Stops the capture.
+* - dmasg_ring_isr: Services the channel, to be called from its interrupt.
+* - dmasg_ring_release: Gives the oldest half back to the DMA.
+* - dmasg_ring_pending: Returns the number of halves ready and not released.
+*
+******************************************************************************/
+#pragma once
+
+#include "type.h"
+#include "io.h"
+#include "vexriscv.h"
+#include "dmasg.h"
+
+#define DMASG_RING_INTERRUPTS   (DMASG_CHANNEL_INTERRUPT_DESCRIPTOR_COMPLETION_HALF_MASK | \
+                                 DMASG_CHANNEL_INTERRUPT_DESCRIPTOR_COMPLETION_MASK)
+
+    struct dmasg_ring;
+
+    // Called from dmasg_ring_isr when a half of the buffer is filled
+    typedef void (*dmasg_ring_callback)(struct dmasg_ring *ring, u8 *data, u32 bytes, void *context);
+
+    struct dmasg_ring {
+        u32 base;
+        u32 channel;
+        // Input stream port, see dmasg_input_stream
+        u32 port;
+        u32 burst;
+        u8 *buffer;
+        // Size of the whole buffer, even
+        u32 bytes;
+        dmasg_ring_callback callback;
+        void *context;
+        // Halves filled by the DMA and halves released by the application
+        volatile u32 completed;
+        volatile u32 released;
+        volatile u32 overruns;
+    };
+
+/*******************************************************************************
+*
+* @brief This function initializes a ring capture context.
+*
+* @param ring: Context to initialize
+* @param base: Base address of the DMA controller
+* @param channel: DMA channel ID, supporting the direct mode
+* @param port: Input stream port of the channel
+* @param buffer: Circular buffer
+* @param bytes: Size of the buffer, even, each half being reported separately
+* @param burst: Bytes per burst (power of two)
+* @param callback: Function called for each filled half, 0 for none
+* @param context: Argument given to the callback
+*
+*******************************************************************************/
+    static void dmasg_ring_init(struct dmasg_ring *ring, u32 base, u32 channel, u32 port, void *buffer, u32 bytes,
+                                u32 burst, dmasg_ring_callback callback, void *context){
+        ring->base = base;
+        ring->channel = channel;
+        ring->port = port;
+        ring->burst = burst;
+        ring->buffer = (u8 *) buffer;
+        ring->bytes = bytes & ~1;
+        ring->callback = callback;
+        ring->context = context;
+        ring->completed = 0;
+        ring->released = 0;
+        ring->overruns = 0;
+    }
+
+/*******************************************************************************
+*
+* @brief This function configures the channel and starts the capture.
+*
+* @param ring: Context
+*
+*******************************************************************************/
+    static void dmasg_ring_start(struct dmasg_ring *ring){
+        ring->completed = 0;
+        ring->released = 0;
+        dmasg_input_stream(ring->base, ring->channel, ring->port, 0, 0);
+        dmasg_output_memory(ring->base, ring->channel, (u32) ring->buffer, ring->burst);
+        dmasg_interrupt_config(ring->base, ring->channel, DMASG_RING_INTERRUPTS);
+        dmasg_direct_start(ring->base, ring->channel, ring->bytes, 1);
+    }
+
+/*******************************************************************************
+*
+* @brief This function stops the capture and waits for the channel to be idle.
+*
+* @param ring: Context
+*
+*******************************************************************************/
+    static void dmasg_ring_stop(struct dmasg_ring *ring){
+        dmasg_interrupt_config(ring->base, ring->channel, 0);
+        dmasg_stop(ring->base, ring->channel);
+        while(dmasg_busy(ring->base, ring->channel));
+    }
+
+/*******************************************************************************
+*
+* @brief This function reports a filled half to the application.
+*
+*******************************************************************************/
+    static void dmasg_ring_half_(struct dmasg_ring *ring){
+        u32 half = ring->bytes / 2;
+        u8 *data = ring->buffer + (ring->completed & 1) * half;
+        ring->completed++;
+        data_cache_invalidate_range(data, half);
+        if(ring->callback) ring->callback(ring, data, half, ring->context);
+    }
+
+/*******************************************************************************
+*
+* @brief This function services the channel, to be called from its interrupt
+*        handler.
+*
+* @param ring: Context
+*
+*******************************************************************************/
+    static void dmasg_ring_isr(struct dmasg_ring *ring){
+        u32 ca = dmasg_ca(ring->base, ring->channel);
+        u32 pending = read_u32(ca + DMASG_CHANNEL_INTERRUPT_PENDING) & DMASG_RING_INTERRUPTS;
+        dmasg_interrupt_pending_clear(ring->base, ring->channel, pending);
+
+        // The first half completes before the whole buffer, both may be pending when serviced late
+        if((pending & DMASG_CHANNEL_INTERRUPT_DESCRIPTOR_COMPLETION_HALF_MASK) && !(ring->completed & 1)){
+            dmasg_ring_half_(ring);
+        }
+        if((pending & DMASG_CHANNEL_INTERRUPT_DESCRIPTOR_COMPLETION_MASK)){
+            if(!(ring->completed & 1)) dmasg_ring_half_(ring);
+            dmasg_ring_half_(ring);
+        }
+    }
+
+/*******************************************************************************
+*
+* @brief This function returns the number of halves filled and not released.
+*
+* @param ring: Context
+*
+* @return Number of halves ready, more than 1 means the oldest one is overrun
+*
+*******************************************************************************/
+    static u32 dmasg_ring_pending(struct dmasg_ring *ring){
+        return ring->completed - ring->released;
+    }
+
+/*******************************************************************************
+*
+* @brief This function gives the oldest filled half back to the DMA. The data of
+*        that half has to be consumed before, as the DMA may write it again as
+*        soon as it is released.
+*
+* @param ring: Context
+*
+* @return 0 if the half was consumed in time, -1 if the DMA already came back
+*         into it (overrun, the data read from it may be corrupted), -2 if no
+*         half was filled (nothing is released)
+*
+*******************************************************************************/
+    static int dmasg_ring_release(struct dmasg_ring *ring){
+        u32 half = ring->released & 1;
+        u32 ahead = ring->completed - ring->released;
+        if(ahead == 0) return -2;
+        u32 position = dmasg_progress_bytes(ring->base, ring->channel);
+        u32 writing = position >= ring->bytes / 2;
+
+        ring->released++;
+
+        // ahead == 1 : the DMA should be filling the other half, unless it wrapped
+        // before its completion interrupt got serviced
+        if(ahead >= 2 || (ahead == 1 && writing == half)){
+            ring->overruns++;
+            return -1;
+        }
+        return 0;
+    }
@@ -0,0 +1,338 @@
+/*******************************************************************************
+*
+* @file dmasg_sched.h
+*
+* @brief Header file for a dmasg channel manager. Clients (SD, Ethernet, UART,
+*        memcpy...) allocate their channels from it with a traffic class, which
+*        sets the priority and the arbitration weight of the channel. The
+*        manager keeps per channel counters of the bytes moved, the number of
+*        transfers and the time spent busy, so that the client saturating the
+*        bus can be identified.
+*
+*        The real time class has a priority of its own, the other classes
+*        share the lowest priority. Among them the weight is the number of
+*        extra bursts a channel gets in a row when the arbiter grants it, so a
+*        storage channel moves up to 4 bursts for each one of a background
+*        channel.
+*
+*        dmasg_sched_sample runs from thread context and masks MIE while it
+*        updates a channel, as dmasg_sched_complete may run from the ISR.
+*
+*        Clients report each transfer with dmasg_sched_begin before starting
+*        the channel, dmasg_sched_started once it is started, and its end with
+*        dmasg_sched_complete, typically from the channel completion interrupt.
+*        dmasg_sched_sample can be called periodically instead of, or on top
+*        of, the completion hook. It accounts the bytes of the transfers in
+*        flight from dmasg_progress_bytes and completes the transfers of the
+*        started channels found idle.
+*
+*        Time is measured in mcycle cycles.
+*
+* Functions:
+* - dmasg_sched_init: Initializes the manager over a set of channels.
+* - dmasg_sched_alloc: Allocates a channel for a traffic class.
+* - dmasg_sched_free: Gives a channel back to the manager.
+* - dmasg_sched_set_class: Changes the traffic class of a channel.
+* - dmasg_sched_begin: Reports a transfer about to start.
+* - dmasg_sched_started: Reports that the channel of a transfer is started.
+* - dmasg_sched_complete: Reports the end of a transfer.
+* - dmasg_sched_sample: Samples the transfers in flight.
+* - dmasg_sched_stats: Returns the counters of a channel.
+* - dmasg_sched_clear: Clears the counters of every channel.
+* - dmasg_sched_utilization: Returns the busy ratio of a channel.
+*
+******************************************************************************/
+#pragma once
+
+#include "type.h"
+#include "io.h"
+#include "riscv.h"
+#include "dmasg.h"
+
+#define DMASG_SCHED_MAX_CHANNELS        8
+
+// Traffic classes, from the most to the least latency sensitive
+#define DMASG_CLASS_REALTIME            0       // stream capture, audio, Ethernet RX
+#define DMASG_CLASS_STORAGE             1       // SD card, flash
+#define DMASG_CLASS_BULK                2       // memcpy, memset
+#define DMASG_CLASS_BACKGROUND          3       // UART, logs
+#define DMASG_CLASS_COUNT               4
+
+    struct dmasg_sched_class {
+        u32 priority;
+        u32 weight;
+    };
+
+    // Priority and weight programmed for each traffic class, can be tuned
+    // before allocating the channels. The weight is the number of extra bursts
+    // granted in a row, between channels of the same priority only.
+    static struct dmasg_sched_class dmasg_sched_classes[DMASG_CLASS_COUNT] = {
+        [DMASG_CLASS_REALTIME]   = { .priority = 1, .weight = 0 },
+        [DMASG_CLASS_STORAGE]    = { .priority = 0, .weight = 3 },
+        [DMASG_CLASS_BULK]       = { .priority = 0, .weight = 1 },
+        [DMASG_CLASS_BACKGROUND] = { .priority = 0, .weight = 0 },
+    };
+
+    struct dmasg_sched_stats {
+        // Bytes of the completed transfers, plus the sampled progress of the
+        // transfer in flight
+        u64 bytes;
+        u32 transfers;
+        // Cycles spent with a transfer in flight
+        u64 busy;
+    };
+
+    struct dmasg_sched_channel {
+        const char *owner;
+        u32 class;
+        u32 allocated;
+        // Transfer in flight: size, start time and progress already accounted.
+        // Only started transfers are completed by dmasg_sched_sample.
+        volatile u32 active;
+        volatile u32 started;
+        u32 expected;
+        u32 start;
+        u32 sampled;
+        u32 sampledTime;
+        struct dmasg_sched_stats stats;
+    };
+
+    struct dmasg_sched {
+        u32 base;
+        // Channels managed, one bit per channel ID
+        u32 mask;
+        u32 since;
+        struct dmasg_sched_channel ch[DMASG_SCHED_MAX_CHANNELS];
+    };
+
+/*******************************************************************************
+*
+* @brief This function initializes the manager over a set of channels.
+*
+* @param sched: Manager to initialize
+* @param base: Base address of the DMA controller
+* @param mask: Channels available to the clients, bit n for the channel ID n
+*
+*******************************************************************************/
+    static void dmasg_sched_init(struct dmasg_sched *sched, u32 base, u32 mask){
+        sched->base = base;
+        sched->mask = mask & ((1 << DMASG_SCHED_MAX_CHANNELS) - 1);
+        sched->since = csr_read(mcycle);
+        for(u32 i = 0; i < DMASG_SCHED_MAX_CHANNELS; i++){
+            struct dmasg_sched_channel *c = &sched->ch[i];
+            c->owner = 0;
+            c->class = DMASG_CLASS_BACKGROUND;
+            c->allocated = 0;
+            c->active = 0;
+            c->started = 0;
+            c->stats.bytes = 0;
+            c->stats.transfers = 0;
+            c->stats.busy = 0;
+        }
+    }
+
+/*******************************************************************************
+*
+* @brief This function changes the traffic class of a channel and programs its
+*        priority and weight accordingly.
+*
+* @param sched: Manager
+* @param channel: DMA channel ID
+* @param class: One of the DMASG_CLASS_* defines
+*
+*******************************************************************************/
+    static void dmasg_sched_set_class(struct dmasg_sched *sched, u32 channel, u32 class){
+        if(class >= DMASG_CLASS_COUNT) class = DMASG_CLASS_BACKGROUND;
+        sched->ch[channel].class = class;
+        dmasg_priority_weight(sched->base, channel, dmasg_sched_classes[class].priority,
+                              dmasg_sched_classes[class].weight);
+    }
+
+/*******************************************************************************
+*
+* @brief This function allocates a free channel for a traffic class.
+*
+* @param sched: Manager
+* @param class: One of the DMASG_CLASS_* defines
+* @param owner: Name of the client, shown in the statistics
+*
+* @return The DMA channel ID, or -1 if every channel is in use
+*
+*******************************************************************************/
+    static int dmasg_sched_alloc(struct dmasg_sched *sched, u32 class, const char *owner){
+        for(u32 i = 0; i < DMASG_SCHED_MAX_CHANNELS; i++){
+            struct dmasg_sched_channel *c = &sched->ch[i];
+            if(!(sched->mask & (1 << i)) || c->allocated) continue;
+            c->allocated = 1;
+            c->owner = owner;
+            c->active = 0;
+            c->started = 0;
+            dmasg_sched_set_class(sched, i, class);
+            return i;
+        }
+        return -1;
+    }
+
+/*******************************************************************************
+*
+* @brief This function gives a channel back to the manager. Its counters are
+*        kept until the next dmasg_sched_clear.
+*
+* @param sched: Manager
+* @param channel: DMA channel ID, stopped
+*
+*******************************************************************************/
+    static void dmasg_sched_free(struct dmasg_sched *sched, u32 channel){
+        sched->ch[channel].allocated = 0;
+        sched->ch[channel].active = 0;
+        sched->ch[channel].started = 0;
+    }
+
+/*******************************************************************************
+*
+* @brief This function reports a transfer, right before the channel is
+*        started. dmasg_sched_started must follow once the channel is started.
+*
+* @param sched: Manager
+* @param channel: DMA channel ID
+* @param bytes: Size of the transfer
+*
+*******************************************************************************/
+    static void dmasg_sched_begin(struct dmasg_sched *sched, u32 channel, u32 bytes){
+        struct dmasg_sched_channel *c = &sched->ch[channel];
+        c->expected = bytes;
+        c->sampled = 0;
+        c->start = csr_read(mcycle);
+        c->sampledTime = c->start;
+        c->started = 0;
+        c->active = 1;
+    }
+
+/*******************************************************************************
+*
+* @brief This function reports that the channel of a transfer is started, right
+*        after dmasg_*_start. Until then dmasg_sched_sample leaves the transfer
+*        alone, as the channel is not busy yet.
+*
+* @param sched: Manager
+* @param channel: DMA channel ID
+*
+*******************************************************************************/
+    static void dmasg_sched_started(struct dmasg_sched *sched, u32 channel){
+        sched->ch[channel].started = 1;
+    }
+
+/*******************************************************************************
+*
+* @brief This function reports the end of a transfer, to be called from the
+*        completion interrupt of the channel or once it is found idle.
+*
+* @param sched: Manager
+* @param channel: DMA channel ID
+*
+*******************************************************************************/
+    static void dmasg_sched_complete(struct dmasg_sched *sched, u32 channel){
+        struct dmasg_sched_channel *c = &sched->ch[channel];
+        if(!c->active) return;
+        c->active = 0;
+        c->started = 0;
+        c->stats.bytes += c->expected - c->sampled;
+        c->stats.busy += csr_read(mcycle) - c->sampledTime;
+        c->stats.transfers++;
+    }
+
+/*******************************************************************************
+*
+* @brief This function samples the transfers in flight. The bytes already moved
+*        are read from dmasg_progress_bytes and the busy time is accounted up to
+*        now, so that long transfers show up in the counters before their end.
+*        Transfers of started channels found idle are completed.
+*
+* @param sched: Manager
+*
+* @note dmasg_progress_bytes reports the progress of the current descriptor,
+*       the sampled bytes are exact for direct mode transfers and single
+*       descriptor lists only.
+*
+*******************************************************************************/
+    static void dmasg_sched_sample(struct dmasg_sched *sched){
+        for(u32 i = 0; i < DMASG_SCHED_MAX_CHANNELS; i++){
+            struct dmasg_sched_channel *c = &sched->ch[i];
+            //dmasg_sched_complete may run from the completion interrupt
+            u32 mie = csr_read_clear(mstatus, MSTATUS_MIE) & MSTATUS_MIE;
+            if(c->active && c->started){
+                if(!dmasg_busy(sched->base, i)){
+                    dmasg_sched_complete(sched, i);
+                } else {
+                    u32 now = csr_read(mcycle);
+                    u32 progress = dmasg_progress_bytes(sched->base, i);
+                    if(progress > c->expected) progress = c->expected;
+                    if(progress > c->sampled){
+                        c->stats.bytes += progress - c->sampled;
+                        c->sampled = progress;
+                    }
+                    c->stats.busy += now - c->sampledTime;
+                    c->sampledTime = now;
+                }
+            }
+            if(mie) csr_set(mstatus, MSTATUS_MIE);
+        }
+    }
+
+/*******************************************************************************
+*
+* @brief This function returns the counters of a channel.
+*
+* @param sched: Manager
+* @param channel: DMA channel ID
+* @param stats: Filled with the counters since the last dmasg_sched_clear
+*
+* @return Name of the owner of the channel, 0 if it was never allocated
+*
+*******************************************************************************/
+    static const char *dmasg_sched_stats(struct dmasg_sched *sched, u32 channel, struct dmasg_sched_stats *stats){
+        *stats = sched->ch[channel].stats;
+        return sched->ch[channel].owner;
+    }
+
+/*******************************************************************************
+*
+* @brief This function clears the counters of every channel and restarts the
+*        measurement window.
+*
+* @param sched: Manager
+*
+*******************************************************************************/
+    static void dmasg_sched_clear(struct dmasg_sched *sched){
+        u32 now = csr_read(mcycle);
+        for(u32 i = 0; i < DMASG_SCHED_MAX_CHANNELS; i++){
+            struct dmasg_sched_channel *c = &sched->ch[i];
+            c->stats.bytes = 0;
+            c->stats.transfers = 0;
+            c->stats.busy = 0;
+            c->sampledTime = now;
+        }
+        sched->since = now;
+    }
+
+/*******************************************************************************
+*
+* @brief This function returns the busy ratio of a channel since the last
+*        dmasg_sched_clear (or dmasg_sched_init).
+*
+* @param sched: Manager
+* @param channel: DMA channel ID
+*
+* @return Busy time in per mille of the measurement window
+*
+* @note The window is measured with the 32 bits mcycle counter, it has to be
+*       cleared more often than the counter wraps.
+*
+*******************************************************************************/
+    static u32 dmasg_sched_utilization(struct dmasg_sched *sched, u32 channel){
+        u32 window = csr_read(mcycle) - sched->since;
+        if(window == 0) return 0;
+        u64 busy = sched->ch[channel].stats.busy;
+        if(busy > window) busy = window;
+        return (u32) (busy * 1000 / window);
+    }
@@ -46,8 +46,14 @@
 * Functions:
 * - sd_ctrl_write: Writes a 32-bit data value to the specified offset within the SD controller device registers.
 * - sd_ctrl_read: Reads a 32-bit data value from the specified offset within the SD controller device registers.
+* - sd_ctrl_cmd_start: Writes a command to the SD controller without waiting for its completion.
 * - sd_ctrl_cmd: Sends a command to the SD controller device and handles the response accordingly.
 * - sd_ctrl_creat_Descriptor: Creates a descriptor for data transfer by allocating memory and setting up the descriptor entries.
+* - sd_ctrl_pio_write: Writes blocks to the controller buffer without DMA.
+* - sd_ctrl_pio_read: Reads blocks from the controller buffer without DMA.
+* - sd_ctrl_reset_lines: Resets the CMD and DAT lines of the controller.
+* - sd_ctrl_int_clear: Clears the latched interrupt flags of IntPtr.
+* - sd_ctrl_abort_data: Recovers the controller and the card from a failed data transfer.
 * - sd_ctrl_data: Handles data transfer between the SD controller and the SD card.
 * - sd_ctrl_check_read_write: Checks if the MMC command requires data read or write operations.
 * - sd_ctrl_send_cmd: Sends the MMC command with or without data transfer based on the command type.
@@ -57,14 +63,24 @@
 * - sd_ctrl_set_bus: Sets the bus width for SD operations.
 * - sd_ctrl_set_ios: Sets the I/O settings for the SD controller.
 * - sd_ctrl_init: Initializes the SD controller and MMC/SD card.
-* - sd_ctrl_mmc_probe: Probes and initializes the MMC/SD controller.
+* - sd_ctrl_mmc_probe_static: Probes and initializes the MMC/SD controller over caller storage.
+* - sd_ctrl_mmc_probe: Probes and initializes the MMC/SD controller over the default storage.
+* - sd_ctrl_max_blocks: Returns the largest block count of one data command.
+* - sd_ctrl_read_blocks: Reads blocks from the card with CMD17/CMD18.
+* - sd_ctrl_write_blocks: Writes blocks to the card with CMD24/CMD25.
+* - sd_ctrl_read_speed: Measures and prints the read throughput.
+* - sd_ctrl_switch_func: Queries or switches the card access mode with CMD6.
+* - sd_ctrl_speed_test: Checks that reads at the current clock are stable.
+* - sd_ctrl_high_speed: Switches to High-Speed and selects the fastest stable clock.
 *
 ******************************************************************************/
 
 #pragma once
 
 #include "print.h"
+#include "vexriscv.h"
 #include "mmc.h" 
+#include "sd_trace.h"
 
 #define REG_VERSION 					0x0000
 #define REG_ARGUMENT2 					0x0000
@@ -97,6 +113,19 @@
 #define REG_SHARE_BUS_CONTORL			0x00E0
 #define REG_SLOT_INTERRUPT_STATUS		0x00FC
 #define MAX_DESCRIPTOR                  65536
+#define MAX_BLOCK_COUNT					0xFFFF	/* Width of the block count register */
+#define PRESENT_STATE_BUFFER_WRITE_EN	0x400	/* One block can be written to the buffer */
+#define PRESENT_STATE_BUFFER_READ_EN	0x800	/* One block can be read from the buffer */
+#define HOST_CONTROL_HIGH_SPEED			0x4		/* High Speed Enable */
+#define CLOCK_CONTROL_RESET_CMD			(1<<25)	/* Software Reset for CMD Line, self clearing */
+#define CLOCK_CONTROL_RESET_DAT			(1<<26)	/* Software Reset for DAT Line, self clearing */
+#define SD_RESET_TIMEOUT_US				1000	/* Longest software reset */
+#define SD_SWITCH_STATUS_SIZE			64		/* CMD6 status data block */
+#define SD_SWITCH_CHECK					0		/* CMD6 mode: query the functions */
+#define SD_SWITCH_SET					1		/* CMD6 mode: switch the functions */
+#define SD_SWITCH_ACCESS_HS				1		/* Group 1 function: High-Speed/SDR25 */
+#define SD_SPEED_TEST_BLOCKS			8		/* Blocks read by each speed test command */
+#define SD_SPEED_TEST_LOOPS				4		/* Speed test reads at each clock step */
 
 /*******************************************************************************
 *
@@ -143,12 +172,42 @@ struct sd_ctrl_dev {
     int f_max;                  	/* Maximum clock frequency */
     int app_cmd;                	/* Application command flag */
     TransModeStruct *TransModePtr; 	/* Pointer to transaction mode settings */
+    u32 *adma;                  	/* ADMA descriptor table, 2 words per line */
+    u32 adma_lines;             	/* Lines of the ADMA descriptor table */
 };
 
+/*******************************************************************************
+*
+* @brief Structure holding the storage of an SD controller, provided by the caller
+*        of sd_ctrl_mmc_probe_static instead of being allocated. Declare it with
+*        SD_CTRL_STORAGE, which sizes the ADMA table for the largest transfer.
+*
+******************************************************************************/
+struct sd_ctrl_storage {
+    struct sd_ctrl_dev dev;     	/* Device structure */
+    TransModeStruct trans;      	/* Transaction mode settings */
+    u32 *adma;                  	/* ADMA descriptor table */
+    u32 adma_lines;             	/* Lines of the ADMA descriptor table */
+};
+
+// ADMA lines needed by a transfer of the given size, 64KB per line
+#define SD_ADMA_LINES(bytes)			(((bytes) + MAX_DESCRIPTOR - 1) / MAX_DESCRIPTOR)
+
+// Declares the static storage of an SD controller for transfers up to max_bytes
+#define SD_CTRL_STORAGE(name, max_bytes) \
+    static u32 name##_adma[2*SD_ADMA_LINES(max_bytes)] __attribute__((aligned(8), unused)); \
+    static struct sd_ctrl_storage name __attribute__((unused)) = { .adma = name##_adma, .adma_lines = SD_ADMA_LINES(max_bytes) }
+
+// Largest transfer of the storage used by sd_ctrl_mmc_probe
+#ifndef SD_MAX_TRANSFER_BYTES
+#define SD_MAX_TRANSFER_BYTES			(4*1024*1024)
+#endif
+
 IntStruct IntPtr; 				/* Global interrupt status structure */
-u32 Descriptor[64];				/* Array to hold Descriptor */
-u32 DataDescriptor[64];			/* Array to hold Data Descriptor */
-u32 AttributeDescriptor[64]; 	/* Array to hold Attribute Descriptor */
+#ifndef DMA_MODE
+u32 BounceBuffer[BLOCK_SIZE/4];	/* Block copy of unaligned PIO buffers */
+#endif
+SD_CTRL_STORAGE(SdCtrlStorage, SD_MAX_TRANSFER_BYTES);	/* Storage of sd_ctrl_mmc_probe */
 
 
 
@@ -183,16 +242,15 @@ static uint32_t sd_ctrl_read(struct sd_ctrl_dev *dev, uint32_t offset)
 
 /*******************************************************************************
 *
-* @brief This function sends a command to the SD controller device and handles the response accordingly.
+* @brief This function writes a command and the current transfer mode to the SD controller 
+*        device, without waiting for the command complete interrupt.
 *
 * @param mmc  Pointer to the MMC structure.
 * @param cmd  Pointer to the MMC command structure containing command details.
-* @return     0 on success, -1 on failure.
 *
 ******************************************************************************/
-static int sd_ctrl_cmd(struct mmc *mmc, struct mmc_cmd *cmd)
+static void sd_ctrl_cmd_start(struct mmc *mmc, struct mmc_cmd *cmd)
 {
-	int time_out;
 	u32 Value;
 	struct sd_ctrl_dev *dev = mmc->priv;
 
@@ -254,7 +312,26 @@ static int sd_ctrl_cmd(struct mmc *mmc, struct mmc_cmd *cmd)
 	while(read_u32(PROBE_ADDR+0x008)&0x1) {
 		bsp_uDelay(1);
 	}
+	SD_TRACE_BEGIN(cmd->cmdidx,cmd->cmdarg,dev->app_cmd);
 	sd_ctrl_write(dev,SDHC_ADDR+REG_TRANFER_MODE,Value);
+}
+
+/*******************************************************************************
+*
+* @brief This function sends a command to the SD controller device and handles the response accordingly.
+*
+* @param mmc  Pointer to the MMC structure.
+* @param cmd  Pointer to the MMC command structure containing command details.
+* @return     0 on success, -1 on failure.
+*
+******************************************************************************/
+static int sd_ctrl_cmd(struct mmc *mmc, struct mmc_cmd *cmd)
+{
+	int time_out;
+	int ret = 0;
+	struct sd_ctrl_dev *dev = mmc->priv;
+
+	sd_ctrl_cmd_start(mmc,cmd);
 
 	time_out = 0;
 	while(1) {
@@ -277,12 +354,15 @@ static int sd_ctrl_cmd(struct mmc *mmc, struct mmc_cmd *cmd)
 					cmd->response[0] = sd_ctrl_read(dev,SDHC_ADDR+REG_COMMAND_RESP31_0);//cmd_resp[31:0]
 					cmd->response[1] = sd_ctrl_read(dev,SDHC_ADDR+REG_COMMAND_RESP63_32);//cmd_resp[63:32]
 				}
+				SD_TRACE_RESP((cmd->resp_type&0xf) ? cmd->response[0] : 0,0);
 
 			} else {
+				SD_TRACE_RESP(0,SD_TRACE_INT_ERR(IntPtr));
 				IntPtr.command_timeout_error = 0x0;
 				IntPtr.command_crc_error = 0x0;
 				IntPtr.command_end_bit_error = 0x0;
 				IntPtr.command_index_error = 0x0;
+				ret = -1;
 
 				if(DEBUG_PRINTF_EN == 1)
 					bsp_printf("Err : CMD Failed!\n\r");
@@ -299,43 +379,42 @@ static int sd_ctrl_cmd(struct mmc *mmc, struct mmc_cmd *cmd)
 
 	mmc->priv = dev;
 
-	return 0;
+	return ret;
 }
 
 /*******************************************************************************
 *
-* @brief This function creates a descriptor for data transfer by allocating memory 
-* for the descriptor table and setting up the descriptor entries. It calculates the 
-* number of lines required for the descriptor table based on the block size and 
-* number of blocks to transfer.
+* @brief This function creates a descriptor for data transfer by setting up the entries
+* of the descriptor table of the device. It calculates the number of lines required 
+* for the descriptor table based on the block size and number of blocks to transfer.
 *
 * @param mmc        Pointer to the MMC structure.
 * @param blocks     Number of blocks to transfer.
 * @param block_size Size of each block.
 * @param src        Source buffer for data transfer.
-* @return           0 on success, -1 on failure.
+* @return           0 on success, -1 if the transfer does not fit in the table.
 *
  ******************************************************************************/
 static int sd_ctrl_creat_Descriptor(struct mmc *mmc,u32 blocks,u32 block_size ,char* src)
 {
 	u32 Value=0;
 	u32 addr_location;
-	u32 lenght,sub,line,n;
+	u32 lenght,line,n;
 
 	struct sd_ctrl_dev *dev = mmc->priv;
 
-	//Max 64 line Descriptor
-	//Descriptor=malloc(sizeof(u32)*64);
-	memset(Descriptor,0,sizeof(Descriptor));
-	memset(DataDescriptor,0,sizeof(DataDescriptor));
-	memset(AttributeDescriptor,0,sizeof(AttributeDescriptor));
-
 	lenght = block_size*blocks;
 
 	line=(lenght/MAX_DESCRIPTOR);
 
 	if(lenght%MAX_DESCRIPTOR) line++;
 
+	//Table sized at compile time, see SD_CTRL_STORAGE
+	if(line > dev->adma_lines) {
+		bsp_printf("Err : %d bytes exceed the ADMA table\r\n",lenght);
+		return -1;
+	}
+
 	if(DEBUG_PRINTF_EN == 1)
 		bsp_printf("lenght = %d line = %d in Addr = 0x%x\r\n",lenght,line,(u32)src);
 
@@ -362,27 +441,174 @@ static int sd_ctrl_creat_Descriptor(struct mmc *mmc,u32 blocks,u32 block_size ,c
 
 		//Descriptor Table - Length
 		//The maximum data length of each descriptor line is less than 64KB. 0x0=65536 0x1=1 0x2=2......0xFFFFFFFF=65535
-		DataDescriptor[n]=((u32)Descriptor)+(sizeof(u32)*2*n);
-		write_u32(Value, DataDescriptor[n]);
-
-		AttributeDescriptor[n]=((u32)Descriptor)+sizeof(u32)+(sizeof(u32)*2*n);
+		dev->adma[2*n] = Value;
 
 		//Descriptor Table - Address Field
 		addr_location=((u32)src+(n*MAX_DESCRIPTOR)) & 0xFFFFFFFF;
-		write_u32(addr_location, AttributeDescriptor[n]);
+		dev->adma[2*n+1] = addr_location;
 
 		if (lenght > MAX_DESCRIPTOR)
 			lenght = lenght - MAX_DESCRIPTOR;
 
 		if(DEBUG_PRINTF_EN == 1)
-			bsp_printf("%d AttributeDescriptor[0x%x] = 0x%x  Data[0x%x] = 0x%x\r\n",n,AttributeDescriptor[n],addr_location,DataDescriptor[n],Value);
+			bsp_printf("%d AttributeDescriptor[0x%x] = 0x%x  Data[0x%x] = 0x%x\r\n",n,(u32)&dev->adma[2*n+1],addr_location,(u32)&dev->adma[2*n],Value);
 	}
 
-	sd_ctrl_write(dev,SDHC_ADDR+REG_ADMA_SYSTEM_ADDR0,DataDescriptor[0]);//sdhc_reg - adma_system_address[31:0]
+	asm volatile ("" : : : "memory");
+	sd_ctrl_write(dev,SDHC_ADDR+REG_ADMA_SYSTEM_ADDR0,(u32)dev->adma);//sdhc_reg - adma_system_address[31:0]
 
 	return 0;
 }
 
+#ifndef DMA_MODE
+/*******************************************************************************
+*
+* @brief This function writes blocks to the controller buffer without DMA. Each block is
+*        pushed as a whole once the buffer write enable bit is set, with aligned word 
+*        loads. Unaligned sources go through BounceBuffer.
+*
+* @param dev        Pointer to the SD controller device structure.
+* @param src        Source buffer.
+* @param blocks     Number of blocks to write.
+* @param blocksize  Size of each block, multiple of 4 and up to BLOCK_SIZE.
+*
+******************************************************************************/
+static void sd_ctrl_pio_write(struct sd_ctrl_dev *dev, const char *src, u32 blocks, u32 blocksize)
+{
+	const u32 *p;
+	u32 words = blocksize/4;
+
+	for(u32 i=0; i<blocks; i++) {
+		//Wait one block data can be written to the buffer.
+		while(!(sd_ctrl_read(dev,SDHC_ADDR+REG_PRESENT_STATE)&PRESENT_STATE_BUFFER_WRITE_EN));
+
+		if((u32)src & 0x3) {
+			memcpy(BounceBuffer,src,blocksize);
+			p = BounceBuffer;
+		} else {
+			p = (const u32 *)src;
+		}
+
+		//Write One Block
+		for(u32 j=0; j<words; j++) {
+			sd_ctrl_write(dev,SDHC_ADDR+REG_BUFFER_DATA,p[j]);//sdhc_reg - buffer_data_port Register
+		}
+		src += blocksize;
+	}
+}
+
+/*******************************************************************************
+*
+* @brief This function reads blocks from the controller buffer without DMA. Each block is
+*        drained as a whole once the buffer read enable bit is set, with aligned word 
+*        stores. Unaligned destinations go through BounceBuffer.
+*
+* @param dev        Pointer to the SD controller device structure.
+* @param dest       Destination buffer.
+* @param blocks     Number of blocks to read.
+* @param blocksize  Size of each block, multiple of 4 and up to BLOCK_SIZE.
+*
+* @note Define SD_PIO_LEGACY_PACING to get back the former 1us delay after each word, 
+*       for throughput comparison or if the read rate has to stay under the SD clock rate.
+*
+******************************************************************************/
+static void sd_ctrl_pio_read(struct sd_ctrl_dev *dev, char *dest, u32 blocks, u32 blocksize)
+{
+	u32 *p;
+	u32 words = blocksize/4;
+
+	for(u32 i=0; i<blocks; i++) {
+		//Wait readable block data exists in the buffer.
+		while(!(sd_ctrl_read(dev,SDHC_ADDR+REG_PRESENT_STATE)&PRESENT_STATE_BUFFER_READ_EN)) {
+#ifdef SD_PIO_LEGACY_PACING
+			bsp_uDelay(1);
+#endif
+		}
+
+		p = ((u32)dest & 0x3) ? BounceBuffer : (u32 *)dest;
+
+		//Read One Block
+		for(u32 j=0; j<words; j++) {
+			p[j] = sd_ctrl_read(dev,SDHC_ADDR+REG_BUFFER_DATA);
+#ifdef SD_PIO_LEGACY_PACING
+			bsp_uDelay(1);
+#endif
+		}
+
+		if(p == BounceBuffer) memcpy(dest,BounceBuffer,blocksize);
+		dest += blocksize;
+	}
+}
+#endif
+
+/*******************************************************************************
+*
+* @brief This function resets the CMD and DAT lines of the controller and waits
+*        for the self clearing reset bits, after a failed command or transfer.
+*
+* @param mmc  Pointer to the MMC structure representing the MMC/SD card.
+*
+*******************************************************************************/
+static void sd_ctrl_reset_lines(struct mmc *mmc)
+{
+	struct sd_ctrl_dev *dev = mmc->priv;
+	u32 Value, t;
+
+	Value = sd_ctrl_read(dev,SDHC_ADDR+REG_CLOCK_CONTORL);
+	sd_ctrl_write(dev,SDHC_ADDR+REG_CLOCK_CONTORL,Value | CLOCK_CONTROL_RESET_CMD | CLOCK_CONTROL_RESET_DAT);
+	for(t=0; t<SD_RESET_TIMEOUT_US; t++) {
+		if(!(sd_ctrl_read(dev,SDHC_ADDR+REG_CLOCK_CONTORL) & (CLOCK_CONTROL_RESET_CMD | CLOCK_CONTROL_RESET_DAT)))
+			break;
+		bsp_uDelay(1);
+	}
+}
+
+/*******************************************************************************
+*
+* @brief This function clears the interrupt flags latched in IntPtr, such as a
+*        transfer complete arriving after an error.
+*
+*******************************************************************************/
+static void sd_ctrl_int_clear(void)
+{
+	IntPtr.command_complete = 0x0;
+	IntPtr.transfer_complete = 0x0;
+	IntPtr.buffer_write_ready = 0x0;
+	IntPtr.buffer_read_ready = 0x0;
+	IntPtr.command_timeout_error = 0x0;
+	IntPtr.command_crc_error = 0x0;
+	IntPtr.command_end_bit_error = 0x0;
+	IntPtr.command_index_error = 0x0;
+	IntPtr.data_crc_error = 0x0;
+}
+
+/*******************************************************************************
+*
+* @brief This function recovers from a failed data transfer: the CMD and DAT lines
+*        of the controller are reset, a multiple block transfer is stopped with
+*        CMD12, and the interrupt flags latched meanwhile (such as a late
+*        transfer complete) are cleared, so that the next command starts clean.
+*
+* @param mmc   Pointer to the MMC structure representing the MMC/SD card.
+* @param data  Transfer which failed.
+*
+*******************************************************************************/
+static void sd_ctrl_abort_data(struct mmc *mmc, struct mmc_data *data)
+{
+	struct mmc_cmd stop;
+
+	sd_ctrl_reset_lines(mmc);
+
+	if(data->blocks > 1) {
+		stop.cmdidx = MMC_CMD_STOP_TRANSMISSION;
+		stop.cmdarg = 0;
+		stop.resp_type = MMC_RSP_R1b;
+		sd_ctrl_cmd(mmc,&stop);
+	}
+
+	sd_ctrl_int_clear();
+}
+
 /*******************************************************************************
 *
 * @brief This function handles data transfer between the SD controller and the SD card.
@@ -390,12 +616,11 @@ static int sd_ctrl_creat_Descriptor(struct mmc *mmc,u32 blocks,u32 block_size ,c
 * @param mmc Pointer to the MMC structure representing the MMC/SD card.
 * @param cmd Pointer to the MMC command structure.
 * @param data Pointer to the MMC data structure containing data transfer information.
-* @return Returns 0 upon successful data transfer.
+* @return Returns 0 upon successful data transfer, -1 on command or data CRC error.
 *
 ******************************************************************************/
 static int sd_ctrl_data(struct mmc *mmc, struct mmc_cmd *cmd, struct mmc_data *data)
 {
-	u32 buf=0,tmp=0;
 	struct sd_ctrl_dev *dev =mmc->priv;
 
 	//Transfer Mode Set
@@ -408,10 +633,13 @@ static int sd_ctrl_data(struct mmc *mmc, struct mmc_cmd *cmd, struct mmc_data *d
 #ifdef DMA_MODE
 
 	dev->TransModePtr->dma_enable = 0x1;
-	if(data->flags==MMC_DATA_WRITE)
-		sd_ctrl_creat_Descriptor(mmc,data->blocks,data->blocksize,(char*)data->src);
-	else
-		sd_ctrl_creat_Descriptor(mmc,data->blocks,data->blocksize,data->dest);
+	if(data->flags==MMC_DATA_WRITE) {
+		if(sd_ctrl_creat_Descriptor(mmc,data->blocks,data->blocksize,(char*)data->src))
+			return -1;
+	} else {
+		if(sd_ctrl_creat_Descriptor(mmc,data->blocks,data->blocksize,data->dest))
+			return -1;
+	}
 
 #else
 	dev->TransModePtr->dma_enable = 0x0;
@@ -433,7 +661,9 @@ static int sd_ctrl_data(struct mmc *mmc, struct mmc_cmd *cmd, struct mmc_data *d
 	//Set Block Size & Block Count
 		sd_ctrl_write(dev,SDHC_ADDR+REG_BLOCKSIZE_COUNT,((data->blocks&0xffff)<<16) | data->blocksize);//sdhc_reg - Block Size & Block Count Register
 
-		sd_ctrl_cmd(mmc,cmd);
+		SD_TRACE_DATA(data->blocks);
+		if(sd_ctrl_cmd(mmc,cmd))
+			return -1;
 
 
 		if(DEBUG_PRINTF_EN == 1)
@@ -464,62 +694,34 @@ static int sd_ctrl_data(struct mmc *mmc, struct mmc_cmd *cmd, struct mmc_data *d
 #ifndef DMA_MODE
 
 	if(data->flags==MMC_DATA_WRITE)
-	{
-		for(int i=0; i<(data->blocks); i++) {
-
-			//Wait one block data can be written to the buffer.
-			while(1) {
-				if(sd_ctrl_read(dev,SDHC_ADDR+REG_PRESENT_STATE)&0x400) {
-					break;
-				}
-				//bsp_uDelay(1);
-			}
-			//Write One Block
-			for(int j=0; j<((data->blocksize)/4); j++) {
-
-				buf = data->src[tmp++];
-				buf |= data->src[tmp++]<<8;
-				buf |= data->src[tmp++]<<16;
-				buf |= data->src[tmp++]<<24;
-				//bsp_printf("WRITE %x \r\n",buf);
-
-				sd_ctrl_write(dev,SDHC_ADDR+REG_BUFFER_DATA,buf);//sdhc_reg - buffer_data_port Register
-			}
-		}
-	}
+		sd_ctrl_pio_write(dev,data->src,data->blocks,data->blocksize);
 	else
-	{
-		for(int i=0; i<data->blocks; i++) {
-			//Wait readable block data exists in the buffer.
-			while(1) {
-				if(sd_ctrl_read(dev,SDHC_ADDR+REG_PRESENT_STATE)&0x800) {
-					break;
-				}
-				bsp_uDelay(1);
-			}
-			//Read One Block
-			for(int j=0; j<(BLOCK_SIZE/4); j++) {
-				buf = sd_ctrl_read(dev,SDHC_ADDR+REG_BUFFER_DATA);
-
-				data->dest[tmp++]=buf & 0xFF;
-				data->dest[tmp++]=(buf>>8) & 0xFF;
-				data->dest[tmp++]=(buf>>16) & 0xFF;
-				data->dest[tmp++]=(buf>>24) & 0xFF;
-
-				bsp_uDelay(1);//Must ensure that the read rate is lower than the SD clock rate.
-			}
-		}
-	}
+		sd_ctrl_pio_read(dev,data->dest,data->blocks,data->blocksize);
 
 #endif
-	//Wait Transfer Complete Interrupt
+	//Wait Transfer Complete Interrupt, a data CRC error may end the transfer early
 	while(1) {
 		if(IntPtr.transfer_complete == 0x1) {
 			IntPtr.transfer_complete = 0x0;
 			//bsp_uDelay(100);
 			break;
 		}
+		if(IntPtr.data_crc_error == 0x1)
+			break;
+	}
+	SD_TRACE_END(IntPtr.data_crc_error ? SD_TRACE_ERR_DATA_CRC : 0);
+
+	if(IntPtr.data_crc_error == 0x1) {
+		sd_ctrl_abort_data(mmc,data);
+		if(DEBUG_PRINTF_EN == 1)
+			bsp_printf("Err : Data CRC Error!\n\r");
+		return -1;
 	}
+
+#ifdef DMA_MODE
+	if(data->flags==MMC_DATA_READ)
+		data_cache_invalidate_range(data->dest,data->blocks*data->blocksize);
+#endif
 	return 0;
 }
 
@@ -536,6 +738,7 @@ static int sd_ctrl_data(struct mmc *mmc, struct mmc_cmd *cmd, struct mmc_data *d
 static int sd_ctrl_check_read_write(struct mmc_cmd *cmd)
 {
 		 if(cmd->cmdidx== MMC_CMD_READ_SINGLE_BLOCK)	return 1;
+	else if(cmd->cmdidx== SD_CMD_SWITCH_FUNC)			return 1;
 	else if(cmd->cmdidx== MMC_CMD_READ_MULTIPLE_BLOCK)	return 1;
 	else if(cmd->cmdidx== MMC_CMD_WRITE_SINGLE_BLOCK)	return 1;
 	else if(cmd->cmdidx== MMC_CMD_WRITE_MULTIPLE_BLOCK)	return 1;
@@ -550,24 +753,18 @@ static int sd_ctrl_check_read_write(struct mmc_cmd *cmd)
 * @param mmc Pointer to the MMC structure representing the MMC/SD card.
 * @param cmd Pointer to the MMC command structure.
 * @param data Pointer to the MMC data structure containing data transfer information.
-* @return Returns 0 upon successful command execution.
+* @return Returns 0 upon successful command execution, -1 on error.
 *
 *******************************************************************************/
 static int sd_ctrl_send_cmd(struct mmc *mmc, struct mmc_cmd *cmd, struct mmc_data *data)
 {
-	if(sd_ctrl_check_read_write(cmd))
-	{
-		if(data)
-		{
-			sd_ctrl_data(mmc,cmd,data);
-		}
-	}
-	else
-	{
-		sd_ctrl_cmd(mmc,cmd);
-	}
+	struct sd_ctrl_dev *dev = mmc->priv;
 
-	return 0;
+	//CMD6 carries data, ACMD6 (SET_BUS_WIDTH) shares its index but does not
+	if(data && sd_ctrl_check_read_write(cmd) && !(cmd->cmdidx == SD_CMD_SWITCH_FUNC && dev->app_cmd))
+		return sd_ctrl_data(mmc,cmd,data);
+
+	return sd_ctrl_cmd(mmc,cmd);
 }
 
 /*******************************************************************************
@@ -626,6 +823,7 @@ static int sd_ctrl_set_clk(struct mmc *mmc)
 
 	//sys_reg - clk_out_en & clk_out_div
 	sd_ctrl_write(dev,0x004,(0x1<<16) | Value);
+	SD_TRACE_EVENT(SD_TRACE_EV_CLOCK,clk);
 
 	if(DEBUG_PRINTF_EN == 1)
 		bsp_printf("SDS Clock Division Coefficient %d\r\n", Value);
@@ -637,7 +835,7 @@ static int sd_ctrl_set_clk(struct mmc *mmc)
 
 /*******************************************************************************
 *
-* @brief This function sets the bus width for SD operations.
+* @brief This function sets the bus width and the high speed timing for SD operations.
 *
 * @param mmc Pointer to the MMC structure representing the MMC/SD card.
 * @return Returns 0 upon successful bus width setting.
@@ -651,7 +849,11 @@ static int sd_ctrl_set_bus(struct mmc *mmc)
 	if(mmc->bus_width >=4)	set_width=2;	//4 bit
 	else					set_width=1;	//1 bit
 
+	if(mmc->card_caps & MMC_MODE_HS)
+		set_width |= HOST_CONTROL_HIGH_SPEED;	//Drive on the rising edge
+
 	sd_ctrl_write(dev,SDHC_ADDR+REG_HOST_CONTORL,set_width);
+	SD_TRACE_EVENT(SD_TRACE_EV_BUS,set_width);
 
 	return 0;
 }
@@ -689,24 +891,46 @@ static int sd_ctrl_init(struct mmc *mmc)
 
 /*******************************************************************************
 *
-* @brief This function probes and initializes the MMC/SD controller.
+* @brief This function returns the largest block count of one data command, bounded
+*        by the block count register and, in DMA mode, by the ADMA table.
+*
+* @param mmc Pointer to the MMC structure representing the MMC/SD card.
+* @return Returns the maximum number of blocks of BLOCK_SIZE.
+*
+*******************************************************************************/
+static u32 sd_ctrl_max_blocks(struct mmc *mmc)
+{
+#ifdef DMA_MODE
+    struct sd_ctrl_dev *dev = mmc->priv;
+    u32 blocks = dev->adma_lines * (MAX_DESCRIPTOR / BLOCK_SIZE);
+
+    if(blocks < MAX_BLOCK_COUNT)
+        return blocks;
+#else
+    (void)mmc;
+#endif
+    return MAX_BLOCK_COUNT;
+}
+
+/*******************************************************************************
+*
+* @brief This function probes and initializes the MMC/SD controller. The device
+*        structures and the ADMA table live in the storage given by the caller,
+*        nothing is allocated.
 *
 * @param mmc Pointer to the MMC structure representing the MMC/SD card.
 * @param base_addr Base address of the SD controller.
+* @param st Storage of the controller, declared with SD_CTRL_STORAGE.
 * @return Returns 0 upon successful probe and initialization.
 *
 *******************************************************************************/
 
-static int sd_ctrl_mmc_probe(struct mmc *mmc, int base_addr)
+static int sd_ctrl_mmc_probe_static(struct mmc *mmc, int base_addr, struct sd_ctrl_storage *st)
 {
-    struct sd_ctrl_dev *dev;
-    TransModeStruct *ptr;
-
-    // Allocate memory for SD controller device and transfer mode structure
-    dev = malloc(sizeof(struct sd_ctrl_dev));
-    ptr = malloc(sizeof(TransModeStruct));
+    struct sd_ctrl_dev *dev = &st->dev;
+    TransModeStruct *ptr = &st->trans;
 
-    // Initialize allocated memory with zeros
+    // Initialize the storage with zeros
     memset(dev, 0, sizeof(struct sd_ctrl_dev));
     memset(ptr, 0, sizeof(TransModeStruct));
 
@@ -714,6 +938,8 @@ static int sd_ctrl_mmc_probe(struct mmc *mmc, int base_addr)
     dev->base_addr = base_addr;
     dev->clk_freq = SD_CLK_FREQ;
     dev->TransModePtr = ptr;
+    dev->adma = st->adma;
+    dev->adma_lines = st->adma_lines;
 
     // Set MMC private data to SD controller device
     mmc->priv = dev;
@@ -729,7 +955,7 @@ static int sd_ctrl_mmc_probe(struct mmc *mmc, int base_addr)
     mmc->f_max = MAX_CLK_FREQ;
     mmc->f_min = MAX_CLK_FREQ / 4;
     mmc->host_caps = MMC_MODE_4BIT;
-    mmc->cfg->b_max = 1024;
+    mmc->cfg->b_max = sd_ctrl_max_blocks(mmc);
     mmc->bus_width = 4;
     mmc->high_capacity = 1;
     mmc->read_bl_len = BLOCK_SIZE;
@@ -742,3 +968,259 @@ static int sd_ctrl_mmc_probe(struct mmc *mmc, int base_addr)
 
     return 0;
 }
+
+/*******************************************************************************
+*
+* @brief This function probes and initializes the MMC/SD controller over the default
+*        storage, sized for transfers up to SD_MAX_TRANSFER_BYTES.
+*
+* @param mmc Pointer to the MMC structure representing the MMC/SD card.
+* @param base_addr Base address of the SD controller.
+* @return Returns 0 upon successful probe and initialization.
+*
+*******************************************************************************/
+
+static int sd_ctrl_mmc_probe(struct mmc *mmc, int base_addr)
+{
+    return sd_ctrl_mmc_probe_static(mmc, base_addr, &SdCtrlStorage);
+}
+
+/*******************************************************************************
+*
+* @brief This function reads blocks from the card with CMD17, or CMD18 for several blocks.
+*        Reads longer than sd_ctrl_max_blocks are split into several commands.
+*
+* @param mmc     Pointer to the MMC structure representing the MMC/SD card.
+* @param start   First block to read.
+* @param blkcnt  Number of blocks to read.
+* @param dst     Destination buffer.
+* @return        Returns 0 upon successful read, -1 on error.
+*
+*******************************************************************************/
+static int sd_ctrl_read_blocks(struct mmc *mmc, u32 start, u32 blkcnt, char *dst)
+{
+	struct mmc_cmd cmd;
+	struct mmc_data data;
+	u32 max = sd_ctrl_max_blocks(mmc);
+	u32 n;
+
+	for(; blkcnt; blkcnt-=n, start+=n, dst+=n*BLOCK_SIZE) {
+		n = blkcnt > max ? max : blkcnt;
+
+		cmd.cmdidx = n > 1 ? MMC_CMD_READ_MULTIPLE_BLOCK : MMC_CMD_READ_SINGLE_BLOCK;
+		cmd.cmdarg = mmc->high_capacity ? start : start * BLOCK_SIZE;
+		cmd.resp_type = MMC_RSP_R1;
+
+		data.dest = dst;
+		data.blocks = n;
+		data.blocksize = BLOCK_SIZE;
+		data.flags = MMC_DATA_READ;
+
+		if(sd_ctrl_send_cmd(mmc,&cmd,&data))
+			return -1;
+	}
+
+	return 0;
+}
+
+/*******************************************************************************
+*
+* @brief This function writes blocks to the card with CMD24, or CMD25 for several blocks.
+*        Writes longer than sd_ctrl_max_blocks are split into several commands.
+*
+* @param mmc     Pointer to the MMC structure representing the MMC/SD card.
+* @param start   First block to write.
+* @param blkcnt  Number of blocks to write.
+* @param src     Source buffer.
+* @return        Returns 0 upon successful write, -1 on error.
+*
+*******************************************************************************/
+static int sd_ctrl_write_blocks(struct mmc *mmc, u32 start, u32 blkcnt, const char *src)
+{
+	struct mmc_cmd cmd;
+	struct mmc_data data;
+	u32 max = sd_ctrl_max_blocks(mmc);
+	u32 n;
+
+	for(; blkcnt; blkcnt-=n, start+=n, src+=n*BLOCK_SIZE) {
+		n = blkcnt > max ? max : blkcnt;
+
+		cmd.cmdidx = n > 1 ? MMC_CMD_WRITE_MULTIPLE_BLOCK : MMC_CMD_WRITE_SINGLE_BLOCK;
+		cmd.cmdarg = mmc->high_capacity ? start : start * BLOCK_SIZE;
+		cmd.resp_type = MMC_RSP_R1;
+
+		data.src = src;
+		data.blocks = n;
+		data.blocksize = BLOCK_SIZE;
+		data.flags = MMC_DATA_WRITE;
+
+		if(sd_ctrl_send_cmd(mmc,&cmd,&data))
+			return -1;
+	}
+
+	return 0;
+}
+
+/*******************************************************************************
+*
+* @brief This function measures the read throughput of the card and prints it in MB/s.
+*        Build it with and without SD_PIO_LEGACY_PACING to compare the PIO pacing.
+*
+* @param mmc     Pointer to the MMC structure representing the MMC/SD card.
+* @param start   First block to read.
+* @param blkcnt  Number of blocks per read command.
+* @param dst     Destination buffer of blkcnt blocks.
+* @param loops   Number of read commands.
+* @return        Throughput in KB/s.
+*
+*******************************************************************************/
+static u32 sd_ctrl_read_speed(struct mmc *mmc, u32 start, u32 blkcnt, char *dst, u32 loops)
+{
+	u32 t, kbps;
+	u64 bytes = (u64)blkcnt * BLOCK_SIZE * loops;
+
+	t = clint_getTimeLow(BSP_CLINT);
+	for(u32 i=0; i<loops; i++)
+		sd_ctrl_read_blocks(mmc,start,blkcnt,dst);
+	t = clint_getTimeLow(BSP_CLINT) - t;
+
+	kbps = (u32)(bytes * (BSP_CLINT_HZ / 1000) / (t ? t : 1));
+	bsp_printf("SD read %d blocks x %d: %d.%d MB/s\r\n",blkcnt,loops,kbps/1000,(kbps%1000)/100);
+
+	return kbps;
+}
+
+/*******************************************************************************
+*
+* @brief This function queries or switches the access mode (function group 1) of the
+*        card with CMD6 and reads back its 64 bytes switch status.
+*
+* @param mmc     Pointer to the MMC structure representing the MMC/SD card.
+* @param mode    SD_SWITCH_CHECK to query, SD_SWITCH_SET to switch.
+* @param value   Function of group 1, SD_SWITCH_ACCESS_HS for High-Speed.
+* @param status  Word aligned buffer of SD_SWITCH_STATUS_SIZE bytes for the status.
+* @return        Returns 0 if the card reports the function as selected, -1 otherwise.
+*
+*******************************************************************************/
+static int sd_ctrl_switch_func(struct mmc *mmc, u32 mode, u32 value, u8 *status)
+{
+	struct mmc_cmd cmd;
+	struct mmc_data data;
+	u32 support;
+
+	//Other groups are left unchanged (0xF)
+	cmd.cmdidx = SD_CMD_SWITCH_FUNC;
+	cmd.cmdarg = (mode<<31) | 0x00FFFFF0 | (value&0xF);
+	cmd.resp_type = MMC_RSP_R1;
+
+	data.dest = (char *)status;
+	data.blocks = 1;
+	data.blocksize = SD_SWITCH_STATUS_SIZE;
+	data.flags = MMC_DATA_READ;
+
+	if(sd_ctrl_send_cmd(mmc,&cmd,&data))
+		return -1;
+
+	//Status bits 415:400 are the group 1 support bits, 379:376 the group 1 selection
+	support = (status[12]<<8) | status[13];
+	if(DEBUG_PRINTF_EN == 1)
+		bsp_printf("CMD6 mode %d support 0x%x selected %d\r\n",mode,support,status[16]&0xF);
+
+	if(!(support & (1<<value)) || (status[16]&0xF) != value)
+		return -1;
+
+	return 0;
+}
+
+/*******************************************************************************
+*
+* @brief This function checks that reads at the current clock are stable. The blocks
+*        are read SD_SPEED_TEST_LOOPS times and compared with a reference read at a
+*        safe clock.
+*
+* @param mmc  Pointer to the MMC structure representing the MMC/SD card.
+* @param lba  First block of the test area.
+* @param ref  Reference data, SD_SPEED_TEST_BLOCKS blocks.
+* @param buf  Read buffer, SD_SPEED_TEST_BLOCKS blocks.
+* @return     Returns 0 if every read succeeds and matches, -1 otherwise.
+*
+*******************************************************************************/
+static int sd_ctrl_speed_test(struct mmc *mmc, u32 lba, const char *ref, char *buf)
+{
+	for(u32 i=0; i<SD_SPEED_TEST_LOOPS; i++) {
+		memset(buf,0,SD_SPEED_TEST_BLOCKS*BLOCK_SIZE);
+		if(sd_ctrl_read_blocks(mmc,lba,SD_SPEED_TEST_BLOCKS,buf))
+			return -1;
+		if(memcmp(buf,ref,SD_SPEED_TEST_BLOCKS*BLOCK_SIZE))
+			return -1;
+	}
+
+	return 0;
+}
+
+/*******************************************************************************
+*
+* @brief This function switches the card and the controller to High-Speed (SDR25)
+*        when the card supports it, then selects the fastest stable clock. The clock
+*        steps down a ladder while the read test fails on CRC errors or mismatches,
+*        down to f_min. To be called once the card is in transfer state.
+*
+* @param mmc      Pointer to the MMC structure representing the MMC/SD card.
+* @param lba      First block of a readable test area of SD_SPEED_TEST_BLOCKS blocks.
+* @param scratch  Word aligned buffer of 2 x SD_SPEED_TEST_BLOCKS blocks.
+* @return         Selected clock in KHz, or -1 if the card is not stable at any step.
+*
+*******************************************************************************/
+static int sd_ctrl_high_speed(struct mmc *mmc, u32 lba, char *scratch)
+{
+	static const u32 ladder[] = { 50000, 33333, 25000, 12500 };
+	struct sd_ctrl_dev *dev = mmc->priv;
+	char *ref = scratch;
+	char *buf = scratch + SD_SPEED_TEST_BLOCKS*BLOCK_SIZE;
+	int retry;
+	u32 max, n;
+
+	//Reference data at the Default Speed clock, twice identical
+	mmc->card_caps &= ~MMC_MODE_HS;
+	sd_ctrl_set_bus(mmc);
+	dev->clk_freq = 25000;
+	sd_ctrl_set_clk(mmc);
+	for(retry=0; retry<3; retry++) {
+		if(sd_ctrl_read_blocks(mmc,lba,SD_SPEED_TEST_BLOCKS,ref) == 0 &&
+		   sd_ctrl_speed_test(mmc,lba,ref,buf) == 0)
+			break;
+	}
+	if(retry == 3) {
+		bsp_printf("Err : SD reference read failed\r\n");
+		return -1;
+	}
+
+	//Default Speed is limited to 25MHz, High-Speed to 50MHz
+	max = 25000;
+	if(sd_ctrl_switch_func(mmc,SD_SWITCH_CHECK,SD_SWITCH_ACCESS_HS,(u8 *)buf) == 0 &&
+	   sd_ctrl_switch_func(mmc,SD_SWITCH_SET,SD_SWITCH_ACCESS_HS,(u8 *)buf) == 0) {
+		//The card switches within 8 clocks after the end of the status block
+		bsp_uDelay(10);
+		mmc->card_caps |= MMC_MODE_HS;
+		sd_ctrl_set_bus(mmc);
+		max = 50000;
+	}
+
+	for(n=0; n<sizeof(ladder)/sizeof(ladder[0]); n++) {
+		if(ladder[n] > max || ladder[n] > mmc->f_max || ladder[n] < mmc->f_min)
+			continue;
+
+		dev->clk_freq = ladder[n];
+		sd_ctrl_set_clk(mmc);
+		if(sd_ctrl_speed_test(mmc,lba,ref,buf) == 0) {
+			bsp_printf("SD %s mode at %d KHz\r\n",(mmc->card_caps & MMC_MODE_HS) ? "High-Speed" : "Default Speed",mmc->clock);
+			return mmc->clock;
+		}
+
+		if(DEBUG_PRINTF_EN == 1)
+			bsp_printf("SD unstable at %d KHz\r\n",mmc->clock);
+	}
+
+	bsp_printf("Err : SD not stable at any clock\r\n");
+	return -1;
+}
@@ -0,0 +1,449 @@
+/*******************************************************************************
+*
+* @file efx_mmc_queue.h
+*
+* @brief Header file for a queued block I/O layer on top of the SD controller ADMA.
+*        Requests are queued without blocking and completed from the SD controller
+*        interrupt. Two ADMA descriptor tables are used alternately, the table of
+*        the next command is built while the current one is transferring, so the
+*        interrupt handler only has to point the controller to it and issue the
+*        command.
+*
+*        Consecutive requests of the same direction on contiguous LBAs are merged
+*        into a single CMD18/CMD25 (Auto CMD12), each request keeping its own
+*        buffer through its own ADMA lines.
+*
+*        A command or data CRC error completes its requests with SD_REQ_ERROR
+*        right away. The CMD and DAT lines are then reset and a multiple block
+*        command is stopped with CMD12, issued from the interrupt as well, before
+*        the next command starts.
+*
+*        The application SD interrupt handler has to update IntPtr as usual and
+*        then call sd_queue_isr. The blocking sd_ctrl_send_cmd path must not be
+*        used while requests are queued.
+*
+* Functions:
+* - sd_queue_init: Initializes a request queue on a probed MMC/SD card.
+* - sd_queue_submit: Queues a read or write request.
+* - sd_queue_isr: Completes and issues commands, to be called from the SD interrupt.
+* - sd_queue_wait: Waits for the completion of a request.
+* - sd_queue_read: Reads blocks through the queue and waits for them.
+* - sd_queue_write: Writes blocks through the queue and waits for them.
+*
+******************************************************************************/
+
+#pragma once
+
+#include "type.h"
+#include "riscv.h"
+#include "vexriscv.h"
+#include "efx_mmc_driver.h"
+
+#define SD_QUEUE_DEPTH				16		// pending requests, power of two
+#define SD_QUEUE_LINES				16		// ADMA lines per descriptor table
+#define SD_QUEUE_BLOCKS_PER_LINE	(MAX_DESCRIPTOR / BLOCK_SIZE)
+#define SD_QUEUE_REQUEST_MAX_BLOCKS	(SD_QUEUE_LINES * SD_QUEUE_BLOCKS_PER_LINE)
+
+#define SD_REQ_QUEUED				0
+#define SD_REQ_DONE					1
+#define SD_REQ_ERROR				2
+
+/*******************************************************************************
+*
+* @brief Structure describing a block I/O request. It belongs to the caller and
+*        has to stay valid until its completion.
+*
+******************************************************************************/
+struct sd_request {
+	u32 lba;					/* First block */
+	u32 blocks;					/* Number of blocks, up to SD_QUEUE_REQUEST_MAX_BLOCKS */
+	char *buf;					/* Data buffer, 4 bytes aligned */
+	u32 flags;					/* MMC_DATA_READ or MMC_DATA_WRITE */
+	volatile u32 status;		/* SD_REQ_* */
+};
+
+/*******************************************************************************
+*
+* @brief Structure holding the ADMA table of one command and the requests merged in it.
+*
+******************************************************************************/
+struct sd_queue_batch {
+	u32 table[SD_QUEUE_LINES*2] __attribute__ ((aligned (8)));	/* Attribute/length, address pairs */
+	u32 count;					/* Number of requests merged */
+	u32 lba;					/* First block of the command */
+	u32 blocks;					/* Number of blocks of the command */
+	u32 flags;					/* MMC_DATA_READ or MMC_DATA_WRITE */
+	u32 error;					/* Set by the interrupt on a command or data error */
+};
+
+/*******************************************************************************
+*
+* @brief Structure holding the request queue of an MMC/SD card.
+*
+******************************************************************************/
+struct sd_queue {
+	struct mmc *mmc;
+	struct sd_request *ring[SD_QUEUE_DEPTH];
+	u32 rd;						/* Oldest request not completed */
+	u32 prep;					/* First request not in a descriptor table yet */
+	u32 wr;						/* Next free entry */
+	struct sd_queue_batch batch[2];
+	u32 ready[2];				/* Table built and not issued yet */
+	u32 cur;					/* Table of the running command */
+	volatile u32 running;
+	u32 stopping;				/* CMD12 of a failed command running */
+	u32 requests;				/* Statistics */
+	u32 commands;
+	u32 errors;
+};
+
+/*******************************************************************************
+*
+* @brief This function initializes a request queue on a probed MMC/SD card.
+*
+* @param q    Pointer to the queue structure.
+* @param mmc  Pointer to the MMC structure, initialized by sd_ctrl_mmc_probe.
+*
+******************************************************************************/
+static void sd_queue_init(struct sd_queue *q, struct mmc *mmc)
+{
+	memset(q, 0, sizeof(struct sd_queue));
+	q->mmc = mmc;
+}
+
+/*******************************************************************************
+*
+* @brief This function builds the ADMA table of the next command from the requests
+*        not prepared yet, merging the contiguous ones.
+*
+* @return 1 if a table was built, 0 if there is no request to prepare.
+*
+******************************************************************************/
+static int sd_queue_prepare_(struct sd_queue *q, struct sd_queue_batch *b)
+{
+	u32 line = 0;
+
+	b->count = 0;
+	b->blocks = 0;
+	b->error = 0;
+
+	while(q->prep != q->wr)
+	{
+		struct sd_request *r = q->ring[q->prep & (SD_QUEUE_DEPTH-1)];
+		u32 lines = (r->blocks + SD_QUEUE_BLOCKS_PER_LINE - 1) / SD_QUEUE_BLOCKS_PER_LINE;
+
+		if(b->count)
+		{
+			if(r->flags != b->flags || r->lba != b->lba + b->blocks) break;
+			if(b->blocks + r->blocks > MAX_BLOCK_COUNT || line + lines > SD_QUEUE_LINES) break;
+		}
+		else
+		{
+			b->lba = r->lba;
+			b->flags = r->flags;
+		}
+
+		u32 length = r->blocks * BLOCK_SIZE;
+		u32 addr = (u32)r->buf;
+		while(length)
+		{
+			u32 chunk = length > MAX_DESCRIPTOR ? MAX_DESCRIPTOR : length;
+			//[5:4]:Nop(00b)/rsv(01b)/Tran(10b)/Link(11b); [2]:Int; [1]:End; [0]:Valid; 0x0=65536 length
+			b->table[line*2] = ((chunk&0xffff)<<16) | 0x21;
+			b->table[line*2+1] = addr;
+			addr += chunk;
+			length -= chunk;
+			line++;
+		}
+
+		b->blocks += r->blocks;
+		b->count++;
+		q->prep++;
+	}
+
+	if(b->count == 0) return 0;
+
+	b->table[(line-1)*2] |= 0x2;
+	asm volatile ("" : : : "memory");
+	return 1;
+}
+
+/*******************************************************************************
+*
+* @brief This function points the controller to a prepared ADMA table and issues
+*        its read or write command, without waiting.
+*
+******************************************************************************/
+static void sd_queue_issue_(struct sd_queue *q, struct sd_queue_batch *b)
+{
+	struct mmc *mmc = q->mmc;
+	struct sd_ctrl_dev *dev = mmc->priv;
+	struct mmc_cmd cmd;
+
+	if(b->flags == MMC_DATA_WRITE)
+		cmd.cmdidx = b->blocks > 1 ? MMC_CMD_WRITE_MULTIPLE_BLOCK : MMC_CMD_WRITE_SINGLE_BLOCK;
+	else
+		cmd.cmdidx = b->blocks > 1 ? MMC_CMD_READ_MULTIPLE_BLOCK : MMC_CMD_READ_SINGLE_BLOCK;
+	cmd.cmdarg = mmc->high_capacity ? b->lba : b->lba * BLOCK_SIZE;
+	cmd.resp_type = MMC_RSP_R1;
+
+	dev->TransModePtr->dma_enable = 0x1;
+	dev->TransModePtr->auto_cmd_enable = b->blocks > 1 ? 0x1 : 0x0;
+	dev->TransModePtr->data_transfer_direction_select = b->flags == MMC_DATA_WRITE ? 0x0 : 0x1;
+
+	sd_ctrl_write(dev,SDHC_ADDR+REG_ADMA_SYSTEM_ADDR0,(u32)b->table);
+	sd_ctrl_write(dev,SDHC_ADDR+REG_BLOCKSIZE_COUNT,((b->blocks&0xffff)<<16) | BLOCK_SIZE);
+	SD_TRACE_DATA(b->blocks);
+	sd_ctrl_cmd_start(mmc,&cmd);
+	dev->app_cmd = 0;
+
+	q->commands++;
+}
+
+/*******************************************************************************
+*
+* @brief This function issues the next command if the controller is idle, and builds
+*        the table of the following one. It runs from the interrupt or with the
+*        interrupts disabled.
+*
+******************************************************************************/
+static void sd_queue_kick_(struct sd_queue *q)
+{
+	u32 next = q->cur ^ 1;
+
+	if(!q->running)
+	{
+		if(!q->ready[next] && sd_queue_prepare_(q, &q->batch[next])) q->ready[next] = 1;
+		if(!q->ready[next]) return;
+		q->ready[next] = 0;
+		q->cur = next;
+		q->running = 1;
+		sd_queue_issue_(q, &q->batch[next]);
+		next ^= 1;
+	}
+
+	if(!q->ready[next] && sd_queue_prepare_(q, &q->batch[next])) q->ready[next] = 1;
+}
+
+/*******************************************************************************
+*
+* @brief This function completes the requests of the running command.
+*
+******************************************************************************/
+static void sd_queue_complete_(struct sd_queue *q)
+{
+	struct sd_queue_batch *b = &q->batch[q->cur];
+
+	for(u32 i = 0; i < b->count; i++)
+	{
+		struct sd_request *r = q->ring[q->rd & (SD_QUEUE_DEPTH-1)];
+		if(r->flags == MMC_DATA_READ && !b->error)
+			data_cache_invalidate_range(r->buf, r->blocks * BLOCK_SIZE);
+		r->status = b->error ? SD_REQ_ERROR : SD_REQ_DONE;
+		q->rd++;
+	}
+	if(b->error) q->errors++;
+	q->running = 0;
+}
+
+/*******************************************************************************
+*
+* @brief This function completes the requests of the running command with an
+*        error and recovers the controller: the CMD and DAT lines are reset, the
+*        latched interrupt flags cleared, and a multiple block command is stopped
+*        with CMD12. The next command is issued once the CMD12 completes, or
+*        right away for a single block one.
+*
+******************************************************************************/
+static void sd_queue_abort_(struct sd_queue *q)
+{
+	struct sd_queue_batch *b = &q->batch[q->cur];
+	struct sd_ctrl_dev *dev = q->mmc->priv;
+	struct mmc_cmd stop;
+	u32 blocks = b->blocks;
+
+	b->error = 1;
+	sd_queue_complete_(q);
+	sd_ctrl_reset_lines(q->mmc);
+	sd_ctrl_int_clear();
+
+	if(blocks > 1)
+	{
+		stop.cmdidx = MMC_CMD_STOP_TRANSMISSION;
+		stop.cmdarg = 0;
+		stop.resp_type = MMC_RSP_R1b;
+		dev->TransModePtr->dma_enable = 0x0;
+		dev->TransModePtr->auto_cmd_enable = 0x0;
+		q->stopping = 1;
+		q->running = 1;
+		sd_ctrl_cmd_start(q->mmc,&stop);
+		dev->app_cmd = 0;
+		return;
+	}
+	sd_queue_kick_(q);
+}
+
+/*******************************************************************************
+*
+* @brief This function completes the running command and issues the next one. It
+*        has to be called from the SD controller interrupt handler, once IntPtr
+*        has been updated from the interrupt status.
+*
+* @param q  Pointer to the queue structure.
+*
+******************************************************************************/
+static void sd_queue_isr(struct sd_queue *q)
+{
+	if(!q->running) return;
+
+	//CMD12 after an error, its own errors are ignored as the card may already be idle
+	if(q->stopping)
+	{
+		if(IntPtr.command_complete == 0x1)
+		{
+			SD_TRACE_RESP(0,SD_TRACE_INT_ERR(IntPtr));
+			sd_ctrl_int_clear();
+			q->stopping = 0;
+			q->running = 0;
+			sd_queue_kick_(q);
+		}
+		return;
+	}
+
+	if(IntPtr.command_complete == 0x1)
+	{
+		IntPtr.command_complete = 0x0;
+		if(IntPtr.command_timeout_error || IntPtr.command_crc_error ||
+		   IntPtr.command_end_bit_error || IntPtr.command_index_error)
+		{
+			SD_TRACE_RESP(0,SD_TRACE_INT_ERR(IntPtr));
+			IntPtr.command_timeout_error = 0x0;
+			IntPtr.command_crc_error = 0x0;
+			IntPtr.command_end_bit_error = 0x0;
+			IntPtr.command_index_error = 0x0;
+			//No data phase follows a failed command
+			sd_queue_abort_(q);
+			return;
+		}
+		SD_TRACE_RESP(sd_ctrl_read(q->mmc->priv,SDHC_ADDR+REG_COMMAND_RESP31_0),0);
+	}
+
+	//The transfer may end without transfer complete after a data CRC error
+	if(IntPtr.data_crc_error == 0x1)
+	{
+		SD_TRACE_END(SD_TRACE_ERR_DATA_CRC);
+		sd_queue_abort_(q);
+		return;
+	}
+
+	if(IntPtr.transfer_complete == 0x1)
+	{
+		IntPtr.transfer_complete = 0x0;
+		SD_TRACE_END(0);
+		sd_queue_complete_(q);
+		sd_queue_kick_(q);
+	}
+}
+
+/*******************************************************************************
+*
+* @brief This function queues a read or write request. The command is issued right
+*        away if the controller is idle, otherwise the request is merged into the
+*        next command when possible.
+*
+* @param q  Pointer to the queue structure.
+* @param r  Pointer to the request, owned by the queue until its completion.
+* @return   0 on success, -1 if the queue is full or the request too large.
+*
+******************************************************************************/
+static int sd_queue_submit(struct sd_queue *q, struct sd_request *r)
+{
+	int ret = 0;
+
+	if(r->blocks == 0 || r->blocks > SD_QUEUE_REQUEST_MAX_BLOCKS) return -1;
+
+	u32 mie = csr_read_clear(mstatus, MSTATUS_MIE) & MSTATUS_MIE;
+
+	if(q->wr - q->rd == SD_QUEUE_DEPTH)
+	{
+		ret = -1;
+	}
+	else
+	{
+		u32 next = q->cur ^ 1;
+		//Rebuild the table not issued yet, so that the new request can be merged into it
+		if(q->ready[next])
+		{
+			q->ready[next] = 0;
+			q->prep -= q->batch[next].count;
+		}
+		r->status = SD_REQ_QUEUED;
+		q->ring[q->wr & (SD_QUEUE_DEPTH-1)] = r;
+		q->wr++;
+		q->requests++;
+		sd_queue_kick_(q);
+	}
+
+	if(mie) csr_set(mstatus, MSTATUS_MIE);
+	return ret;
+}
+
+/*******************************************************************************
+*
+* @brief This function waits for the completion of a request.
+*
+* @param r  Pointer to a submitted request.
+* @return   0 on success, -1 on a command or data error.
+*
+******************************************************************************/
+static int sd_queue_wait(struct sd_request *r)
+{
+	while(r->status == SD_REQ_QUEUED);
+	return r->status == SD_REQ_DONE ? 0 : -1;
+}
+
+/*******************************************************************************
+*
+* @brief This function reads blocks through the queue and waits for them.
+*
+* @param q       Pointer to the queue structure.
+* @param lba     First block to read.
+* @param blocks  Number of blocks to read.
+* @param dest    Destination buffer, 4 bytes aligned.
+* @return        0 on success, -1 on failure.
+*
+******************************************************************************/
+static int sd_queue_read(struct sd_queue *q, u32 lba, u32 blocks, char *dest)
+{
+	struct sd_request r;
+
+	r.lba = lba;
+	r.blocks = blocks;
+	r.buf = dest;
+	r.flags = MMC_DATA_READ;
+	if(sd_queue_submit(q, &r)) return -1;
+	return sd_queue_wait(&r);
+}
+
+/*******************************************************************************
+*
+* @brief This function writes blocks through the queue and waits for them.
+*
+* @param q       Pointer to the queue structure.
+* @param lba     First block to write.
+* @param blocks  Number of blocks to write.
+* @param src     Source buffer, 4 bytes aligned.
+* @return        0 on success, -1 on failure.
+*
+******************************************************************************/
+static int sd_queue_write(struct sd_queue *q, u32 lba, u32 blocks, const char *src)
+{
+	struct sd_request r;
+
+	r.lba = lba;
+	r.blocks = blocks;
+	r.buf = (char *)src;
+	r.flags = MMC_DATA_WRITE;
+	if(sd_queue_submit(q, &r)) return -1;
+	return sd_queue_wait(&r);
+}
@@ -0,0 +1,432 @@
+/*******************************************************************************
+*
+* @file efx_tse_dma.h
+*
+* @brief Header file for the packet data path of the TSE (Triple-Speed Ethernet)
+*        MAC. The RX stream of the MAC is captured by a dmasg channel into a
+*        ring of descriptors, one packet per descriptor, and the TX stream is
+*        fed by another channel from a second ring. Both rings work over a
+*        pool of fixed size packet buffers allocated by the application.
+*
+*        Packets are handed over by reference: a received buffer is given to
+*        the application and replaced in the RX ring by a free one of the pool,
+*        a buffer to send is given to the TX ring and comes back to the pool
+*        once sent. The application gives received buffers back to the pool
+*        with tse_pkt_free, or sends them.
+*
+*        A ring stops when the DMA reads a descriptor still holding a packet
+*        (status COMPLETED). tse_dma_poll restarts it once the descriptor is
+*        available again. Everything runs from a single context, the
+*        application polling tse_dma_rx and tse_dma_poll.
+*
+* Functions:
+* - tse_pkt_pool_init: Initializes a pool over an array of packet buffers.
+* - tse_pkt_alloc: Takes a buffer from the pool.
+* - tse_pkt_free: Gives a buffer back to the pool.
+* - tse_dma_init: Configures the channels, fills the RX ring and starts it.
+* - tse_dma_rx: Returns the next received packet.
+* - tse_dma_tx: Queues a packet for transmission.
+* - tse_dma_poll: Reclaims the sent packets and restarts the stopped rings.
+* - tse_dma_sample: Computes the packet and byte rates of both rings.
+* - tse_dma_stop: Stops both channels and gives every buffer back to the pool.
+*
+******************************************************************************/
+#pragma once
+
+#include <string.h>
+#include "type.h"
+#include "io.h"
+#include "bsp.h"
+#include "vexriscv.h"
+#include "dmasg.h"
+#include "dmasg_pool.h"
+
+// Size of a packet buffer, a maximum size frame rounded to cache lines
+#define TSE_PKT_SIZE                    1536
+// Descriptors per ring, power of two
+#ifndef TSE_DMA_RING_SIZE
+#define TSE_DMA_RING_SIZE               16
+#endif
+
+/******************************************************************************
+*
+* A packet buffer. Declare the storage of a pool as an array of this type.
+*
+******************************************************************************/
+    struct tse_pkt {
+        // Frame as carried by the MAC stream, from the destination MAC address
+        u8 data[TSE_PKT_SIZE];
+        // Length of the frame in data
+        u32 len;
+        // Next free buffer of the pool
+        struct tse_pkt *next;
+    } __attribute__ ((aligned (DMASG_POOL_ALIGN)));
+
+    struct tse_pkt_pool {
+        struct tse_pkt *free;
+        u32 available;
+        u32 count;
+    };
+
+    struct tse_dma_stats {
+        // Packets received or sent
+        u32 packets;
+        u64 bytes;
+        // RX: packets dropped because the pool was empty,
+        // TX: packets refused because the ring was full
+        u32 drops;
+        // RX: packets larger than a buffer, dropped
+        u32 errors;
+        // Restarts of a ring stopped on a descriptor in use
+        u32 stalls;
+        // Rates computed by tse_dma_sample
+        u32 pps;
+        u32 bps;
+        // Counters at the previous tse_dma_sample
+        u32 lastPackets;
+        u64 lastBytes;
+    };
+
+    struct tse_dma_ring {
+        u32 channel;
+        struct dmasg_pool_slot desc[TSE_DMA_RING_SIZE];
+        struct tse_pkt *pkt[TSE_DMA_RING_SIZE];
+        // Next descriptor to consume (RX) or to reclaim (TX), free running
+        u32 head;
+        // Next descriptor to fill (TX), free running
+        u32 tail;
+        // RX: dropping the rest of an oversize frame, up to its end of packet
+        u32 discard;
+        struct tse_dma_stats stats;
+    };
+
+    struct tse_dma {
+        u32 base;
+        struct tse_pkt_pool *pool;
+        struct tse_dma_ring rx;
+        struct tse_dma_ring tx;
+        u64 lastSample;
+    };
+
+/*******************************************************************************
+*
+* @brief This function initializes a pool over an array of packet buffers.
+*
+* @param pool: Pool to initialize
+* @param pkts: Storage of the buffers, 64 bytes aligned by its type
+* @param count: Number of buffers, more than TSE_DMA_RING_SIZE so that the
+*               RX ring can be refilled
+*
+*******************************************************************************/
+    static void tse_pkt_pool_init(struct tse_pkt_pool *pool, struct tse_pkt *pkts, u32 count){
+        pool->free = 0;
+        for(u32 i = count; i-- > 0;){
+            pkts[i].next = pool->free;
+            pool->free = &pkts[i];
+        }
+        pool->available = count;
+        pool->count = count;
+    }
+
+/*******************************************************************************
+*
+* @brief This function takes a buffer from the pool.
+*
+* @param pool: Pool
+*
+* @return The buffer, or 0 if the pool is empty
+*
+*******************************************************************************/
+    static struct tse_pkt *tse_pkt_alloc(struct tse_pkt_pool *pool){
+        struct tse_pkt *p = pool->free;
+        if(p){
+            pool->free = p->next;
+            pool->available--;
+            p->len = 0;
+        }
+        return p;
+    }
+
+/*******************************************************************************
+*
+* @brief This function gives a buffer back to the pool.
+*
+* @param pool: Pool
+* @param pkt: Buffer previously returned by tse_pkt_alloc or tse_dma_rx
+*
+*******************************************************************************/
+    static void tse_pkt_free(struct tse_pkt_pool *pool, struct tse_pkt *pkt){
+        pkt->next = pool->free;
+        pool->free = pkt;
+        pool->available++;
+    }
+
+/*******************************************************************************
+*
+* @brief This function arms a RX descriptor on a buffer.
+*
+*******************************************************************************/
+    static void tse_dma_rx_arm_(struct tse_dma_ring *r, u32 slot, struct tse_pkt *p){
+        struct dmasg_descriptor *d = &r->desc[slot].descriptor;
+        r->pkt[slot] = p;
+        d->control = TSE_PKT_SIZE - 1;
+        d->from = 0;
+        d->to = (u32) p->data;
+        d->status = 0;
+    }
+
+/*******************************************************************************
+*
+* @brief This function configures the RX and TX channels, fills the RX ring with
+*        buffers of the pool and starts it. The TX ring starts empty.
+*
+* @param dma: Packet path to initialize
+* @param pool: Pool providing the buffers, shared with the application
+* @param base: Base address of the DMA controller
+* @param rx_channel: DMA channel connected to the RX stream of the MAC
+* @param rx_port: Input port of the RX stream (see dmasg_input_stream)
+* @param tx_channel: DMA channel connected to the TX stream of the MAC
+* @param tx_port: Output port of the TX stream (see dmasg_output_stream)
+* @param burst: Bytes per memory burst, power of two
+*
+* @return 0 on success, -1 if the pool cannot fill the RX ring
+*
+*******************************************************************************/
+    static int tse_dma_init(struct tse_dma *dma, struct tse_pkt_pool *pool, u32 base,
+                            u32 rx_channel, u32 rx_port, u32 tx_channel, u32 tx_port, u32 burst){
+        struct tse_dma_ring *rx = &dma->rx, *tx = &dma->tx;
+
+        dma->base = base;
+        dma->pool = pool;
+        dma->lastSample = clint_getTime(BSP_CLINT);
+        rx->channel = rx_channel;
+        tx->channel = tx_channel;
+        rx->head = rx->tail = 0;
+        tx->head = tx->tail = 0;
+        rx->discard = tx->discard = 0;
+        memset(&rx->stats, 0, sizeof(rx->stats));
+        memset(&tx->stats, 0, sizeof(tx->stats));
+
+        // Circular lists, a descriptor in use stops the DMA
+        for(u32 i = 0; i < TSE_DMA_RING_SIZE; i++){
+            rx->desc[i].descriptor.next = (u32) &rx->desc[(i + 1) & (TSE_DMA_RING_SIZE - 1)].descriptor;
+            tx->desc[i].descriptor.next = (u32) &tx->desc[(i + 1) & (TSE_DMA_RING_SIZE - 1)].descriptor;
+            tx->desc[i].descriptor.status = DMASG_DESCRIPTOR_STATUS_COMPLETED;
+            tx->pkt[i] = 0;
+        }
+        for(u32 i = 0; i < TSE_DMA_RING_SIZE; i++){
+            struct tse_pkt *p = tse_pkt_alloc(pool);
+            if(!p){
+                while(i-- > 0) tse_pkt_free(pool, rx->pkt[i]);
+                return -1;
+            }
+            tse_dma_rx_arm_(rx, i, p);
+        }
+
+        // One packet per descriptor, starting on a packet boundary
+        dmasg_input_stream(base, rx_channel, rx_port, 1, 1);
+        dmasg_output_memory(base, rx_channel, 0, burst);
+        dmasg_input_memory(base, tx_channel, 0, burst);
+        dmasg_output_stream(base, tx_channel, tx_port, 0, 0, 0);
+
+        asm volatile ("" : : : "memory");
+        dmasg_linked_list_start(base, rx_channel, (u32) &rx->desc[0].descriptor);
+        return 0;
+    }
+
+/*******************************************************************************
+*
+* @brief This function returns the next received packet. Its descriptor is armed
+*        again on a buffer of the pool right away. When the pool is empty, or the
+*        frame did not fit in a buffer, the packet is dropped and its buffer kept
+*        in the ring. A frame which did not fit is dropped up to the descriptor
+*        holding its end of packet.
+*
+* @param dma: Packet path
+*
+* @return The packet, owned by the application, or 0 if none was received
+*
+*******************************************************************************/
+    static struct tse_pkt *tse_dma_rx(struct tse_dma *dma){
+        struct tse_dma_ring *rx = &dma->rx;
+
+        while(1){
+            u32 slot = rx->head & (TSE_DMA_RING_SIZE - 1);
+            struct dmasg_descriptor *d = &rx->desc[slot].descriptor;
+            struct tse_pkt *p = rx->pkt[slot];
+            struct tse_pkt *fresh;
+            u32 status;
+
+            if(!dmasg_descriptor_completed_(d)) return 0;
+            status = ((volatile struct dmasg_descriptor *) d)->status;
+            rx->head++;
+
+            if(rx->discard || !(status & DMASG_DESCRIPTOR_STATUS_END_OF_PACKET)){
+                if(!rx->discard) rx->stats.errors++;
+                rx->discard = !(status & DMASG_DESCRIPTOR_STATUS_END_OF_PACKET);
+                tse_dma_rx_arm_(rx, slot, p);
+                continue;
+            }
+            fresh = tse_pkt_alloc(dma->pool);
+            if(!fresh){
+                rx->stats.drops++;
+                tse_dma_rx_arm_(rx, slot, p);
+                continue;
+            }
+
+            tse_dma_rx_arm_(rx, slot, fresh);
+            p->len = status & DMASG_DESCRIPTOR_STATUS_BYTES;
+            data_cache_invalidate_range(p->data, p->len);
+            rx->stats.packets++;
+            rx->stats.bytes += p->len;
+            return p;
+        }
+    }
+
+/*******************************************************************************
+*
+* @brief This function gives the sent packets of the TX ring back to the pool.
+*
+*******************************************************************************/
+    static void tse_dma_tx_reclaim_(struct tse_dma *dma){
+        struct tse_dma_ring *tx = &dma->tx;
+
+        while(tx->head != tx->tail){
+            u32 slot = tx->head & (TSE_DMA_RING_SIZE - 1);
+            struct tse_pkt *p = tx->pkt[slot];
+            if(!dmasg_descriptor_completed_(&tx->desc[slot].descriptor)) break;
+            tx->stats.packets++;
+            tx->stats.bytes += p->len;
+            tx->pkt[slot] = 0;
+            tse_pkt_free(dma->pool, p);
+            tx->head++;
+        }
+    }
+
+/*******************************************************************************
+*
+* @brief This function queues a packet for transmission. The buffer is given
+*        back to the pool once sent, see tse_dma_poll.
+*
+* @param dma: Packet path
+* @param pkt: Packet, with its length set, owned by the TX ring on success
+*
+* @return 0 on success, -1 if the TX ring is full (the packet stays owned by
+*         the caller)
+*
+*******************************************************************************/
+    static int tse_dma_tx(struct tse_dma *dma, struct tse_pkt *pkt){
+        struct tse_dma_ring *tx = &dma->tx;
+        u32 slot = tx->tail & (TSE_DMA_RING_SIZE - 1);
+        struct dmasg_descriptor *d = &tx->desc[slot].descriptor;
+
+        if(tx->tail - tx->head == TSE_DMA_RING_SIZE || pkt->len == 0 || pkt->len > TSE_PKT_SIZE){
+            tx->stats.drops++;
+            return -1;
+        }
+
+        tx->pkt[slot] = pkt;
+        d->from = (u32) pkt->data;
+        d->to = 0;
+        d->control = (pkt->len - 1) | DMASG_DESCRIPTOR_CONTROL_END_OF_PACKET;
+        asm volatile ("" : : : "memory");
+        d->status = 0;
+        asm volatile ("" : : : "memory");
+        tx->tail++;
+
+        // Idle ring, or the DMA stopped on this descriptor before it was filled.
+        // The sent descriptors are reclaimed first, so that the DMA restarts on
+        // the oldest packet not sent rather than stopping on a completed one.
+        if(!dmasg_busy(dma->base, tx->channel)){
+            tse_dma_tx_reclaim_(dma);
+            dmasg_linked_list_start(dma->base, tx->channel, (u32) &tx->desc[tx->head & (TSE_DMA_RING_SIZE - 1)].descriptor);
+        }
+        return 0;
+    }
+
+/*******************************************************************************
+*
+* @brief This function gives the sent packets back to the pool and restarts the
+*        rings the DMA stopped on a descriptor in use, to be called periodically.
+*
+* @param dma: Packet path
+*
+*******************************************************************************/
+    static void tse_dma_poll(struct tse_dma *dma){
+        struct tse_dma_ring *rx = &dma->rx, *tx = &dma->tx;
+
+        tse_dma_tx_reclaim_(dma);
+
+        // The TX DMA may have read a descriptor right before tse_dma_tx filled it
+        if(tx->head != tx->tail && !dmasg_busy(dma->base, tx->channel)){
+            tx->stats.stalls++;
+            dmasg_linked_list_start(dma->base, tx->channel, (u32) &tx->desc[tx->head & (TSE_DMA_RING_SIZE - 1)].descriptor);
+        }
+
+        // The RX DMA stops on the oldest packet not consumed yet. Restart it after
+        // the packets pending from rx->head, once tse_dma_rx armed that descriptor
+        // again.
+        if(!dmasg_busy(dma->base, rx->channel)){
+            u32 pending = 0;
+            while(pending < TSE_DMA_RING_SIZE &&
+                  dmasg_descriptor_completed_(&rx->desc[(rx->head + pending) & (TSE_DMA_RING_SIZE - 1)].descriptor))
+                pending++;
+            if(pending == TSE_DMA_RING_SIZE) return;
+            rx->stats.stalls++;
+            dmasg_linked_list_start(dma->base, rx->channel, (u32) &rx->desc[(rx->head + pending) & (TSE_DMA_RING_SIZE - 1)].descriptor);
+        }
+    }
+
+/*******************************************************************************
+*
+* @brief This function computes the packet and byte rates of a ring.
+*
+*******************************************************************************/
+    static void tse_dma_rate_(struct tse_dma_stats *s, u32 ticks){
+        s->pps = (u32) ((u64) (s->packets - s->lastPackets) * BSP_CLINT_HZ / ticks);
+        s->bps = (u32) ((s->bytes - s->lastBytes) * 8 * BSP_CLINT_HZ / ticks);
+        s->lastPackets = s->packets;
+        s->lastBytes = s->bytes;
+    }
+
+/*******************************************************************************
+*
+* @brief This function computes the packet and byte rates of both rings since
+*        the previous call, into their pps and bps fields.
+*
+* @param dma: Packet path
+*
+*******************************************************************************/
+    static void tse_dma_sample(struct tse_dma *dma){
+        u64 now = clint_getTime(BSP_CLINT);
+        u32 ticks = (u32) (now - dma->lastSample);
+        if(ticks == 0) return;
+        tse_dma_rate_(&dma->rx.stats, ticks);
+        tse_dma_rate_(&dma->tx.stats, ticks);
+        dma->lastSample = now;
+    }
+
+/*******************************************************************************
+*
+* @brief This function stops both channels and gives every buffer held by the
+*        rings back to the pool. Packets owned by the application are not
+*        affected.
+*
+* @param dma: Packet path
+*
+*******************************************************************************/
+    static void tse_dma_stop(struct tse_dma *dma){
+        dmasg_stop(dma->base, dma->rx.channel);
+        dmasg_stop(dma->base, dma->tx.channel);
+        while(dmasg_busy(dma->base, dma->rx.channel) || dmasg_busy(dma->base, dma->tx.channel));
+
+        for(u32 i = 0; i < TSE_DMA_RING_SIZE; i++){
+            tse_pkt_free(dma->pool, dma->rx.pkt[i]);
+            dma->rx.pkt[i] = 0;
+        }
+        for(; dma->tx.head != dma->tx.tail; dma->tx.head++){
+            u32 slot = dma->tx.head & (TSE_DMA_RING_SIZE - 1);
+            tse_pkt_free(dma->pool, dma->tx.pkt[slot]);
+            dma->tx.pkt[slot] = 0;
+        }
+    }
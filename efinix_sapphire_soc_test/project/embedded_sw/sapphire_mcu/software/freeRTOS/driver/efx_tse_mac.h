@@ -240,6 +240,7 @@ static void MacCntClean()
 * @brief This function prints the values of various statistics counters in the TSEMAC control/status register.
 *
 * @note This function is usefult to track trasmit/receive frame error such as CRC errors, etc
+*       It blocks on the UART, efx_tse_stats.h samples the same counters without printing.
 *
 ******************************************************************************/
 static void CntMonitor()
@@ -0,0 +1,641 @@
+/*******************************************************************************
+*
+* @file efx_tse_net.h
+*
+* @brief Header file for a minimal UDP/IPv4 stack over the TSE packet path
+*        (efx_tse_dma.h). It answers ARP requests and ICMP echo requests, keeps
+*        a small ARP cache, and sends and receives UDP datagrams. Nothing is
+*        allocated: the stack works in place on the packet buffers of the
+*        pool. ARP and ICMP replies are built in the request buffer itself.
+*
+*        UDP transmission goes through flows. A flow holds the Ethernet, IPv4
+*        and UDP headers of a destination as a template, with the partial IPv4
+*        header checksum computed once. Sending a datagram copies the template
+*        in front of the payload and patches the length, the identification
+*        and the checksum. The UDP checksum is left to 0 (allowed by IPv4)
+*        unless TSE_NET_UDP_CSUM is defined.
+*
+*        Addresses and ports are given in host order, as in tseDemo.h.
+*
+* Functions:
+* - tse_net_init: Initializes the stack over a packet path.
+* - tse_net_udp_bind: Registers the receive handler of a local UDP port.
+* - tse_net_arp_lookup: Looks an address up in the ARP cache.
+* - tse_net_arp_request: Broadcasts an ARP request.
+* - tse_net_input: Processes a received packet.
+* - tse_net_poll: Receives and processes the pending packets.
+* - tse_udp_flow_init: Builds the header template of a UDP destination.
+* - tse_udp_alloc: Takes a buffer and returns its payload area.
+* - tse_udp_send: Sends a datagram of a flow.
+* - tse_udp_stream: Measures the UDP throughput against the line rate.
+*
+******************************************************************************/
+#pragma once
+
+#include <string.h>
+#include "type.h"
+#include "bsp.h"
+#include "efx_tse_dma.h"
+#include "inet_csum.h"
+
+#define TSE_NET_ARP_SIZE		8			/* ARP cache entries */
+#define TSE_NET_UDP_PORTS		4			/* Bound UDP ports */
+#define TSE_NET_ARP_RETRY_MS	100			/* Minimum interval between ARP requests */
+
+#define ETH_HDR_LEN				14
+#define ETH_MIN_LEN				60			/* Minimum frame without FCS */
+#define ETH_TYPE_IP				0x0800
+#define ETH_TYPE_ARP			0x0806
+#define IP_HDR_LEN				20
+#define IP_PROTO_ICMP			1
+#define IP_PROTO_UDP			17
+#define UDP_HDR_LEN				8
+#define UDP_PAYLOAD_OFS			(ETH_HDR_LEN + IP_HDR_LEN + UDP_HDR_LEN)
+#define UDP_PAYLOAD_MAX			(1500 - IP_HDR_LEN - UDP_HDR_LEN)
+
+/*******************************************************************************
+*
+* @brief Handler of a bound UDP port. The packet is borrowed for the call: the
+*        handler returns 1 if it keeps it (and gives it back with tse_pkt_free
+*        or tse_dma_tx later), 0 to let the stack free it.
+*
+******************************************************************************/
+typedef int (*tse_udp_handler)(void *context, struct tse_pkt *pkt, u8 *payload, u32 len,
+							   u32 src_ip, u32 src_port);
+
+/*******************************************************************************
+*
+* @brief Structure holding an ARP cache entry.
+*
+******************************************************************************/
+struct tse_arp_entry {
+	u32 ip;						/* Address, 0 for a free entry */
+	u8 mac[6];
+};
+
+/*******************************************************************************
+*
+* @brief Structure holding a bound UDP port.
+*
+******************************************************************************/
+struct tse_udp_port {
+	u32 port;					/* Local port, 0 for a free entry */
+	tse_udp_handler handler;
+	void *context;
+};
+
+/*******************************************************************************
+*
+* @brief Structure holding the stack counters.
+*
+******************************************************************************/
+struct tse_net_stats {
+	u32 arp_rx;					/* ARP packets received */
+	u32 arp_tx;					/* ARP requests and replies sent */
+	u32 icmp_echo;				/* ICMP echo requests answered */
+	u32 udp_rx;					/* Datagrams delivered to a handler */
+	u32 udp_tx;					/* Datagrams sent */
+	u32 bad_csum;				/* Packets dropped on a checksum error */
+	u32 no_port;				/* Datagrams to a port without handler */
+	u32 dropped;				/* Other packets dropped, or TX ring full */
+};
+
+/*******************************************************************************
+*
+* @brief Structure holding the stack state.
+*
+******************************************************************************/
+struct tse_net {
+	struct tse_dma *dma;
+	u8 mac[6];
+	u32 ip;
+	u32 netmask;
+	u32 gateway;				/* 0 without gateway */
+	struct tse_arp_entry arp[TSE_NET_ARP_SIZE];
+	u32 arp_next;				/* Next entry replaced */
+	u32 arp_last;				/* Time of the last request, in CLINT ticks */
+	struct tse_udp_port udp[TSE_NET_UDP_PORTS];
+	struct tse_net_stats stats;
+};
+
+/*******************************************************************************
+*
+* @brief Structure holding a UDP flow: the headers of a destination.
+*
+******************************************************************************/
+struct tse_udp_flow {
+	u8 hdr[UDP_PAYLOAD_OFS];	/* Ethernet, IPv4 and UDP headers */
+	u32 ip_sum;					/* IPv4 header sum without length, id and checksum */
+	u16 ip_id;					/* Next identification */
+};
+
+/*******************************************************************************
+*
+* @brief Big endian accessors of the packet fields, 16 bits aligned.
+*
+******************************************************************************/
+static u32 tse_get16_(const u8 *p)			{ return (p[0]<<8) | p[1]; }
+static u32 tse_get32_(const u8 *p)			{ return (p[0]<<24) | (p[1]<<16) | (p[2]<<8) | p[3]; }
+static void tse_put16_(u8 *p, u32 v)		{ p[0] = v>>8; p[1] = v; }
+static void tse_put32_(u8 *p, u32 v)		{ p[0] = v>>24; p[1] = v>>16; p[2] = v>>8; p[3] = v; }
+
+/*******************************************************************************
+*
+* @brief This function initializes the stack over a packet path.
+*
+* @param net      Pointer to the stack structure.
+* @param dma      Packet path, initialized by tse_dma_init.
+* @param mac_h    MAC address bits 47:32, as SRC_MAC_H.
+* @param mac_l    MAC address bits 31:0, as SRC_MAC_L.
+* @param ip       Local address, as SRC_IP.
+* @param netmask  Network mask.
+* @param gateway  Gateway for the other networks, 0 if none.
+*
+******************************************************************************/
+static void tse_net_init(struct tse_net *net, struct tse_dma *dma, u32 mac_h, u32 mac_l,
+						 u32 ip, u32 netmask, u32 gateway)
+{
+	memset(net, 0, sizeof(*net));
+	net->dma = dma;
+	tse_put16_(net->mac, mac_h);
+	tse_put32_(net->mac+2, mac_l);
+	net->ip = ip;
+	net->netmask = netmask;
+	net->gateway = gateway;
+	net->arp_last = clint_getTimeLow(BSP_CLINT) - TSE_NET_ARP_RETRY_MS * (BSP_CLINT_HZ/1000);
+}
+
+/*******************************************************************************
+*
+* @brief This function registers the receive handler of a local UDP port.
+*
+* @param net      Pointer to the stack structure.
+* @param port     Local port.
+* @param handler  Handler, 0 to unbind the port.
+* @param context  Passed to the handler.
+* @return         0 on success, -1 if every entry is in use.
+*
+******************************************************************************/
+static int tse_net_udp_bind(struct tse_net *net, u32 port, tse_udp_handler handler, void *context)
+{
+	struct tse_udp_port *free = 0;
+
+	for(u32 i=0; i<TSE_NET_UDP_PORTS; i++) {
+		if(net->udp[i].port == port) {
+			free = &net->udp[i];
+			break;
+		}
+		if(!net->udp[i].port && !free)
+			free = &net->udp[i];
+	}
+	if(!free)
+		return -1;
+
+	free->port = handler ? port : 0;
+	free->handler = handler;
+	free->context = context;
+	return 0;
+}
+
+/*******************************************************************************
+*
+* @brief This function looks an address up in the ARP cache.
+*
+* @param net  Pointer to the stack structure.
+* @param ip   Address.
+* @return     The MAC address, or 0 if it is not cached.
+*
+******************************************************************************/
+static const u8 *tse_net_arp_lookup(struct tse_net *net, u32 ip)
+{
+	for(u32 i=0; i<TSE_NET_ARP_SIZE; i++)
+		if(net->arp[i].ip == ip)
+			return net->arp[i].mac;
+	return 0;
+}
+
+/*******************************************************************************
+*
+* @brief This function adds or refreshes an ARP cache entry.
+*
+******************************************************************************/
+static void tse_net_arp_learn_(struct tse_net *net, u32 ip, const u8 *mac)
+{
+	struct tse_arp_entry *e = 0;
+
+	if(!ip) return;
+	for(u32 i=0; i<TSE_NET_ARP_SIZE; i++)
+		if(net->arp[i].ip == ip)
+			e = &net->arp[i];
+	if(!e) {
+		e = &net->arp[net->arp_next];
+		net->arp_next = (net->arp_next + 1) % TSE_NET_ARP_SIZE;
+	}
+	e->ip = ip;
+	memcpy(e->mac, mac, 6);
+}
+
+/*******************************************************************************
+*
+* @brief This function fills the Ethernet header of a packet.
+*
+******************************************************************************/
+static void tse_net_eth_(struct tse_net *net, u8 *p, const u8 *dst, u32 type)
+{
+	memcpy(p, dst, 6);
+	memcpy(p+6, net->mac, 6);
+	tse_put16_(p+12, type);
+}
+
+/*******************************************************************************
+*
+* @brief This function pads a frame to the Ethernet minimum and queues it.
+*
+******************************************************************************/
+static int tse_net_send_(struct tse_net *net, struct tse_pkt *pkt, u32 len)
+{
+	if(len < ETH_MIN_LEN) {
+		memset(pkt->data + len, 0, ETH_MIN_LEN - len);
+		len = ETH_MIN_LEN;
+	}
+	pkt->len = len;
+	if(tse_dma_tx(net->dma, pkt)) {
+		net->stats.dropped++;
+		tse_pkt_free(net->dma->pool, pkt);
+		return -1;
+	}
+	return 0;
+}
+
+/*******************************************************************************
+*
+* @brief This function broadcasts an ARP request. Requests are limited to one per
+*        TSE_NET_ARP_RETRY_MS.
+*
+* @param net  Pointer to the stack structure.
+* @param ip   Address to resolve.
+* @return     0 if a request was sent, -1 otherwise.
+*
+******************************************************************************/
+static int tse_net_arp_request(struct tse_net *net, u32 ip)
+{
+	static const u8 bcast[6] = { 0xff, 0xff, 0xff, 0xff, 0xff, 0xff };
+	struct tse_pkt *pkt;
+	u8 *a;
+	u32 now = clint_getTimeLow(BSP_CLINT);
+
+	if(now - net->arp_last < TSE_NET_ARP_RETRY_MS * (BSP_CLINT_HZ/1000))
+		return -1;
+	pkt = tse_pkt_alloc(net->dma->pool);
+	if(!pkt)
+		return -1;
+	net->arp_last = now;
+
+	tse_net_eth_(net, pkt->data, bcast, ETH_TYPE_ARP);
+	a = pkt->data + ETH_HDR_LEN;
+	tse_put16_(a, 1);					//Ethernet
+	tse_put16_(a+2, ETH_TYPE_IP);
+	a[4] = 6;
+	a[5] = 4;
+	tse_put16_(a+6, 1);					//Request
+	memcpy(a+8, net->mac, 6);
+	tse_put32_(a+14, net->ip);
+	memset(a+18, 0, 6);
+	tse_put32_(a+24, ip);
+
+	net->stats.arp_tx++;
+	return tse_net_send_(net, pkt, ETH_HDR_LEN + 28);
+}
+
+/*******************************************************************************
+*
+* @brief This function processes an ARP packet, answering the requests for the
+*        local address in the same buffer.
+*
+******************************************************************************/
+static void tse_net_arp_input_(struct tse_net *net, struct tse_pkt *pkt)
+{
+	u8 *a = pkt->data + ETH_HDR_LEN;
+	u32 oper, spa;
+
+	net->stats.arp_rx++;
+	if(pkt->len < ETH_HDR_LEN + 28 || tse_get16_(a+2) != ETH_TYPE_IP || a[4] != 6 || a[5] != 4) {
+		tse_pkt_free(net->dma->pool, pkt);
+		return;
+	}
+
+	oper = tse_get16_(a+6);
+	spa = tse_get32_(a+14);
+	if(tse_get32_(a+24) != net->ip) {
+		tse_pkt_free(net->dma->pool, pkt);
+		return;
+	}
+	tse_net_arp_learn_(net, spa, a+8);
+	if(oper != 1) {
+		tse_pkt_free(net->dma->pool, pkt);
+		return;
+	}
+
+	//Reply in place: the sender becomes the target
+	tse_put16_(a+6, 2);
+	memcpy(a+18, a+8, 6);
+	tse_put32_(a+24, spa);
+	memcpy(a+8, net->mac, 6);
+	tse_put32_(a+14, net->ip);
+	tse_net_eth_(net, pkt->data, a+18, ETH_TYPE_ARP);
+
+	net->stats.arp_tx++;
+	tse_net_send_(net, pkt, ETH_HDR_LEN + 28);
+}
+
+/*******************************************************************************
+*
+* @brief This function answers an ICMP echo request in the same buffer. Swapping
+*        the addresses keeps the IPv4 checksum, the ICMP one is updated for the
+*        type change (RFC 1624).
+*
+******************************************************************************/
+static void tse_net_icmp_input_(struct tse_net *net, struct tse_pkt *pkt, u8 *ip, u32 ihl, u32 len)
+{
+	u8 *icmp = ip + ihl;
+	u8 tmp[6];
+
+	if(len < ihl + 8 || icmp[0] != 8 || inet_csum_finish(inet_csum_add(icmp, len - ihl, 0))) {
+		if(icmp[0] == 8) net->stats.bad_csum++;
+		tse_pkt_free(net->dma->pool, pkt);
+		return;
+	}
+
+	memcpy(tmp, ip+12, 4);
+	memcpy(ip+12, ip+16, 4);
+	memcpy(ip+16, tmp, 4);
+	memcpy(tmp, pkt->data+6, 6);
+	tse_net_eth_(net, pkt->data, tmp, ETH_TYPE_IP);
+
+	//Type 8 (echo request) becomes 0 (echo reply), code 0
+	icmp[0] = 0;
+	tse_put16_(icmp+2, inet_csum_update16(tse_get16_(icmp+2), 0x0800, 0x0000));
+
+	net->stats.icmp_echo++;
+	tse_net_send_(net, pkt, ETH_HDR_LEN + len);
+}
+
+/*******************************************************************************
+*
+* @brief This function delivers a UDP datagram to the handler of its port.
+*
+******************************************************************************/
+static void tse_net_udp_input_(struct tse_net *net, struct tse_pkt *pkt, u8 *ip, u32 ihl, u32 len)
+{
+	u8 *udp = ip + ihl;
+	u32 ulen, dport, sum;
+
+	if(len < ihl + UDP_HDR_LEN || (ulen = tse_get16_(udp+4)) < UDP_HDR_LEN || ulen > len - ihl) {
+		net->stats.dropped++;
+		tse_pkt_free(net->dma->pool, pkt);
+		return;
+	}
+
+	if(tse_get16_(udp+6)) {
+		sum = inet_csum_add(ip+12, 8, IP_PROTO_UDP + ulen);
+		if(inet_csum_finish(inet_csum_add(udp, ulen, sum))) {
+			net->stats.bad_csum++;
+			tse_pkt_free(net->dma->pool, pkt);
+			return;
+		}
+	}
+
+	dport = tse_get16_(udp+2);
+	for(u32 i=0; i<TSE_NET_UDP_PORTS; i++) {
+		struct tse_udp_port *u = &net->udp[i];
+		if(u->port != dport) continue;
+		net->stats.udp_rx++;
+		if(!u->handler(u->context, pkt, udp + UDP_HDR_LEN, ulen - UDP_HDR_LEN, tse_get32_(ip+12), tse_get16_(udp)))
+			tse_pkt_free(net->dma->pool, pkt);
+		return;
+	}
+
+	net->stats.no_port++;
+	tse_pkt_free(net->dma->pool, pkt);
+}
+
+/*******************************************************************************
+*
+* @brief This function processes a received packet. The stack takes its ownership:
+*        it is freed, sent back as a reply, or handed to a UDP handler.
+*
+* @param net  Pointer to the stack structure.
+* @param pkt  Packet returned by tse_dma_rx.
+*
+******************************************************************************/
+static void tse_net_input(struct tse_net *net, struct tse_pkt *pkt)
+{
+	u8 *ip = pkt->data + ETH_HDR_LEN;
+	u32 type, ihl, len;
+
+	if(pkt->len < ETH_HDR_LEN + IP_HDR_LEN) {
+		if(pkt->len >= ETH_HDR_LEN + 28 && tse_get16_(pkt->data+12) == ETH_TYPE_ARP)
+			tse_net_arp_input_(net, pkt);
+		else
+			tse_pkt_free(net->dma->pool, pkt);
+		return;
+	}
+
+	type = tse_get16_(pkt->data+12);
+	if(type == ETH_TYPE_ARP) {
+		tse_net_arp_input_(net, pkt);
+		return;
+	}
+
+	ihl = (ip[0] & 0xF) * 4;
+	len = tse_get16_(ip+2);
+	if(type != ETH_TYPE_IP || (ip[0] >> 4) != 4 || ihl < IP_HDR_LEN || len < ihl ||
+	   ETH_HDR_LEN + len > pkt->len || tse_get32_(ip+16) != net->ip ||
+	   (tse_get16_(ip+6) & 0x3FFF)) {		//Fragments are not reassembled
+		net->stats.dropped++;
+		tse_pkt_free(net->dma->pool, pkt);
+		return;
+	}
+	if(inet_csum_finish(inet_csum_add(ip, ihl, 0))) {
+		net->stats.bad_csum++;
+		tse_pkt_free(net->dma->pool, pkt);
+		return;
+	}
+
+	//Replies go back to the sender, learn its address for free
+	tse_net_arp_learn_(net, tse_get32_(ip+12), pkt->data+6);
+
+	if(ip[9] == IP_PROTO_ICMP)
+		tse_net_icmp_input_(net, pkt, ip, ihl, len);
+	else if(ip[9] == IP_PROTO_UDP)
+		tse_net_udp_input_(net, pkt, ip, ihl, len);
+	else {
+		net->stats.dropped++;
+		tse_pkt_free(net->dma->pool, pkt);
+	}
+}
+
+/*******************************************************************************
+*
+* @brief This function receives and processes the pending packets, then reclaims
+*        the sent ones.
+*
+* @param net  Pointer to the stack structure.
+* @return     Number of packets processed.
+*
+******************************************************************************/
+static u32 tse_net_poll(struct tse_net *net)
+{
+	struct tse_pkt *pkt;
+	u32 n = 0;
+
+	while((pkt = tse_dma_rx(net->dma))) {
+		tse_net_input(net, pkt);
+		n++;
+	}
+	tse_dma_poll(net->dma);
+	return n;
+}
+
+/*******************************************************************************
+*
+* @brief This function builds the header template of a UDP destination. The next
+*        hop has to be in the ARP cache: otherwise an ARP request is sent and the
+*        call fails, to be retried after tse_net_poll.
+*
+* @param net       Pointer to the stack structure.
+* @param flow      Pointer to the flow structure.
+* @param dst_ip    Destination address, as DST_IP.
+* @param src_port  Local port, as SRC_PORT.
+* @param dst_port  Destination port, as DST_PORT.
+* @return          0 on success, -1 if the next hop is not resolved yet.
+*
+******************************************************************************/
+static int tse_udp_flow_init(struct tse_net *net, struct tse_udp_flow *flow, u32 dst_ip, u32 src_port, u32 dst_port)
+{
+	u32 hop = dst_ip;
+	const u8 *mac;
+	u8 *ip = flow->hdr + ETH_HDR_LEN;
+	u8 *udp = ip + IP_HDR_LEN;
+
+	if(net->gateway && ((dst_ip ^ net->ip) & net->netmask))
+		hop = net->gateway;
+	mac = tse_net_arp_lookup(net, hop);
+	if(!mac) {
+		tse_net_arp_request(net, hop);
+		return -1;
+	}
+
+	memset(flow->hdr, 0, sizeof(flow->hdr));
+	tse_net_eth_(net, flow->hdr, mac, ETH_TYPE_IP);
+	ip[0] = 0x45;
+	tse_put16_(ip+6, 0x4000);			//Don't Fragment
+	ip[8] = 64;							//TTL
+	ip[9] = IP_PROTO_UDP;
+	tse_put32_(ip+12, net->ip);
+	tse_put32_(ip+16, dst_ip);
+	tse_put16_(udp, src_port);
+	tse_put16_(udp+2, dst_port);
+
+	flow->ip_sum = inet_csum_add(ip, IP_HDR_LEN, 0);
+	flow->ip_id = 0;
+	return 0;
+}
+
+/*******************************************************************************
+*
+* @brief This function takes a buffer from the pool for a datagram.
+*
+* @param net      Pointer to the stack structure.
+* @param payload  Set to the payload area, UDP_PAYLOAD_MAX bytes.
+* @return         The buffer, or 0 if the pool is empty.
+*
+******************************************************************************/
+static struct tse_pkt *tse_udp_alloc(struct tse_net *net, u8 **payload)
+{
+	struct tse_pkt *pkt = tse_pkt_alloc(net->dma->pool);
+
+	if(pkt)
+		*payload = pkt->data + UDP_PAYLOAD_OFS;
+	return pkt;
+}
+
+/*******************************************************************************
+*
+* @brief This function sends a datagram of a flow. The headers are copied from the
+*        template in front of the payload, already in the buffer.
+*
+* @param net   Pointer to the stack structure.
+* @param flow  Pointer to the flow structure.
+* @param pkt   Buffer from tse_udp_alloc, owned by the stack afterwards.
+* @param len   Payload length, up to UDP_PAYLOAD_MAX.
+* @return      0 on success, -1 if the TX ring was full (the buffer is freed).
+*
+******************************************************************************/
+static int tse_udp_send(struct tse_net *net, struct tse_udp_flow *flow, struct tse_pkt *pkt, u32 len)
+{
+	u8 *ip = pkt->data + ETH_HDR_LEN;
+	u8 *udp = ip + IP_HDR_LEN;
+	u32 total = IP_HDR_LEN + UDP_HDR_LEN + len;
+	u32 id = flow->ip_id++;
+
+	memcpy(pkt->data, flow->hdr, UDP_PAYLOAD_OFS);
+	tse_put16_(ip+2, total);
+	tse_put16_(ip+4, id);
+	tse_put16_(ip+10, inet_csum_finish(flow->ip_sum + total + id));
+	tse_put16_(udp+4, UDP_HDR_LEN + len);
+#ifdef TSE_NET_UDP_CSUM
+	{
+		u32 sum = inet_csum_finish(inet_csum_add(udp, UDP_HDR_LEN + len, inet_csum_add(ip+12, 8, IP_PROTO_UDP + UDP_HDR_LEN + len)));
+		tse_put16_(udp+6, sum ? sum : 0xFFFF);
+	}
+#endif
+
+	net->stats.udp_tx++;
+	return tse_net_send_(net, pkt, ETH_HDR_LEN + total);
+}
+
+/*******************************************************************************
+*
+* @brief This function streams datagrams of a flow as fast as the TX ring accepts
+*        them, and prints the throughput with the fraction of the line rate
+*        reached. Each frame occupies 24 more bytes on the wire (preamble, FCS and
+*        inter-packet gap).
+*
+* @param net    Pointer to the stack structure.
+* @param flow   Pointer to the flow structure.
+* @param len    Payload length of each datagram.
+* @param count  Number of datagrams.
+* @param mbps   Line rate: 10, 100 or 1000.
+* @return       Wire throughput in per mille of the line rate.
+*
+******************************************************************************/
+static u32 tse_udp_stream(struct tse_net *net, struct tse_udp_flow *flow, u32 len, u32 count, u32 mbps)
+{
+	struct tse_pkt *pkt;
+	u8 *payload;
+	u32 t, sent = 0, wire, kbps, ratio;
+	u32 frame = ETH_HDR_LEN + IP_HDR_LEN + UDP_HDR_LEN + len;
+
+	if(frame < ETH_MIN_LEN) frame = ETH_MIN_LEN;
+	wire = frame + 4 + 8 + 12;
+
+	t = clint_getTimeLow(BSP_CLINT);
+	while(sent < count) {
+		tse_dma_poll(net->dma);
+		if(net->dma->tx.tail - net->dma->tx.head == TSE_DMA_RING_SIZE) continue;
+		pkt = tse_udp_alloc(net, &payload);
+		if(!pkt) continue;
+		tse_put32_(payload, sent);
+		if(tse_udp_send(net, flow, pkt, len) == 0) sent++;
+	}
+	while(net->dma->tx.head != net->dma->tx.tail)
+		tse_dma_poll(net->dma);
+	t = clint_getTimeLow(BSP_CLINT) - t;
+
+	kbps = (u32)((u64)sent * wire * 8 * (BSP_CLINT_HZ/1000) / (t ? t : 1));
+	ratio = kbps / mbps;
+	bsp_printf("UDP %d x %d bytes: %d kbps payload, %d kbps wire, %d.%d%% of %d Mbps\r\n",
+			   sent, len, (u32)((u64)kbps * len / wire), kbps, ratio/10, ratio%10, mbps);
+	return ratio;
+}
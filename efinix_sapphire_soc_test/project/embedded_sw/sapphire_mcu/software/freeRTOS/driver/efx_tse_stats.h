@@ -0,0 +1,240 @@
+/*******************************************************************************
+*
+* @file efx_tse_stats.h
+*
+* @brief Header file for a statistics sampler of the TSE (Triple-Speed Ethernet)
+*        MAC. It snapshots the counters printed by CntMonitor without printing
+*        them nor clearing them: each sample reads the raw 32 bits counters and
+*        keeps the wrap safe difference with the previous one, accumulated on
+*        64 bits. Per second rates are computed over the last interval, along
+*        with the receive and transmit error ratios. The application reads them
+*        with TseStatsGet / TseStatsRate, or copies a record with TseStatsExport
+*        to send it over the network; only TseStatsPrint uses the UART.
+*
+* Functions:
+* - TseStatsInit: Takes the baseline of the counters.
+* - TseStatsSample: Reads the counters and updates the totals and the rates.
+* - TseStatsPoll: Samples when the period has elapsed.
+* - TseStatsGet: Returns a counter total.
+* - TseStatsRate: Returns a counter rate per second.
+* - TseStatsRxErrorPpm: Returns the receive error ratio of the last interval.
+* - TseStatsTxErrorPpm: Returns the transmit error ratio of the last interval.
+* - TseStatsExport: Copies the statistics into a flat record.
+* - TseStatsPrint: Prints the statistics.
+*
+******************************************************************************/
+#pragma once
+
+#include <string.h>
+#include "bsp.h"
+#include "efx_tse_mac.h"
+
+/*******************************************************************************
+*
+* @brief Counters sampled, in the CntMonitor order.
+*
+******************************************************************************/
+enum tse_cnt {
+	TSE_CNT_TX_OK,				/* aFramesTransmittedOK */
+	TSE_CNT_RX_OK,				/* aFramesReceivedOK */
+	TSE_CNT_IN_ERR,				/* ifInErrors */
+	TSE_CNT_OUT_ERR,			/* ifOutErrors */
+	TSE_CNT_PKTS,				/* etherStatsPkts */
+	TSE_CNT_UNDERSIZE,			/* etherStatsUndersizePkts */
+	TSE_CNT_OVERSIZE,			/* etherStatsOversizePkts */
+	TSE_CNT_RX_FILTER_ERR,		/* aRxFilterFramesErrors */
+	TSE_CNT_FCS_ERR,			/* aFrameCheckSequenceErrors */
+	TSE_CNT_TX_PAUSE,			/* aTxPAUSEMACCtrlFrames */
+	TSE_CNT_RX_PAUSE,			/* aRxPAUSEMACCtrlFrames */
+	TSE_CNT_NUM
+};
+
+static const u32 TseCntOffset[TSE_CNT_NUM] = {
+	0x68, 0x6c, 0x88, 0x8c, 0xb4, 0xb8, 0xbc, 0x9c, 0x70, 0x80, 0x84
+};
+
+static const char *const TseCntName[TSE_CNT_NUM] = {
+	"aFramesTransmittedOK", "aFramesReceivedOK", "ifInErrors", "ifOutErrors",
+	"etherStatsPkts", "etherStatsUndersizePkts", "etherStatsOversizePkts",
+	"aRxFilterFramesErrors", "aFrameCheckSequenceErrors",
+	"aTxPAUSEMACCtrlFrames", "aRxPAUSEMACCtrlFrames"
+};
+
+/*******************************************************************************
+*
+* @brief Structure holding the sampler state.
+*
+******************************************************************************/
+struct tse_stats {
+	u32 raw[TSE_CNT_NUM];		/* Counters at the last sample */
+	u64 total[TSE_CNT_NUM];		/* Increase since TseStatsInit */
+	u32 delta[TSE_CNT_NUM];		/* Increase over the last interval */
+	u32 rate[TSE_CNT_NUM];		/* Per second over the last interval */
+	u64 time;					/* Time of the last sample, in CLINT ticks */
+	u32 interval;				/* Length of the last interval, in CLINT ticks */
+	u32 period;					/* Sampling period of TseStatsPoll, in CLINT ticks */
+	u32 samples;				/* Number of samples taken */
+};
+
+/*******************************************************************************
+*
+* @brief Flat record of TseStatsExport, 32 bits words in host order.
+*
+******************************************************************************/
+struct tse_stats_record {
+	u32 samples;
+	u32 interval_us;			/* Length of the last interval */
+	u32 total[TSE_CNT_NUM];		/* Totals, low 32 bits */
+	u32 rate[TSE_CNT_NUM];		/* Per second */
+	u32 rx_error_ppm;
+	u32 tx_error_ppm;
+};
+
+/*******************************************************************************
+*
+* @brief This function takes the baseline of the counters. The counters are not
+*        cleared, so the sampler can run beside other users of MacCntClean.
+*
+* @param st         Pointer to the sampler structure.
+* @param period_ms  Sampling period of TseStatsPoll, in ms.
+*
+******************************************************************************/
+static void TseStatsInit(struct tse_stats *st, u32 period_ms)
+{
+	memset(st, 0, sizeof(*st));
+	for(u32 i=0; i<TSE_CNT_NUM; i++)
+		st->raw[i] = read_u32(TSEMAC_CSR+TseCntOffset[i]);
+	st->time = clint_getTime(BSP_CLINT);
+	st->period = period_ms * (BSP_CLINT_HZ/1000);
+}
+
+/*******************************************************************************
+*
+* @brief This function reads the counters and updates the totals and the rates.
+*        The differences are taken modulo 2^32, so a counter wrapping between
+*        two samples is still counted right. A MacCntClean in between is seen
+*        as a wrap: call TseStatsInit again after clearing the counters.
+*
+* @param st  Pointer to the sampler structure.
+*
+******************************************************************************/
+static void TseStatsSample(struct tse_stats *st)
+{
+	u64 now = clint_getTime(BSP_CLINT);
+	u32 dt = (u32)(now - st->time);
+
+	for(u32 i=0; i<TSE_CNT_NUM; i++) {
+		u32 raw = read_u32(TSEMAC_CSR+TseCntOffset[i]);
+		st->delta[i] = raw - st->raw[i];
+		st->raw[i] = raw;
+		st->total[i] += st->delta[i];
+		st->rate[i] = dt ? (u32)((u64)st->delta[i] * BSP_CLINT_HZ / dt) : 0;
+	}
+	st->time = now;
+	st->interval = dt;
+	st->samples++;
+}
+
+/*******************************************************************************
+*
+* @brief This function samples the counters when the period has elapsed. It is
+*        meant to be called from the main loop or a timer tick.
+*
+* @param st  Pointer to the sampler structure.
+* @return    1 if a sample was taken, 0 otherwise.
+*
+******************************************************************************/
+static int TseStatsPoll(struct tse_stats *st)
+{
+	if(clint_getTime(BSP_CLINT) - st->time < st->period)
+		return 0;
+	TseStatsSample(st);
+	return 1;
+}
+
+/*******************************************************************************
+*
+* @brief This function returns the increase of a counter since TseStatsInit.
+*
+******************************************************************************/
+static u64 TseStatsGet(struct tse_stats *st, enum tse_cnt cnt)
+{
+	return st->total[cnt];
+}
+
+/*******************************************************************************
+*
+* @brief This function returns the rate per second of a counter over the last
+*        interval.
+*
+******************************************************************************/
+static u32 TseStatsRate(struct tse_stats *st, enum tse_cnt cnt)
+{
+	return st->rate[cnt];
+}
+
+/*******************************************************************************
+*
+* @brief This function returns the part of the received frames in error over the
+*        last interval, in parts per million.
+*
+******************************************************************************/
+static u32 TseStatsRxErrorPpm(struct tse_stats *st)
+{
+	u32 err = st->delta[TSE_CNT_IN_ERR];
+	u32 all = st->delta[TSE_CNT_RX_OK] + err;
+
+	return all ? (u32)((u64)err * 1000000 / all) : 0;
+}
+
+/*******************************************************************************
+*
+* @brief This function returns the part of the transmitted frames in error over
+*        the last interval, in parts per million.
+*
+******************************************************************************/
+static u32 TseStatsTxErrorPpm(struct tse_stats *st)
+{
+	u32 err = st->delta[TSE_CNT_OUT_ERR];
+	u32 all = st->delta[TSE_CNT_TX_OK] + err;
+
+	return all ? (u32)((u64)err * 1000000 / all) : 0;
+}
+
+/*******************************************************************************
+*
+* @brief This function copies the statistics into a flat record, for example as
+*        the payload of a UDP datagram.
+*
+* @param st   Pointer to the sampler structure.
+* @param rec  Record to fill.
+*
+******************************************************************************/
+static void TseStatsExport(struct tse_stats *st, struct tse_stats_record *rec)
+{
+	rec->samples = st->samples;
+	rec->interval_us = (u32)((u64)st->interval * 1000000 / BSP_CLINT_HZ);
+	for(u32 i=0; i<TSE_CNT_NUM; i++) {
+		rec->total[i] = (u32)st->total[i];
+		rec->rate[i] = st->rate[i];
+	}
+	rec->rx_error_ppm = TseStatsRxErrorPpm(st);
+	rec->tx_error_ppm = TseStatsTxErrorPpm(st);
+}
+
+/*******************************************************************************
+*
+* @brief This function prints the totals and rates. It blocks on the UART and is
+*        not meant for the packet path.
+*
+* @param st  Pointer to the sampler structure.
+*
+******************************************************************************/
+static void TseStatsPrint(struct tse_stats *st)
+{
+	bsp_print("--------------------");
+	for(u32 i=0; i<TSE_CNT_NUM; i++)
+		bsp_printf("%s : %d (%d/s)\r\n", TseCntName[i], (u32)st->total[i], st->rate[i]);
+	bsp_printf("Rx errors : %d ppm, Tx errors : %d ppm\r\n", TseStatsRxErrorPpm(st), TseStatsTxErrorPpm(st));
+	bsp_print("--------------------");
+}
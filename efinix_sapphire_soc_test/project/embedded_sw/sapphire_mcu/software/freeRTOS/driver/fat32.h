@@ -0,0 +1,796 @@
+/*******************************************************************************
+*
+* @file fat32.h
+*
+* @brief Header file for a compact streaming FAT32 reader/writer on top of the
+*        mmc_cache block cache. Directories, FAT sectors and partial sectors go
+*        through the cache, while the whole sectors of file data are moved with
+*        multi-block transfers straight from/to the caller buffer (requests of
+*        half the cache or more bypass it). With DMA_MODE, file buffers have
+*        to be 4 bytes aligned.
+*
+*        Each open file keeps a table of the contiguous cluster runs of its
+*        chain. A read covers a whole run with a single transfer, and the next
+*        run of the chain is resolved from the FAT as soon as the current one is
+*        reached, so that FAT accesses do not split the data transfers. This is
+*        a lookup of the FAT entries only: no file data is read ahead, each
+*        transfer is issued when fat32_read asks for it. The FAT itself is
+*        accessed through a one sector cache.
+*
+*        Supported: 512 bytes sectors, MBR or unpartitioned cards, 8.3 names
+*        (long name entries are skipped), paths with sub-directories, read,
+*        write, append, seek. Files are created in existing directories only.
+*
+* Functions:
+* - fat32_mount: Mounts the FAT32 volume of a card.
+* - fat32_open: Opens or creates a file.
+* - fat32_read: Reads from a file.
+* - fat32_write: Writes to a file.
+* - fat32_seek: Moves the position of a file.
+* - fat32_close: Writes the file back and closes it.
+* - fat32_sync: Writes the FAT and the cached blocks back to the card.
+*
+******************************************************************************/
+
+#pragma once
+
+#include <string.h>
+#include "type.h"
+#include "mmc_cache.h"
+
+#define FAT32_SECTOR				512
+#define FAT32_RUNS					8		// cluster runs kept per open file
+#define FAT32_MAX_TRANSFER			2048	// maximum sectors per data transfer
+#define FAT32_EOC					0x0FFFFFF8
+#define FAT32_MASK					0x0FFFFFFF
+
+#define FAT32_READ					0x1		// open an existing file for reading
+#define FAT32_WRITE					0x2		// create or truncate a file for writing
+#define FAT32_APPEND				0x4		// create or open a file, writing at its end
+
+#define FAT32_ATTR_DIRECTORY		0x10
+#define FAT32_ATTR_LFN				0x0F
+
+/*******************************************************************************
+*
+* @brief Structure holding a mounted FAT32 volume.
+*
+******************************************************************************/
+struct fat32_vol {
+	struct mmc_cache *dev;			/* Block cache of the card */
+	u32 fat_lba;					/* First sector of the first FAT */
+	u32 fat_sectors;				/* Sectors per FAT */
+	u32 data_lba;					/* First sector of cluster 2 */
+	u32 fsinfo_lba;					/* FSInfo sector, 0 if none */
+	u32 root_cluster;
+	u32 cluster_count;				/* Data clusters, valid numbers are 2..cluster_count+1 */
+	u32 free_hint;					/* Where the next free cluster search starts */
+	u32 spc;						/* Sectors per cluster */
+	u32 num_fats;
+	u32 fat_buf[FAT32_SECTOR/4];	/* FAT sector cache */
+	u32 fat_sector;					/* Sector held by fat_buf, 0xFFFFFFFF if none */
+	u32 fat_dirty;
+	u32 fsinfo_dirty;				/* Free count of FSInfo to be invalidated */
+};
+
+/*******************************************************************************
+*
+* @brief Structure describing contiguous clusters of a file.
+*
+******************************************************************************/
+struct fat32_run {
+	u32 index;						/* Position of the first cluster in the file chain */
+	u32 cluster;					/* First cluster */
+	u32 count;						/* Number of clusters */
+};
+
+/*******************************************************************************
+*
+* @brief Structure holding an open file.
+*
+******************************************************************************/
+struct fat32_file {
+	struct fat32_vol *vol;
+	u32 first_cluster;				/* 0 for an empty file */
+	u32 size;
+	u32 pos;
+	u32 mode;
+	u32 dir_lba;					/* Directory entry location */
+	u32 dir_offset;
+	u32 dirty;						/* Size or first cluster changed */
+	struct fat32_run runs[FAT32_RUNS];	/* Resolved window of the cluster chain */
+	u32 run_count;
+	u32 chain_end;					/* The last run ends the chain */
+	u32 sec_buf[FAT32_SECTOR/4];	/* Partial sector buffer */
+	u32 sec_lba;					/* Sector held by sec_buf, 0xFFFFFFFF if none */
+	u32 sec_dirty;
+};
+
+/*******************************************************************************
+*
+* @brief These functions read and write little endian fields at any alignment.
+*
+******************************************************************************/
+static u32 fat32_get16_(const u8 *p)
+{
+	return p[0] | (p[1] << 8);
+}
+
+static u32 fat32_get32_(const u8 *p)
+{
+	return p[0] | (p[1] << 8) | (p[2] << 16) | ((u32)p[3] << 24);
+}
+
+static void fat32_set16_(u8 *p, u32 v)
+{
+	p[0] = v;
+	p[1] = v >> 8;
+}
+
+static void fat32_set32_(u8 *p, u32 v)
+{
+	p[0] = v;
+	p[1] = v >> 8;
+	p[2] = v >> 16;
+	p[3] = v >> 24;
+}
+
+/*******************************************************************************
+*
+* @brief This function returns the first sector of a cluster.
+*
+******************************************************************************/
+static u32 fat32_cluster_lba_(struct fat32_vol *vol, u32 cluster)
+{
+	return vol->data_lba + (cluster - 2) * vol->spc;
+}
+
+/*******************************************************************************
+*
+* @brief This function writes the cached FAT sector back to every FAT copy.
+*
+******************************************************************************/
+static int fat32_fat_flush_(struct fat32_vol *vol)
+{
+	if(!vol->fat_dirty) return 0;
+	for(u32 n=0; n<vol->num_fats; n++) {
+		if(mmc_cache_write(vol->dev, vol->fat_sector + n * vol->fat_sectors, 1, (const char *)vol->fat_buf))
+			return -1;
+	}
+	vol->fat_dirty = 0;
+	return 0;
+}
+
+/*******************************************************************************
+*
+* @brief This function loads the FAT sector holding the entry of a cluster.
+*
+* @return Pointer to the entry in the FAT sector cache, 0 on failure.
+*
+******************************************************************************/
+static u32 *fat32_fat_entry_(struct fat32_vol *vol, u32 cluster)
+{
+	u32 sector = vol->fat_lba + cluster / (FAT32_SECTOR/4);
+
+	if(sector != vol->fat_sector) {
+		if(fat32_fat_flush_(vol)) return 0;
+		if(mmc_cache_read(vol->dev, sector, 1, (char *)vol->fat_buf)) {
+			vol->fat_sector = 0xFFFFFFFF;
+			return 0;
+		}
+		vol->fat_sector = sector;
+	}
+	return &vol->fat_buf[cluster % (FAT32_SECTOR/4)];
+}
+
+/*******************************************************************************
+*
+* @brief This function returns the FAT entry of a cluster.
+*
+* @return Next cluster of the chain, FAT32_EOC or more at its end, 0xFFFFFFFF on failure.
+*
+******************************************************************************/
+static u32 fat32_fat_get_(struct fat32_vol *vol, u32 cluster)
+{
+	u32 *e = fat32_fat_entry_(vol, cluster);
+	return e ? *e & FAT32_MASK : 0xFFFFFFFF;
+}
+
+/*******************************************************************************
+*
+* @brief This function sets the FAT entry of a cluster, keeping its reserved bits.
+*
+******************************************************************************/
+static int fat32_fat_set_(struct fat32_vol *vol, u32 cluster, u32 value)
+{
+	u32 *e = fat32_fat_entry_(vol, cluster);
+	if(!e) return -1;
+	*e = (*e & ~FAT32_MASK) | (value & FAT32_MASK);
+	vol->fat_dirty = 1;
+	return 0;
+}
+
+/*******************************************************************************
+*
+* @brief This function allocates a free cluster, preferably the one following prev
+*        so that the file stays contiguous, and links it after prev.
+*
+* @return The new cluster, 0 if the volume is full or on failure.
+*
+******************************************************************************/
+static u32 fat32_alloc_(struct fat32_vol *vol, u32 prev)
+{
+	u32 last = vol->cluster_count + 1;
+	u32 c = prev ? prev + 1 : vol->free_hint;
+
+	for(u32 n=0; n<vol->cluster_count; n++, c++) {
+		if(c > last || c < 2) c = 2;
+		u32 v = fat32_fat_get_(vol, c);
+		if(v == 0xFFFFFFFF) return 0;
+		if(v != 0) continue;
+
+		if(fat32_fat_set_(vol, c, FAT32_MASK)) return 0;
+		if(prev && fat32_fat_set_(vol, prev, c)) return 0;
+		vol->free_hint = c + 1;
+		vol->fsinfo_dirty = 1;
+		return c;
+	}
+	return 0;
+}
+
+/*******************************************************************************
+*
+* @brief This function frees a cluster chain.
+*
+******************************************************************************/
+static int fat32_free_chain_(struct fat32_vol *vol, u32 cluster)
+{
+	while(cluster >= 2 && cluster < FAT32_EOC) {
+		u32 next = fat32_fat_get_(vol, cluster);
+		if(next == 0xFFFFFFFF || fat32_fat_set_(vol, cluster, 0)) return -1;
+		if(cluster < vol->free_hint) vol->free_hint = cluster;
+		cluster = next;
+	}
+	vol->fsinfo_dirty = 1;
+	return 0;
+}
+
+/*******************************************************************************
+*
+* @brief This function writes the FAT and the cached blocks back to the card. The
+*        FSInfo free cluster count is marked unknown once clusters were allocated
+*        or freed.
+*
+* @param vol  Pointer to the volume structure.
+* @return     0 on success, -1 on failure.
+*
+******************************************************************************/
+static int fat32_sync(struct fat32_vol *vol)
+{
+	u8 sec[FAT32_SECTOR] __attribute__ ((aligned (4)));
+
+	if(fat32_fat_flush_(vol)) return -1;
+	if(vol->fsinfo_dirty && vol->fsinfo_lba) {
+		if(mmc_cache_read(vol->dev, vol->fsinfo_lba, 1, (char *)sec)) return -1;
+		if(fat32_get32_(sec) == 0x41615252) {
+			fat32_set32_(sec + 488, 0xFFFFFFFF);
+			fat32_set32_(sec + 492, vol->free_hint);
+			if(mmc_cache_write(vol->dev, vol->fsinfo_lba, 1, (const char *)sec)) return -1;
+		}
+		vol->fsinfo_dirty = 0;
+	}
+	return mmc_cache_flush(vol->dev);
+}
+
+/*******************************************************************************
+*
+* @brief This function mounts the FAT32 volume of a card, from the first FAT32
+*        partition of its MBR or from an unpartitioned card.
+*
+* @param vol  Pointer to the volume structure.
+* @param dev  Pointer to the block cache of the card, initialized by mmc_cache_init.
+* @return     0 on success, -1 if no FAT32 volume is found.
+*
+******************************************************************************/
+static int fat32_mount(struct fat32_vol *vol, struct mmc_cache *dev)
+{
+	u8 sec[FAT32_SECTOR] __attribute__ ((aligned (4)));
+	u32 part = 0;
+
+	memset(vol, 0, sizeof(struct fat32_vol));
+	vol->dev = dev;
+	vol->fat_sector = 0xFFFFFFFF;
+
+	if(mmc_cache_read(dev, 0, 1, (char *)sec)) return -1;
+	if(sec[510] != 0x55 || sec[511] != 0xAA) return -1;
+
+	//An MBR has no BPB jump instruction, take its first FAT32 partition
+	if(sec[0] != 0xEB && sec[0] != 0xE9) {
+		for(u32 n=0; n<4; n++) {
+			u8 *p = sec + 446 + n*16;
+			if(p[4] == 0x0B || p[4] == 0x0C) {
+				part = fat32_get32_(p + 8);
+				break;
+			}
+		}
+		if(!part) return -1;
+		if(mmc_cache_read(dev, part, 1, (char *)sec)) return -1;
+	}
+
+	if(fat32_get16_(sec + 11) != FAT32_SECTOR) return -1;
+	if(fat32_get16_(sec + 22) != 0 || fat32_get32_(sec + 36) == 0) return -1;	//FAT12/16
+
+	vol->spc = sec[13];
+	vol->num_fats = sec[16];
+	vol->fat_sectors = fat32_get32_(sec + 36);
+	vol->fat_lba = part + fat32_get16_(sec + 14);
+	vol->data_lba = vol->fat_lba + vol->num_fats * vol->fat_sectors;
+	vol->root_cluster = fat32_get32_(sec + 44);
+	vol->fsinfo_lba = fat32_get16_(sec + 48) ? part + fat32_get16_(sec + 48) : 0;
+	vol->cluster_count = (part + fat32_get32_(sec + 32) - vol->data_lba) / (vol->spc ? vol->spc : 1);
+	vol->free_hint = 2;
+
+	if(vol->spc == 0 || vol->num_fats == 0) return -1;
+	return 0;
+}
+
+/*******************************************************************************
+*
+* @brief This function converts a path component to a space padded 8.3 name.
+*
+* @return Pointer to the next component, 0 if the name is not a valid 8.3 name.
+*
+******************************************************************************/
+static const char *fat32_name83_(const char *path, u8 *name)
+{
+	u32 n = 0, limit = 8;
+
+	memset(name, ' ', 11);
+	while(*path && *path != '/') {
+		char ch = *path++;
+		if(ch == '.' && limit == 8) {
+			n = 8;
+			limit = 11;
+			continue;
+		}
+		if(n >= limit) return 0;
+		if(ch >= 'a' && ch <= 'z') ch -= 'a' - 'A';
+		name[n++] = ch;
+	}
+	while(*path == '/') path++;
+	return path;
+}
+
+/*******************************************************************************
+*
+* @brief This function looks an 8.3 name up in a directory, or a free entry when
+*        name is 0. A free entry is made by extending the directory if needed.
+*
+* @return 0 when found, with the entry copied to entry and located by lba/offset.
+*
+******************************************************************************/
+static int fat32_dir_find_(struct fat32_vol *vol, u32 cluster, const u8 *name, u8 *entry, u32 *lba, u32 *offset)
+{
+	u8 sec[FAT32_SECTOR] __attribute__ ((aligned (4)));
+	u32 prev = 0;
+
+	while(cluster >= 2 && cluster < FAT32_EOC) {
+		u32 first = fat32_cluster_lba_(vol, cluster);
+		for(u32 s=0; s<vol->spc; s++) {
+			if(mmc_cache_read(vol->dev, first + s, 1, (char *)sec)) return -1;
+			for(u32 o=0; o<FAT32_SECTOR; o+=32) {
+				u8 *e = sec + o;
+				if(name) {
+					if(e[0] == 0x00) return -1;
+					if(e[0] == 0xE5 || e[11] == FAT32_ATTR_LFN) continue;
+					if(memcmp(e, name, 11)) continue;
+				} else {
+					if(e[0] != 0x00 && e[0] != 0xE5) continue;
+				}
+				memcpy(entry, e, 32);
+				*lba = first + s;
+				*offset = o;
+				return 0;
+			}
+		}
+		prev = cluster;
+		cluster = fat32_fat_get_(vol, cluster);
+	}
+
+	if(name || !prev) return -1;
+
+	//Directory full, append a zeroed cluster to it
+	cluster = fat32_alloc_(vol, prev);
+	if(!cluster) return -1;
+	memset(sec, 0, FAT32_SECTOR);
+	for(u32 s=0; s<vol->spc; s++) {
+		if(mmc_cache_write(vol->dev, fat32_cluster_lba_(vol, cluster) + s, 1, (const char *)sec)) return -1;
+	}
+	memset(entry, 0, 32);
+	*lba = fat32_cluster_lba_(vol, cluster);
+	*offset = 0;
+	return 0;
+}
+
+/*******************************************************************************
+*
+* @brief This function writes a directory entry back.
+*
+******************************************************************************/
+static int fat32_dir_write_(struct fat32_vol *vol, u32 lba, u32 offset, const u8 *entry)
+{
+	u8 sec[FAT32_SECTOR] __attribute__ ((aligned (4)));
+
+	if(mmc_cache_read(vol->dev, lba, 1, (char *)sec)) return -1;
+	memcpy(sec + offset, entry, 32);
+	return mmc_cache_write(vol->dev, lba, 1, (const char *)sec);
+}
+
+/*******************************************************************************
+*
+* @brief This function resolves the next cluster run of a file from the FAT. When
+*        the run table is full, the oldest run is dropped.
+*
+* @return 1 if a run was added, 0 at the end of the chain, -1 on failure.
+*
+******************************************************************************/
+static int fat32_resolve_(struct fat32_file *f)
+{
+	struct fat32_vol *vol = f->vol;
+	struct fat32_run *r;
+	u32 cluster, index;
+
+	if(f->chain_end) return 0;
+
+	if(f->run_count == 0) {
+		if(f->first_cluster < 2) {
+			f->chain_end = 1;
+			return 0;
+		}
+		cluster = f->first_cluster;
+		index = 0;
+	} else {
+		r = &f->runs[f->run_count-1];
+		cluster = fat32_fat_get_(vol, r->cluster + r->count - 1);
+		if(cluster == 0xFFFFFFFF) return -1;
+		if(cluster >= FAT32_EOC || cluster < 2) {
+			f->chain_end = 1;
+			return 0;
+		}
+		index = r->index + r->count;
+	}
+
+	if(f->run_count == FAT32_RUNS) {
+		memmove(&f->runs[0], &f->runs[1], sizeof(struct fat32_run) * (FAT32_RUNS-1));
+		f->run_count--;
+	}
+	r = &f->runs[f->run_count++];
+	r->index = index;
+	r->cluster = cluster;
+	r->count = 1;
+
+	//Contiguous run detection
+	while(1) {
+		u32 next = fat32_fat_get_(vol, cluster);
+		if(next == 0xFFFFFFFF) return -1;
+		if(next != cluster + 1) {
+			if(next >= FAT32_EOC || next < 2) f->chain_end = 1;
+			break;
+		}
+		cluster = next;
+		r->count++;
+	}
+	return 1;
+}
+
+/*******************************************************************************
+*
+* @brief This function finds the run holding a cluster of a file, resolving the
+*        chain as far as needed.
+*
+* @param run  Set to the run when found.
+* @return     1 if found, 0 if the chain is shorter, -1 if the FAT could not be read.
+*
+******************************************************************************/
+static int fat32_locate_(struct fat32_file *f, u32 index, struct fat32_run **run)
+{
+	int ret;
+
+	//Behind the resolved window, start again from the first cluster
+	if(f->run_count && index < f->runs[0].index) {
+		f->run_count = 0;
+		f->chain_end = 0;
+	}
+
+	while(1) {
+		for(u32 n=0; n<f->run_count; n++) {
+			struct fat32_run *r = &f->runs[n];
+			if(index >= r->index && index < r->index + r->count) {
+				*run = r;
+				return 1;
+			}
+		}
+		ret = fat32_resolve_(f);
+		if(ret <= 0) return ret;
+	}
+}
+
+/*******************************************************************************
+*
+* @brief This function writes the partial sector buffer of a file back.
+*
+******************************************************************************/
+static int fat32_sec_flush_(struct fat32_file *f)
+{
+	if(!f->sec_dirty) return 0;
+	if(mmc_cache_write(f->vol->dev, f->sec_lba, 1, (const char *)f->sec_buf)) return -1;
+	f->sec_dirty = 0;
+	return 0;
+}
+
+/*******************************************************************************
+*
+* @brief This function loads a sector in the partial sector buffer of a file.
+*
+******************************************************************************/
+static int fat32_sec_load_(struct fat32_file *f, u32 lba, u32 fill)
+{
+	if(f->sec_lba == lba) return 0;
+	if(fat32_sec_flush_(f)) return -1;
+	f->sec_lba = 0xFFFFFFFF;
+	if(fill) {
+		if(mmc_cache_read(f->vol->dev, lba, 1, (char *)f->sec_buf)) return -1;
+	} else {
+		memset(f->sec_buf, 0, FAT32_SECTOR);
+	}
+	f->sec_lba = lba;
+	return 0;
+}
+
+/*******************************************************************************
+*
+* @brief This function opens or creates a file.
+*
+* @param vol   Pointer to the mounted volume.
+* @param f     Pointer to the file structure.
+* @param path  Path from the root directory, 8.3 names separated by '/'.
+* @param mode  FAT32_READ, FAT32_WRITE or FAT32_APPEND.
+* @return      0 on success, -1 on failure.
+*
+******************************************************************************/
+static int fat32_open(struct fat32_vol *vol, struct fat32_file *f, const char *path, u32 mode)
+{
+	u8 name[11], entry[32];
+	u32 dir = vol->root_cluster;
+
+	memset(f, 0, sizeof(struct fat32_file));
+	f->vol = vol;
+	f->mode = mode;
+	f->sec_lba = 0xFFFFFFFF;
+
+	while(*path == '/') path++;
+	while(1) {
+		path = fat32_name83_(path, name);
+		if(!path) return -1;
+		if(fat32_dir_find_(vol, dir, name, entry, &f->dir_lba, &f->dir_offset)) {
+			if(*path || mode == FAT32_READ) return -1;
+			//Create the file in the last directory
+			if(fat32_dir_find_(vol, dir, 0, entry, &f->dir_lba, &f->dir_offset)) return -1;
+			memset(entry, 0, 32);
+			memcpy(entry, name, 11);
+			fat32_set16_(entry + 24, 0x0021);	//1980-01-01
+			if(fat32_dir_write_(vol, f->dir_lba, f->dir_offset, entry)) return -1;
+			return 0;
+		}
+		if(!*path) break;
+		if(!(entry[11] & FAT32_ATTR_DIRECTORY)) return -1;
+		dir = fat32_get16_(entry + 26) | (fat32_get16_(entry + 20) << 16);
+	}
+
+	if(entry[11] & FAT32_ATTR_DIRECTORY) return -1;
+	f->first_cluster = fat32_get16_(entry + 26) | (fat32_get16_(entry + 20) << 16);
+	f->size = fat32_get32_(entry + 28);
+
+	if(mode == FAT32_WRITE && f->first_cluster) {
+		if(fat32_free_chain_(vol, f->first_cluster)) return -1;
+		f->first_cluster = 0;
+		f->size = 0;
+		f->dirty = 1;
+	}
+	if(mode == FAT32_APPEND) f->pos = f->size;
+	return 0;
+}
+
+/*******************************************************************************
+*
+* @brief This function reads from a file. Whole sectors are transferred straight to
+*        the buffer, one multi-block transfer per cluster run.
+*
+* @param f    Pointer to the open file.
+* @param buf  Destination buffer.
+* @param len  Number of bytes to read.
+* @return     Number of bytes read, -1 on failure.
+*
+******************************************************************************/
+static int fat32_read(struct fat32_file *f, void *buf, u32 len)
+{
+	struct fat32_vol *vol = f->vol;
+	u32 cluster_bytes = vol->spc * FAT32_SECTOR;
+	u8 *dst = (u8 *)buf;
+	u32 done = 0;
+
+	if(f->pos >= f->size) return 0;
+	if(len > f->size - f->pos) len = f->size - f->pos;
+
+	while(done < len) {
+		u32 index = f->pos / cluster_bytes;
+		u32 offset = f->pos % cluster_bytes;
+		struct fat32_run *r;
+		if(fat32_locate_(f, index, &r) <= 0) return -1;
+
+		u32 lba = fat32_cluster_lba_(vol, r->cluster + index - r->index) + offset / FAT32_SECTOR;
+		u32 span = (r->index + r->count - index) * cluster_bytes - offset;
+		u32 chunk = len - done;
+		if(chunk > span) chunk = span;
+
+		if(f->pos % FAT32_SECTOR == 0 && chunk >= FAT32_SECTOR) {
+			u32 sectors = chunk / FAT32_SECTOR;
+			if(sectors > FAT32_MAX_TRANSFER) sectors = FAT32_MAX_TRANSFER;
+			//The partial sector buffer may hold newer data
+			if(f->sec_lba - lba < sectors && fat32_sec_flush_(f)) return -1;
+			if(mmc_cache_read(vol->dev, lba, sectors, (char *)dst)) return -1;
+			chunk = sectors * FAT32_SECTOR;
+		} else {
+			u32 in = f->pos % FAT32_SECTOR;
+			if(chunk > FAT32_SECTOR - in) chunk = FAT32_SECTOR - in;
+			if(fat32_sec_load_(f, lba, 1)) return -1;
+			memcpy(dst, (u8 *)f->sec_buf + in, chunk);
+		}
+
+		dst += chunk;
+		done += chunk;
+		f->pos += chunk;
+
+		//Resolve the FAT entries of the next run before it is needed, its data is not prefetched
+		if(chunk == span && r == &f->runs[f->run_count-1] && fat32_resolve_(f) < 0) return -1;
+	}
+	return done;
+}
+
+/*******************************************************************************
+*
+* @brief This function writes to a file, allocating its clusters contiguously when
+*        possible. Whole sectors are transferred straight from the buffer.
+*
+* @param f    Pointer to the open file.
+* @param buf  Source buffer.
+* @param len  Number of bytes to write.
+* @return     Number of bytes written, -1 on failure.
+*
+******************************************************************************/
+static int fat32_write(struct fat32_file *f, const void *buf, u32 len)
+{
+	struct fat32_vol *vol = f->vol;
+	u32 cluster_bytes = vol->spc * FAT32_SECTOR;
+	const u8 *src = (const u8 *)buf;
+	u32 done = 0;
+
+	if(f->mode == FAT32_READ) return -1;
+
+	while(done < len) {
+		u32 index = f->pos / cluster_bytes;
+		u32 offset = f->pos % cluster_bytes;
+		struct fat32_run *r;
+		int found = fat32_locate_(f, index, &r);
+
+		//The chain is unknown past a FAT read error, appending would corrupt it
+		if(found < 0) return -1;
+		if(!found) {
+			//Past the end of the chain, append a cluster
+			u32 last = 0;
+			if(f->run_count) {
+				r = &f->runs[f->run_count-1];
+				last = r->cluster + r->count - 1;
+			}
+			u32 c = fat32_alloc_(vol, last);
+			if(!c) return done ? (int)done : -1;
+			if(!last) {
+				f->first_cluster = c;
+				f->dirty = 1;
+			}
+			if(last && c == last + 1) {
+				r->count++;
+			} else {
+				u32 next = last ? r->index + r->count : 0;
+				if(f->run_count == FAT32_RUNS) {
+					memmove(&f->runs[0], &f->runs[1], sizeof(struct fat32_run) * (FAT32_RUNS-1));
+					f->run_count--;
+				}
+				struct fat32_run *n = &f->runs[f->run_count++];
+				n->index = next;
+				n->cluster = c;
+				n->count = 1;
+			}
+			f->chain_end = 1;
+			continue;
+		}
+
+		u32 lba = fat32_cluster_lba_(vol, r->cluster + index - r->index) + offset / FAT32_SECTOR;
+		u32 span = (r->index + r->count - index) * cluster_bytes - offset;
+		u32 chunk = len - done;
+		if(chunk > span) chunk = span;
+
+		if(f->pos % FAT32_SECTOR == 0 && chunk >= FAT32_SECTOR) {
+			u32 sectors = chunk / FAT32_SECTOR;
+			if(sectors > FAT32_MAX_TRANSFER) sectors = FAT32_MAX_TRANSFER;
+			//The partial sector buffer is overwritten
+			if(f->sec_lba - lba < sectors) {
+				f->sec_dirty = 0;
+				f->sec_lba = 0xFFFFFFFF;
+			}
+			if(mmc_cache_write(vol->dev, lba, sectors, (const char *)src)) return -1;
+			chunk = sectors * FAT32_SECTOR;
+		} else {
+			u32 in = f->pos % FAT32_SECTOR;
+			if(chunk > FAT32_SECTOR - in) chunk = FAT32_SECTOR - in;
+			//No need to read a sector past the end of the file
+			if(fat32_sec_load_(f, lba, f->pos - in < f->size)) return -1;
+			memcpy((u8 *)f->sec_buf + in, src, chunk);
+			f->sec_dirty = 1;
+		}
+
+		src += chunk;
+		done += chunk;
+		f->pos += chunk;
+		if(f->pos > f->size) {
+			f->size = f->pos;
+			f->dirty = 1;
+		}
+	}
+	return done;
+}
+
+/*******************************************************************************
+*
+* @brief This function moves the position of a file.
+*
+* @param f    Pointer to the open file.
+* @param pos  New position, up to the file size.
+* @return     0 on success, -1 if pos is past the end of the file.
+*
+******************************************************************************/
+static int fat32_seek(struct fat32_file *f, u32 pos)
+{
+	if(pos > f->size) return -1;
+	f->pos = pos;
+	return 0;
+}
+
+/*******************************************************************************
+*
+* @brief This function writes the buffered data, the directory entry, the FAT and
+*        the cached blocks of a file back, and closes it.
+*
+* @param f  Pointer to the open file.
+* @return   0 on success, -1 on failure.
+*
+******************************************************************************/
+static int fat32_close(struct fat32_file *f)
+{
+	struct fat32_vol *vol = f->vol;
+	u8 sec[FAT32_SECTOR] __attribute__ ((aligned (4)));
+
+	if(f->mode == FAT32_READ) return 0;
+	if(fat32_sec_flush_(f)) return -1;
+
+	if(f->dirty) {
+		if(mmc_cache_read(vol->dev, f->dir_lba, 1, (char *)sec)) return -1;
+		u8 *e = sec + f->dir_offset;
+		fat32_set16_(e + 20, f->first_cluster >> 16);
+		fat32_set16_(e + 26, f->first_cluster & 0xFFFF);
+		fat32_set32_(e + 28, f->size);
+		if(mmc_cache_write(vol->dev, f->dir_lba, 1, (const char *)sec)) return -1;
+		f->dirty = 0;
+	}
+	return fat32_sync(vol);
+}
@@ -34,6 +34,9 @@
 * - i2c_readData_b: Reads data from a specified register address (8bit) on an I2C slave device.
 * - i2c_readData_w: Reads data from a specified register address (16bit) on an I2C slave device.
 * - i2c_applyConfig: Applies the configuration settings to the I2C module.
+* - i2c_computeConfig: Computes the timing configuration for a requested SCL frequency.
+* - i2c_readDataChecked_b: Reads data with 8-bit register address and reports a NACK.
+* - i2c_probeMaxSpeed: Finds the fastest SCL frequency a slave device answers reliably.
 * - i2c_filterEnable: Enables filtering for a specific filter ID.
 * - i2c_masterStart: Initiates the start condition for I2C communication.
 * - i2c_masterRestart: Initiates a repeated start condition for I2C communication.
@@ -113,8 +116,13 @@
 #define I2C_FILTER_7_BITS               (0)
 #define I2C_FILTER_10_BITS              (1 << 14)
 #define I2C_FILTER_ENABLE               (1 << 15)
+#define I2C_INTERRUPT_RX_DATA           (1 << 0)
+#define I2C_INTERRUPT_RX_ACK            (1 << 1)
 #define I2C_INTERRUPT_TX_DATA           (1 << 2)
 #define I2C_INTERRUPT_TX_ACK            (1 << 3)
+#define I2C_INTERRUPT_START             (1 << 4)
+#define I2C_INTERRUPT_RESTART           (1 << 5)
+#define I2C_INTERRUPT_END               (1 << 6)
 #define I2C_INTERRUPT_DROP              (1 << 7)
 #define I2C_INTERRUPT_CLOCK_GEN_EXIT    (1 << 15)
 #define I2C_INTERRUPT_CLOCK_GEN_ENTER   (1 << 16)
@@ -122,6 +130,10 @@
 #define I2C_INTERRUPT_FILTER            (1 << 17)
 #define I2C_READ                        0x01
 #define I2C_WRITE                       0x00
+#define I2C_SPEED_STANDARD              100000
+#define I2C_SPEED_FAST                  400000
+#define I2C_SPEED_FAST_PLUS             1000000
+#define I2C_PROBE_MAX_LENGTH            16
 
 
 /******************************************************************************
@@ -742,3 +754,175 @@
         data[length-1] = i2c_rxData(reg);           // read the data from rx data register and place it into last data array
         i2c_masterStopBlocking(reg);                // send stop sequence
     }
+
+/*******************************************************************************
+*
+* This function converts a duration in nanoseconds to a number of clock cycles,
+* rounded up.
+*
+* @param   ns: Duration in nanoseconds.
+* @param   clockHz: Frequency of the I2C controller clock.
+*
+* @return  Number of clock cycles.
+*
+*******************************************************************************/
+    static u32 i2c_nsToCycles_(u32 ns, u32 clockHz){
+        return (u32)(((u64)ns * clockHz + 999999999ull) / 1000000000ull);
+    }
+
+/*******************************************************************************
+*
+* This function computes the timing configuration for a requested SCL frequency.
+*
+* @param   config: Configuration structure to fill.
+* @param   clockHz: Frequency of the I2C controller clock (ex: SYSTEM_CLINT_HZ).
+* @param   sclHz: Requested SCL frequency, up to I2C_SPEED_FAST_PLUS.
+*
+* @return  0 on success, -1 if the frequency can't be reached with this clock.
+*
+* The minimum SCL low/high, bus free and data setup times of the I2C specification
+* are selected from the requested frequency (standard-mode up to 100 kHz, fast-mode
+* up to 400 kHz, fast-mode plus up to 1 MHz). The remaining part of the SCL period
+* is shared between tLow and tHigh proportionally to their minimum. The sampling
+* divider is kept at the small fixed value used by the other configurations, as a
+* slower sampler delays the SCL edges seen by the controller and stretches the
+* real SCL period.
+* Every field is written as a cycle count - 1, as expected by the controller.
+*
+*******************************************************************************/
+    static int i2c_computeConfig(I2c_Config *config, u32 clockHz, u32 sclHz){
+        u32 lowNs, highNs, bufNs, suDatNs;
+
+        if(sclHz == 0 || sclHz > I2C_SPEED_FAST_PLUS) return -1;
+
+        if(sclHz <= I2C_SPEED_STANDARD){
+            lowNs = 4700; highNs = 4000; bufNs = 4700; suDatNs = 250;
+        } else if(sclHz <= I2C_SPEED_FAST){
+            lowNs = 1300; highNs = 600;  bufNs = 1300; suDatNs = 100;
+        } else {
+            lowNs = 500;  highNs = 260;  bufNs = 500;  suDatNs = 50;
+        }
+
+        u32 period = clockHz / sclHz;
+        u32 low = i2c_nsToCycles_(lowNs, clockHz);
+        u32 high = i2c_nsToCycles_(highNs, clockHz);
+        if(period < low + high) return -1;
+
+        u32 extra = period - low - high;
+        u32 extraLow = extra * low / (low + high);
+        low += extraLow;
+        high += extra - extraLow;
+
+        config->samplingClockDivider = 3;
+        config->timeout = clockHz / 1000;    //1 ms
+        config->tsuDat = i2c_nsToCycles_(suDatNs, clockHz);
+        config->tLow = low - 1;
+        config->tHigh = high - 1;
+        config->tBuf = i2c_nsToCycles_(bufNs, clockHz);
+        if(config->tsuDat) config->tsuDat -= 1;
+        if(config->tBuf) config->tBuf -= 1;
+        return 0;
+    }
+
+/*******************************************************************************
+*
+* This function is to read data with 8-bit register address and report a NACK
+* of the slave device.
+*
+* @param   reg: I2C peripheral register base address.
+* @param   slaveAddr: Address of the slave device.
+* @param   regAddr: 8-bit register address.
+* @param   data: Pointer to the data buffer to store read data.
+* @param   length: Length of the data buffer.
+*
+* @return  0 on success, -1 if the slave did not acknowledge.
+*
+* Same sequence as i2c_readData_b, the acknowledge bit of the slave is checked
+* after each byte sent by the master and the transaction is aborted with a stop
+* sequence on the first NACK.
+*
+*******************************************************************************/
+    static int i2c_readDataChecked_b(u32 reg, u8 slaveAddr, u8 regAddr, u8 *data , u32 length){
+        i2c_masterStartBlocking(reg);               // Send start sequence
+        i2c_txByte(reg, slaveAddr|I2C_WRITE);       // write device address byte with write bit
+        i2c_txNackBlocking(reg);                    // release SDA during the ack bit
+        if(i2c_rxNack(reg)) goto nack;
+        i2c_txByte(reg, (regAddr & 0xFF));          // write register address
+        i2c_txNackBlocking(reg);
+        if(i2c_rxNack(reg)) goto nack;
+        i2c_masterRestartBlocking(reg);             // send restart sequence and wait for it to complete
+        i2c_txByte(reg, slaveAddr|I2C_READ);        // write device address byte with read bit
+        i2c_txNackBlocking(reg);
+        if(i2c_rxNack(reg)) goto nack;
+        for(u32 i = 0; i < length; i++){
+            i2c_txByte(reg, 0xFF);                  // release SDA while generating 8-bit SCL pulses
+            if(i != length - 1) i2c_txAckBlocking(reg); else i2c_txNackBlocking(reg);
+            data[i] = i2c_rxData(reg);
+        }
+        i2c_masterStopBlocking(reg);                // send stop sequence
+        return 0;
+
+    nack:
+        i2c_masterStopBlocking(reg);
+        return -1;
+    }
+
+/*******************************************************************************
+*
+* This function finds the fastest SCL frequency at which a slave device answers
+* reliably.
+*
+* @param   reg: I2C peripheral register base address.
+* @param   clockHz: Frequency of the I2C controller clock (ex: SYSTEM_CLINT_HZ).
+* @param   slaveAddr: Address of the slave device.
+* @param   regAddr: 8-bit register address of a stable (non volatile) register area.
+* @param   length: Number of bytes to read back at each step (1 to I2C_PROBE_MAX_LENGTH).
+* @param   retries: Number of reads performed at each step.
+*
+* @return  The selected SCL frequency in Hz, or 0 if the device does not answer
+*          at standard-mode.
+*
+* A reference content is read at standard-mode. The SCL frequency is then stepped
+* up to fast-mode plus, each step being validated by reading the same registers
+* several times. The first NACK or data mismatch stops the search and the
+* configuration of the previous (last good) step is applied again. Run it once
+* per device and keep the lowest result when several devices share the bus.
+*
+*******************************************************************************/
+    static u32 i2c_probeMaxSpeed(u32 reg, u32 clockHz, u8 slaveAddr, u8 regAddr, u32 length, u32 retries){
+        static const u32 steps[] = {100000, 200000, 400000, 600000, 800000, 1000000};
+        u8 reference[I2C_PROBE_MAX_LENGTH];
+        u8 readback[I2C_PROBE_MAX_LENGTH];
+        I2c_Config config;
+        u32 best = 0;
+
+        if(length == 0 || length > I2C_PROBE_MAX_LENGTH) return 0;
+
+        for(u32 s = 0; s < sizeof(steps)/sizeof(steps[0]); s++){
+            if(i2c_computeConfig(&config, clockHz, steps[s])) break;
+            i2c_applyConfig(reg, &config);
+
+            int pass = 1;
+            if(s == 0){
+                pass = i2c_readDataChecked_b(reg, slaveAddr, regAddr, reference, length) == 0;
+            }
+            for(u32 r = 0; pass && r < retries; r++){
+                if(i2c_readDataChecked_b(reg, slaveAddr, regAddr, readback, length)){
+                    pass = 0;
+                    break;
+                }
+                for(u32 i = 0; i < length; i++){
+                    if(readback[i] != reference[i]) pass = 0;
+                }
+            }
+
+            if(!pass) break;
+            best = steps[s];
+        }
+
+        if(best){
+            i2c_computeConfig(&config, clockHz, best);
+            i2c_applyConfig(reg, &config);
+        }
+        return best;
+    }
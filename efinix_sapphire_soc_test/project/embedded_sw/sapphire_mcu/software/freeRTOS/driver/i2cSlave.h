@@ -0,0 +1,391 @@
+/*******************************************************************************
+*
+* @file i2cSlave.h
+*
+* @brief Header file for an interrupt driven I2C slave (target) engine. Each
+*        hardware address filter is bound to a RAM backed register map which
+*        the bus master can read and write with an auto-incremented register
+*        pointer, in the same way as most I2C sensors and EEPROMs.
+*
+*        Write frame : [addr+W] [pointer] [data0] [data1] ...
+*        Read frame  : [addr+R] [data@pointer] [data@pointer+1] ...
+*
+*        Write data is acknowledged with the repeat mode of the TX_ACK register,
+*        so the controller never stretches SCL on writes. Read data is fed from
+*        the TX_DATA request interrupt, one byte ahead of the master, SCL is only
+*        stretched when the ISR did not refill the byte in time. Such late
+*        refills are counted in the statistics together with the cycle count
+*        spent in the ISR. A fed byte is committed (register pointer and byte
+*        count) only once its ack slot went by, so the byte prefetched when the
+*        master nacks is read again by the next frame.
+*
+* Functions:
+* - i2cSlave_init: Initializes the slave engine context for an I2C controller.
+* - i2cSlave_addMap: Binds a register map to an address filter.
+* - i2cSlave_removeMap: Disables an address filter and unbinds its register map.
+* - i2cSlave_start: Clears the pending flags and enables the slave interrupts.
+* - i2cSlave_stop: Disables the slave interrupts and releases the bus.
+* - i2cSlave_isr: Services the controller, to be called from the PLIC handler.
+* - i2cSlave_getStats: Copies the engine statistics.
+* - i2cSlave_resetStats: Clears the engine statistics.
+*
+******************************************************************************/
+
+#pragma once
+
+#include "type.h"
+#include "io.h"
+#include "riscv.h"
+#include "i2c.h"
+
+#define I2C_SLAVE_MAX_FILTERS           4
+
+#define I2C_SLAVE_STATE_IDLE            0
+#define I2C_SLAVE_STATE_WRITE_POINTER   1
+#define I2C_SLAVE_STATE_WRITE_DATA      2
+#define I2C_SLAVE_STATE_READ            3
+
+#define I2C_SLAVE_INTERRUPTS            (I2C_INTERRUPT_FILTER | I2C_INTERRUPT_RX_DATA | I2C_INTERRUPT_RX_ACK | \
+                                         I2C_INTERRUPT_END | I2C_INTERRUPT_DROP)
+
+/******************************************************************************
+*
+* This structure describes a register map served on one slave address.
+*
+******************************************************************************/
+    typedef struct {
+        //RAM holding the register values, accessed by both the ISR and the application
+        volatile u8 *regs;
+        //Number of registers, the pointer wraps around at this value
+        u32 size;
+        //7-bit slave address matched by the filter
+        u32 address;
+        //Incremented each time the master writes a register of this map
+        volatile u32 writeCount;
+    } I2cSlave_Map;
+
+/******************************************************************************
+*
+* This structure holds the statistics collected by the slave ISR.
+*
+******************************************************************************/
+    typedef struct {
+        //Number of ISR invocations
+        u32 events;
+        //Number of register bytes written by the master
+        u32 bytesRx;
+        //Number of register bytes read by the master
+        u32 bytesTx;
+        //Read bytes fed after the master acked the previous one, the controller
+        //holding SCL low until then
+        u32 stretches;
+        //Longest ISR execution time, in mcycle
+        u32 isrMaxCycles;
+        //Accumulated ISR execution time, in mcycle
+        u32 isrTotalCycles;
+    } I2cSlave_Stats;
+
+/******************************************************************************
+*
+* This structure holds the context of the slave engine.
+*
+******************************************************************************/
+    typedef struct {
+        u32 reg;
+        I2cSlave_Map maps[I2C_SLAVE_MAX_FILTERS];
+        I2cSlave_Map *active;
+        u32 state;
+        u32 pointer;
+        //Read bytes fed to the controller and not through their ack slot yet
+        u32 pending;
+        //Set until the ack slot of the read address went by
+        u32 addressAck;
+        I2cSlave_Stats stats;
+    } I2cSlave;
+
+/******************************************************************************
+*
+* This function releases the SDA line by invalidating the TX data and TX ack
+* registers of the controller.
+*
+* @param reg   The base address of the I2C registers.
+*
+* @return      None.
+*
+******************************************************************************/
+    static inline void i2cSlave_release_(u32 reg){
+        write_u32(0, reg + I2C_TX_DATA);
+        write_u32(0, reg + I2C_TX_ACK);
+    }
+
+/******************************************************************************
+*
+* This function initializes the slave engine context. All the address filters
+* of the controller are disabled and the RX data/ack listeners are enabled.
+*
+* @param slave The slave engine context.
+* @param reg   The base address of the I2C registers.
+*
+* @return      None.
+*
+* @note The timing configuration (samplingClockDivider, timeout, tsuDat) has to
+*       be applied with i2c_applyConfig beforehand.
+*
+******************************************************************************/
+    static void i2cSlave_init(I2cSlave *slave, u32 reg){
+        u8 *p = (u8 *)slave;
+        for(u32 i = 0;i < sizeof(I2cSlave);i++) p[i] = 0;
+        slave->reg = reg;
+        slave->state = I2C_SLAVE_STATE_IDLE;
+
+        i2c_disableInterrupt(reg, 0xFFFFFFFF);
+        for(u32 id = 0;id < I2C_SLAVE_MAX_FILTERS;id++){
+            i2c_setFilterConfig(reg, id, 0);
+        }
+        i2cSlave_release_(reg);
+        write_u32(I2C_RX_LISTEN, reg + I2C_RX_DATA);
+        i2c_listenAck(reg);
+    }
+
+/******************************************************************************
+*
+* This function binds a register map to an address filter. Several filters can
+* be used at once to answer on several addresses, each with its own map.
+*
+* @param slave    The slave engine context.
+* @param filterId The address filter to use (0 to I2C_SLAVE_MAX_FILTERS-1).
+* @param address  The 7-bit slave address.
+* @param regs     RAM backing the register map.
+* @param size     Number of registers in the map (1 to 256).
+*
+* @return         0 on success, -1 if the parameters are invalid.
+*
+******************************************************************************/
+    static int i2cSlave_addMap(I2cSlave *slave, u32 filterId, u32 address, volatile u8 *regs, u32 size){
+        if(filterId >= I2C_SLAVE_MAX_FILTERS || size == 0 || size > 256) return -1;
+        I2cSlave_Map *map = &slave->maps[filterId];
+        map->regs = regs;
+        map->size = size;
+        map->address = address & 0x7F;
+        map->writeCount = 0;
+        i2c_filterEnable(slave->reg, filterId, I2C_FILTER_ENABLE | I2C_FILTER_7_BITS | map->address);
+        return 0;
+    }
+
+/******************************************************************************
+*
+* This function disables an address filter and unbinds its register map.
+*
+* @param slave    The slave engine context.
+* @param filterId The address filter to disable.
+*
+* @return         None.
+*
+******************************************************************************/
+    static void i2cSlave_removeMap(I2cSlave *slave, u32 filterId){
+        if(filterId >= I2C_SLAVE_MAX_FILTERS) return;
+        i2c_setFilterConfig(slave->reg, filterId, 0);
+        slave->maps[filterId].regs = 0;
+        slave->maps[filterId].size = 0;
+    }
+
+/******************************************************************************
+*
+* This function clears the pending flags and enables the slave interrupts.
+*
+* @param slave The slave engine context.
+*
+* @return      None.
+*
+* @note The I2C interrupt still has to be enabled in the PLIC by the application.
+*
+******************************************************************************/
+    static void i2cSlave_start(I2cSlave *slave){
+        i2c_clearInterruptFlag(slave->reg, 0xFFFFFFFF);
+        i2c_enableInterrupt(slave->reg, I2C_SLAVE_INTERRUPTS);
+    }
+
+/******************************************************************************
+*
+* This function disables the slave interrupts and releases the bus.
+*
+* @param slave The slave engine context.
+*
+* @return      None.
+*
+******************************************************************************/
+    static void i2cSlave_stop(I2cSlave *slave){
+        i2c_disableInterrupt(slave->reg, I2C_SLAVE_INTERRUPTS | I2C_INTERRUPT_TX_DATA | I2C_INTERRUPT_TX_ACK);
+        i2cSlave_release_(slave->reg);
+        slave->state = I2C_SLAVE_STATE_IDLE;
+        slave->active = 0;
+        slave->pending = 0;
+    }
+
+/******************************************************************************
+*
+* This function feeds the register following the pending ones to the TX data
+* register. The register pointer moves when the byte is acked or nacked.
+*
+* @param slave The slave engine context.
+*
+* @return      None.
+*
+******************************************************************************/
+    static inline void i2cSlave_feed_(I2cSlave *slave){
+        I2cSlave_Map *map = slave->active;
+        i2c_txByte(slave->reg, map->regs[(slave->pointer + slave->pending) % map->size]);
+        slave->pending++;
+    }
+
+/******************************************************************************
+*
+* This function services the I2C controller in slave mode. It has to be called
+* from the PLIC handler when the I2C interrupt is claimed.
+*
+* @param slave The slave engine context.
+*
+* @return      None.
+*
+* @note Every event is handled with a fixed amount of work (no loop depending
+*       on the frame length), the execution time of each call is accumulated
+*       in the statistics.
+*
+******************************************************************************/
+    static void i2cSlave_isr(I2cSlave *slave){
+        u32 start = csr_read(mcycle);
+        u32 reg = slave->reg;
+        u32 flags = i2c_getInterruptFlag(reg) & read_u32(reg + I2C_INTERRUPT_ENABLE);
+
+        //Address matched, the address byte is still in the RX data register
+        if(flags & I2C_INTERRUPT_FILTER){
+            u32 hit = i2c_getFilteringHit(reg);
+            u32 id = 0;
+            while(id < I2C_SLAVE_MAX_FILTERS - 1 && !(hit & (1 << id))) id++;
+            u32 rx = read_u32(reg + I2C_RX_DATA);
+
+            slave->active = &slave->maps[id];
+            if(slave->active->size == 0){
+                //Filter hit without map, nack the address
+                slave->active = 0;
+                slave->state = I2C_SLAVE_STATE_IDLE;
+                i2c_txNack(reg);
+            } else if(rx & I2C_READ){
+                slave->state = I2C_SLAVE_STATE_READ;
+                slave->pending = 0;
+                slave->addressAck = 1;
+                i2cSlave_feed_(slave);
+                i2c_txAck(reg);
+                i2c_enableInterrupt(reg, I2C_INTERRUPT_TX_DATA | I2C_INTERRUPT_TX_ACK);
+            } else {
+                slave->state = I2C_SLAVE_STATE_WRITE_POINTER;
+                write_u32(I2C_TX_VALUE | I2C_TX_VALID | I2C_TX_REPEAT, reg + I2C_TX_DATA);
+                i2c_txAck(reg);
+                i2c_enableInterrupt(reg, I2C_INTERRUPT_TX_ACK);
+            }
+            i2c_clearInterruptFlag(reg, I2C_INTERRUPT_FILTER);
+        }
+
+        //The address ack went out, switch the ack slot to the per byte mode of the frame
+        if(flags & I2C_INTERRUPT_TX_ACK){
+            if(slave->state == I2C_SLAVE_STATE_READ){
+                write_u32(I2C_TX_VALID | I2C_TX_REPEAT, reg + I2C_TX_ACK);
+            } else if(slave->state != I2C_SLAVE_STATE_IDLE){
+                write_u32(I2C_TX_VALID | I2C_TX_ENABLE | I2C_TX_REPEAT, reg + I2C_TX_ACK);
+            }
+            i2c_disableInterrupt(reg, I2C_INTERRUPT_TX_ACK);
+        }
+
+        //Master write, first byte is the register pointer, then register data
+        if(flags & I2C_INTERRUPT_RX_DATA){
+            u32 rx = read_u32(reg + I2C_RX_DATA);
+            if(rx & I2C_RX_VALID){
+                I2cSlave_Map *map = slave->active;
+                if(slave->state == I2C_SLAVE_STATE_WRITE_POINTER){
+                    slave->pointer = (rx & I2C_RX_VALUE) % map->size;
+                    slave->state = I2C_SLAVE_STATE_WRITE_DATA;
+                } else if(slave->state == I2C_SLAVE_STATE_WRITE_DATA){
+                    map->regs[slave->pointer] = rx & I2C_RX_VALUE;
+                    if(++slave->pointer >= map->size) slave->pointer = 0;
+                    map->writeCount++;
+                    slave->stats.bytesRx++;
+                }
+            }
+            i2c_clearInterruptFlag(reg, I2C_INTERRUPT_RX_DATA);
+        }
+
+        //Master ack slot of a read, the oldest pending byte went out. A nack ends
+        //the read, the byte prefetched after it is dropped.
+        if(flags & I2C_INTERRUPT_RX_ACK){
+            if(slave->state == I2C_SLAVE_STATE_READ){
+                if(slave->addressAck){
+                    slave->addressAck = 0;
+                } else if(slave->pending){
+                    if(++slave->pointer >= slave->active->size) slave->pointer = 0;
+                    slave->pending--;
+                    slave->stats.bytesTx++;
+                }
+                if(i2c_rxNack(reg)){
+                    i2c_disableInterrupt(reg, I2C_INTERRUPT_TX_DATA);
+                    write_u32(0, reg + I2C_TX_DATA);
+                    slave->pending = 0;
+                    flags &= ~I2C_INTERRUPT_TX_DATA;
+                }
+            }
+            i2c_clearInterruptFlag(reg, I2C_INTERRUPT_RX_ACK);
+        }
+
+        //Master read, the TX data register is empty. Handled after the ack slot
+        //so that a byte fed once the previous one was acked counts as a stretch.
+        if(flags & I2C_INTERRUPT_TX_DATA){
+            if(slave->state == I2C_SLAVE_STATE_READ){
+                if(slave->pending == 0) slave->stats.stretches++;
+                i2cSlave_feed_(slave);
+            } else {
+                i2c_disableInterrupt(reg, I2C_INTERRUPT_TX_DATA);
+            }
+        }
+
+        //Stop or dropped frame
+        if(flags & (I2C_INTERRUPT_END | I2C_INTERRUPT_DROP)){
+            i2c_disableInterrupt(reg, I2C_INTERRUPT_TX_DATA | I2C_INTERRUPT_TX_ACK);
+            i2cSlave_release_(reg);
+            slave->state = I2C_SLAVE_STATE_IDLE;
+            slave->active = 0;
+            slave->pending = 0;
+            i2c_clearInterruptFlag(reg, I2C_INTERRUPT_END | I2C_INTERRUPT_DROP);
+        }
+
+        u32 cycles = csr_read(mcycle) - start;
+        slave->stats.events++;
+        slave->stats.isrTotalCycles += cycles;
+        if(cycles > slave->stats.isrMaxCycles) slave->stats.isrMaxCycles = cycles;
+    }
+
+/******************************************************************************
+*
+* This function copies the statistics collected by the slave ISR.
+*
+* @param slave The slave engine context.
+* @param stats Destination of the statistics.
+*
+* @return      None.
+*
+******************************************************************************/
+    static void i2cSlave_getStats(I2cSlave *slave, I2cSlave_Stats *stats){
+        *stats = slave->stats;
+    }
+
+/******************************************************************************
+*
+* This function clears the statistics collected by the slave ISR.
+*
+* @param slave The slave engine context.
+*
+* @return      None.
+*
+******************************************************************************/
+    static void i2cSlave_resetStats(I2cSlave *slave){
+        I2cSlave_Stats zero = {0};
+        slave->stats = zero;
+    }
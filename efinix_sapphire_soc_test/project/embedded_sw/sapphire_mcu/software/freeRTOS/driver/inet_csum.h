@@ -0,0 +1,264 @@
+/*******************************************************************************
+*
+* @file inet_csum.h
+*
+* @brief Header file for the Internet checksum (RFC 1071) on RV32IM. The sums
+*        handled here are the ones-complement sums of the big endian 16 bits
+*        words, folded to 16 bits; the checksum field is the complement of the
+*        final sum (inet_csum_finish).
+*
+*        inet_csum_add is the kernel to use: it aligns itself on the buffer, then
+*        adds 32 bits words in a 32 bits accumulator with an end-around carry,
+*        8 words per iteration. Words are added in the native (little endian)
+*        order and the result is byte swapped once at the end, which RFC 1071
+*        allows. The CPU traps on misaligned loads, hence the alignment steps.
+*        inet_csum_add32 is the same kernel without unrolling nor alignment, and
+*        inet_csum_ref the plain 16 bits loop, both kept as references for
+*        inet_csum_bench. test/inet_csum_test.c checks the kernels on the host
+*        against a byte-wise reference.
+*
+* Functions:
+* - inet_csum_fold: Folds a sum to 16 bits.
+* - inet_csum_finish: Returns the checksum field of a sum.
+* - inet_csum_ref: Adds a buffer, 16 bits per step.
+* - inet_csum_add32: Adds a 4 bytes aligned buffer, 32 bits per step.
+* - inet_csum_add: Adds any buffer, unrolled and alignment aware.
+* - inet_csum_combine: Combines the sums of two consecutive buffers.
+* - inet_csum_update16: Updates a checksum field for a 16 bits word change.
+* - inet_csum_update32: Updates a checksum field for a 32 bits word change.
+* - inet_csum_bench: Measures the cycles per byte of the three kernels.
+*
+******************************************************************************/
+#pragma once
+
+#include "type.h"
+#include "riscv.h"
+#include "bsp.h"
+
+/*******************************************************************************
+*
+* @brief This function folds a sum to 16 bits.
+*
+******************************************************************************/
+static u32 inet_csum_fold(u32 sum)
+{
+	sum = (sum & 0xFFFF) + (sum >> 16);
+	sum = (sum & 0xFFFF) + (sum >> 16);
+	return sum;
+}
+
+/*******************************************************************************
+*
+* @brief This function returns the checksum field of a sum: its complement.
+*
+******************************************************************************/
+static u32 inet_csum_finish(u32 sum)
+{
+	return ~inet_csum_fold(sum) & 0xFFFF;
+}
+
+/*******************************************************************************
+*
+* @brief Internal helpers: addition with end-around carry, byte swap of a folded
+*        sum, and the last 0 to 3 bytes of a buffer.
+*
+******************************************************************************/
+static inline u32 inet_csum_adc_(u32 acc, u32 w)
+{
+	acc += w;
+	return acc + (acc < w);
+}
+
+static u32 inet_csum_swap_(u32 sum)
+{
+	sum = inet_csum_fold(sum);
+	return ((sum & 0xFF) << 8) | (sum >> 8);
+}
+
+static u32 inet_csum_tail_(const u8 *p, u32 len, u32 acc)
+{
+	if(len & 2) {
+		acc = inet_csum_adc_(acc, *(const u16 *)p);
+		p += 2;
+	}
+	if(len & 1)
+		acc = inet_csum_adc_(acc, p[0]);
+	return acc;
+}
+
+/*******************************************************************************
+*
+* @brief This function adds a buffer to a sum, one 16 bits word per step.
+*
+* @param buf  Buffer, any alignment.
+* @param len  Length in bytes, an odd last byte is padded with 0.
+* @param sum  Sum to add to, 0 to start.
+* @return     The folded sum.
+*
+******************************************************************************/
+static u32 inet_csum_ref(const void *buf, u32 len, u32 sum)
+{
+	const u8 *p = (const u8 *)buf;
+	u64 acc = sum;
+
+	for(; len>1; len-=2, p+=2)
+		acc += (p[0]<<8) | p[1];
+	if(len)
+		acc += p[0]<<8;
+	while(acc >> 16)
+		acc = (acc & 0xFFFF) + (acc >> 16);
+	return (u32)acc;
+}
+
+/*******************************************************************************
+*
+* @brief This function adds a buffer to a sum, one 32 bits word per step.
+*
+* @param buf  Buffer, 4 bytes aligned.
+* @param len  Length in bytes, an odd last byte is padded with 0.
+* @param sum  Sum to add to, 0 to start.
+* @return     The folded sum.
+*
+******************************************************************************/
+static u32 inet_csum_add32(const void *buf, u32 len, u32 sum)
+{
+	const u8 *p = (const u8 *)buf;
+	u32 acc = 0;
+
+	for(; len>=4; len-=4, p+=4)
+		acc = inet_csum_adc_(acc, *(const u32 *)p);
+	acc = inet_csum_tail_(p, len, acc);
+	return inet_csum_fold(inet_csum_fold(sum) + inet_csum_swap_(acc));
+}
+
+/*******************************************************************************
+*
+* @brief This function combines the sums of two consecutive parts of a packet,
+*        for scattered buffers. When the second part starts at an odd offset,
+*        its bytes were paired the other way and its sum is byte swapped.
+*
+* @param sum     Sum of the first part.
+* @param sum2    Sum of the second part, computed from 0.
+* @param offset  Offset of the second part in the packet (length of the first).
+* @return        The folded sum of both parts.
+*
+******************************************************************************/
+static u32 inet_csum_combine(u32 sum, u32 sum2, u32 offset)
+{
+	sum2 = (offset & 1) ? inet_csum_swap_(sum2) : inet_csum_fold(sum2);
+	return inet_csum_fold(inet_csum_fold(sum) + sum2);
+}
+
+/*******************************************************************************
+*
+* @brief This function adds a buffer to a sum, 8 words per iteration. A leading
+*        odd byte and half word are added first to align the word loads.
+*
+* @param buf  Buffer, any alignment.
+* @param len  Length in bytes, an odd last byte is padded with 0.
+* @param sum  Sum to add to, 0 to start.
+* @return     The folded sum.
+*
+******************************************************************************/
+static u32 inet_csum_add(const void *buf, u32 len, u32 sum)
+{
+	const u8 *p = (const u8 *)buf;
+	u32 acc = 0;
+
+	if(!len)
+		return inet_csum_fold(sum);
+	if((u32)p & 1)		//The rest of the buffer is at an odd offset from its start
+		return inet_csum_combine(inet_csum_fold(sum) + (p[0]<<8), inet_csum_add(p+1, len-1, 0), 1);
+
+	if(((u32)p & 2) && len >= 2) {
+		acc = *(const u16 *)p;
+		p += 2;
+		len -= 2;
+	}
+	for(; len>=32; len-=32, p+=32) {
+		const u32 *w = (const u32 *)p;
+		acc = inet_csum_adc_(acc, w[0]);
+		acc = inet_csum_adc_(acc, w[1]);
+		acc = inet_csum_adc_(acc, w[2]);
+		acc = inet_csum_adc_(acc, w[3]);
+		acc = inet_csum_adc_(acc, w[4]);
+		acc = inet_csum_adc_(acc, w[5]);
+		acc = inet_csum_adc_(acc, w[6]);
+		acc = inet_csum_adc_(acc, w[7]);
+	}
+	for(; len>=4; len-=4, p+=4)
+		acc = inet_csum_adc_(acc, *(const u32 *)p);
+	acc = inet_csum_tail_(p, len, acc);
+	return inet_csum_fold(inet_csum_fold(sum) + inet_csum_swap_(acc));
+}
+
+/*******************************************************************************
+*
+* @brief This function updates a checksum field after a 16 bits word of the
+*        covered data changed, without summing the data again (RFC 1624, eq. 3:
+*        HC' = ~(~HC + ~m + m')).
+*
+* @param csum  Current checksum field.
+* @param old   Previous value of the word.
+* @param new   New value of the word.
+* @return      The new checksum field.
+*
+******************************************************************************/
+static u32 inet_csum_update16(u32 csum, u32 old, u32 new)
+{
+	return inet_csum_finish((~csum & 0xFFFF) + (~old & 0xFFFF) + (new & 0xFFFF));
+}
+
+/*******************************************************************************
+*
+* @brief This function updates a checksum field after a 32 bits word of the
+*        covered data changed, such as an IPv4 address.
+*
+* @param csum  Current checksum field.
+* @param old   Previous value of the word.
+* @param new   New value of the word.
+* @return      The new checksum field.
+*
+******************************************************************************/
+static u32 inet_csum_update32(u32 csum, u32 old, u32 new)
+{
+	return inet_csum_finish((~csum & 0xFFFF) + (~old >> 16) + (~old & 0xFFFF) + (new >> 16) + (new & 0xFFFF));
+}
+
+/*******************************************************************************
+*
+* @brief This function measures the three kernels on a buffer with mcycle, from
+*        a warm cache, and prints their cycles per byte.
+*
+* @param buf    Buffer, 4 bytes aligned.
+* @param len    Length in bytes.
+* @param loops  Number of runs averaged.
+* @return       0 if the three sums agree, -1 otherwise.
+*
+******************************************************************************/
+static int inet_csum_bench(const void *buf, u32 len, u32 loops)
+{
+	u32 sum[3], cycles[3], t;
+
+	sum[0] = inet_csum_ref(buf, len, 0);
+	t = csr_read(mcycle);
+	for(u32 i=0; i<loops; i++) sum[0] = inet_csum_ref(buf, len, 0);
+	cycles[0] = csr_read(mcycle) - t;
+
+	sum[1] = inet_csum_add32(buf, len, 0);
+	t = csr_read(mcycle);
+	for(u32 i=0; i<loops; i++) sum[1] = inet_csum_add32(buf, len, 0);
+	cycles[1] = csr_read(mcycle) - t;
+
+	sum[2] = inet_csum_add(buf, len, 0);
+	t = csr_read(mcycle);
+	for(u32 i=0; i<loops; i++) sum[2] = inet_csum_add(buf, len, 0);
+	cycles[2] = csr_read(mcycle) - t;
+
+	for(u32 i=0; i<3; i++) {
+		u32 cpb = (u32)((u64)cycles[i] * 100 / ((u64)loops * (len ? len : 1)));
+		bsp_printf("csum %s %d bytes: 0x%x, %d.%d%d cycles/byte\r\n", i == 0 ? "ref  " : i == 1 ? "add32" : "add  ",
+				   len, sum[i], cpb/100, (cpb/10)%10, cpb%10);
+	}
+	return (sum[0] == sum[1] && sum[0] == sum[2]) ? 0 : -1;
+}
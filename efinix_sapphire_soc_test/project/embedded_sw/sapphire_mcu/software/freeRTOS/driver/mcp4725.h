@@ -0,0 +1,392 @@
+/*******************************************************************************
+*
+* @file mcp4725.h
+*
+* @brief Header file for streaming samples to a MCP4725 12-bit DAC. The DAC is
+*        updated with its fast-write command, which carries a sample in two
+*        bytes, and the bus is kept open across samples:
+*
+*        [start] [addr+W] [PD|D11..D8] [D7..D0] [PD|D11..D8] [D7..D0] ... [stop]
+*
+*        so a sample costs 18 SCL periods instead of the 36 of a register write
+*        followed by a stop and a new start. Between two samples the master
+*        holds SCL low, which the DAC accepts as a regular clock stretch.
+*
+*        Samples are paced by a user timer running at twice the sample rate.
+*        The timer ISR never waits on the bus: each tick queues one byte of the
+*        current frame, after checking that the previous one went out. A tick
+*        finding the bus still busy is counted late and does nothing, the byte
+*        is queued by the next one. The application fills the two halves of a
+*        double buffer while the ISR consumes the other half. When the ISR runs
+*        out of committed samples the last value is held on the output and an
+*        underrun is counted.
+*
+* Functions:
+* - mcp4725_writeFast: Updates the DAC output with a single fast-write frame.
+* - mcp4725_streamInit: Initializes a stream context.
+* - mcp4725_streamBuffer: Returns the buffer half to be filled next.
+* - mcp4725_streamCommit: Hands a filled buffer half over to the ISR.
+* - mcp4725_streamStart: Opens the bus and starts the pacing timer.
+* - mcp4725_streamStop: Stops the pacing timer and closes the bus.
+* - mcp4725_streamTick: Queues the next byte, to be called from the timer ISR.
+* - mcp4725_measureMaxRate: Measures the maximum sustained sample rate.
+*
+******************************************************************************/
+
+#pragma once
+
+#include "type.h"
+#include "io.h"
+#include "riscv.h"
+#include "i2c.h"
+#include "timer.h"
+
+#define MCP4725_ADDRESS_DEFAULT         0x60
+#define MCP4725_FAST_PD_NORMAL          (0 << 4)
+#define MCP4725_FAST_PD_1K              (1 << 4)
+#define MCP4725_FAST_PD_100K            (2 << 4)
+#define MCP4725_FAST_PD_500K            (3 << 4)
+#define MCP4725_VALUE_MASK              0x0FFF
+
+/******************************************************************************
+*
+* This structure holds the context of a timer paced DAC stream.
+*
+******************************************************************************/
+    typedef struct {
+        //I2C controller and user timer base addresses
+        u32 i2c;
+        u32 timer;
+        //7-bit DAC address
+        u8 address;
+        //Double buffer, each half holds length 12-bit samples
+        u16 *buffer[2];
+        u32 length;
+        //Set by mcp4725_streamCommit, cleared by the ISR once the half is consumed
+        volatile u32 ready[2];
+        //Half being consumed by the ISR and read position inside it
+        volatile u32 active;
+        volatile u32 index;
+        //Half to be filled next by the application
+        u32 fill;
+        //Last sample sent, held on the output during an underrun
+        u16 last;
+        //Byte of the frame queued next (0: high, 1: low), a byte is on the bus
+        volatile u32 phase;
+        volatile u32 pending;
+        //Statistics
+        volatile u32 samples;
+        volatile u32 underruns;
+        volatile u32 nacks;
+        volatile u32 late;
+        volatile u32 tickMaxCycles;
+    } Mcp4725_Stream;
+
+/******************************************************************************
+*
+* This structure holds the result of mcp4725_measureMaxRate.
+*
+******************************************************************************/
+    typedef struct {
+        //Samples per second when the samples are sent back to back on the bus
+        u32 busRate;
+        //Samples per second reachable through mcp4725_streamTick, including its overhead
+        u32 tickRate;
+    } Mcp4725_Rate;
+
+/*******************************************************************************
+*
+* @brief This function sends the two bytes of a fast-write frame on an already
+*        opened bus.
+*
+* @param reg: I2C peripheral register base address.
+* @param value: 12-bit DAC value.
+*
+* @return 0 on success, -1 if the DAC did not acknowledge.
+*
+******************************************************************************/
+    static int mcp4725_sendSample_(u32 reg, u16 value){
+        int nack = 0;
+        i2c_txByte(reg, MCP4725_FAST_PD_NORMAL | ((value >> 8) & 0x0F));
+        i2c_txNackBlocking(reg);
+        nack |= i2c_rxNack(reg);
+        i2c_txByte(reg, value & 0xFF);
+        i2c_txNackBlocking(reg);
+        nack |= i2c_rxNack(reg);
+        return nack ? -1 : 0;
+    }
+
+/*******************************************************************************
+*
+* @brief This function opens the bus with a start and the DAC write address.
+*
+* @param reg: I2C peripheral register base address.
+* @param address: 7-bit DAC address.
+*
+* @return 0 on success, -1 if the DAC did not acknowledge.
+*
+******************************************************************************/
+    static int mcp4725_open_(u32 reg, u8 address){
+        i2c_masterStartBlocking(reg);
+        i2c_txByte(reg, (address << 1) | I2C_WRITE);
+        i2c_txNackBlocking(reg);
+        if(i2c_rxNack(reg)){
+            i2c_masterStopBlocking(reg);
+            return -1;
+        }
+        return 0;
+    }
+
+/*******************************************************************************
+*
+* @brief This function updates the DAC output with a single fast-write frame.
+*
+* @param reg: I2C peripheral register base address.
+* @param address: 7-bit DAC address.
+* @param value: 12-bit DAC value.
+*
+* @return 0 on success, -1 if the DAC did not acknowledge.
+*
+******************************************************************************/
+    static int mcp4725_writeFast(u32 reg, u8 address, u16 value){
+        if(mcp4725_open_(reg, address)) return -1;
+        int ret = mcp4725_sendSample_(reg, value & MCP4725_VALUE_MASK);
+        i2c_masterStopBlocking(reg);
+        return ret;
+    }
+
+/*******************************************************************************
+*
+* @brief This function initializes a stream context.
+*
+* @param stream: Stream context.
+* @param i2c: I2C peripheral register base address.
+* @param timer: User timer register base address.
+* @param address: 7-bit DAC address.
+* @param buffer0: First half of the sample double buffer.
+* @param buffer1: Second half of the sample double buffer.
+* @param length: Number of samples in each half.
+*
+******************************************************************************/
+    static void mcp4725_streamInit(Mcp4725_Stream *stream, u32 i2c, u32 timer, u8 address,
+                                   u16 *buffer0, u16 *buffer1, u32 length){
+        stream->i2c = i2c;
+        stream->timer = timer;
+        stream->address = address;
+        stream->buffer[0] = buffer0;
+        stream->buffer[1] = buffer1;
+        stream->length = length;
+        stream->ready[0] = 0;
+        stream->ready[1] = 0;
+        stream->active = 0;
+        stream->index = 0;
+        stream->fill = 0;
+        stream->last = 0;
+        stream->phase = 0;
+        stream->pending = 0;
+        stream->samples = 0;
+        stream->underruns = 0;
+        stream->nacks = 0;
+        stream->late = 0;
+        stream->tickMaxCycles = 0;
+    }
+
+/*******************************************************************************
+*
+* @brief This function returns the buffer half to be filled next.
+*
+* @param stream: Stream context.
+*
+* @return Pointer to length samples, or 0 if both halves are still pending in
+*         the ISR.
+*
+******************************************************************************/
+    static u16 *mcp4725_streamBuffer(Mcp4725_Stream *stream){
+        if(stream->ready[stream->fill]) return 0;
+        return stream->buffer[stream->fill];
+    }
+
+/*******************************************************************************
+*
+* @brief This function hands the buffer half returned by mcp4725_streamBuffer
+*        over to the ISR.
+*
+* @param stream: Stream context.
+*
+******************************************************************************/
+    static void mcp4725_streamCommit(Mcp4725_Stream *stream){
+        stream->ready[stream->fill] = 1;
+        stream->fill ^= 1;
+    }
+
+/*******************************************************************************
+*
+* @brief This function opens the bus and starts the pacing timer, at twice the
+*        sample rate as a frame takes two ticks. The timer interrupt has to be
+*        routed to a handler calling mcp4725_streamTick. Commit at least one
+*        buffer half before calling it to avoid an initial underrun.
+*
+* @param stream: Stream context.
+* @param clockHz: Frequency of the user timer clock.
+* @param sampleHz: Output sample rate.
+*
+* @return 0 on success, -1 if the DAC did not acknowledge.
+*
+******************************************************************************/
+    static int mcp4725_streamStart(Mcp4725_Stream *stream, u32 clockHz, u32 sampleHz){
+        if(mcp4725_open_(stream->i2c, stream->address)) return -1;
+        timer_setConfig(stream->timer, 0);
+        timer_setLimit(stream->timer, clockHz / (2 * sampleHz) - 1);
+        timer_clearValue(stream->timer);
+        timer_setConfig(stream->timer, TIMER_CONFIG_WITHOUT_PRESCALER | TIMER_CONFIG_SELF_RESTART);
+        return 0;
+    }
+
+/*******************************************************************************
+*
+* @brief This function accounts the byte which just went out on the bus.
+*
+* @param stream: Stream context.
+*
+******************************************************************************/
+    static void mcp4725_streamAck_(Mcp4725_Stream *stream){
+        stream->pending = 0;
+        if(i2c_rxNack(stream->i2c)) stream->nacks++;
+        if(stream->phase == 0) stream->samples++;
+    }
+
+/*******************************************************************************
+*
+* @brief This function queues the next byte of the stream on the bus, without
+*        waiting for it. It is meant to be called from the user timer interrupt
+*        handler, once per timer period, so two calls output a sample. If the
+*        previous byte is still on the bus the call is counted late and the
+*        byte is left to the next call.
+*
+* @param stream: Stream context.
+*
+******************************************************************************/
+    static void mcp4725_streamTick(Mcp4725_Stream *stream){
+        u32 startCycle = csr_read(mcycle);
+
+        if(stream->pending){
+            if(read_u32(stream->i2c + I2C_TX_ACK) & I2C_TX_VALID){
+                stream->late++;
+                return;
+            }
+            mcp4725_streamAck_(stream);
+        }
+
+        if(stream->phase == 0){
+            u32 active = stream->active;
+            if(stream->ready[active]){
+                stream->last = stream->buffer[active][stream->index] & MCP4725_VALUE_MASK;
+                if(++stream->index == stream->length){
+                    stream->index = 0;
+                    stream->ready[active] = 0;
+                    stream->active = active ^ 1;
+                }
+            } else {
+                stream->underruns++;
+            }
+            i2c_txByte(stream->i2c, MCP4725_FAST_PD_NORMAL | ((stream->last >> 8) & 0x0F));
+        } else {
+            i2c_txByte(stream->i2c, stream->last & 0xFF);
+        }
+        i2c_txNack(stream->i2c);
+        stream->pending = 1;
+        stream->phase ^= 1;
+
+        u32 cycles = csr_read(mcycle) - startCycle;
+        if(cycles > stream->tickMaxCycles) stream->tickMaxCycles = cycles;
+    }
+
+/*******************************************************************************
+*
+* @brief This function waits for the byte on the bus and sends the rest of the
+*        frame in flight, so that the bus is left between two frames.
+*
+* @param stream: Stream context.
+*
+******************************************************************************/
+    static void mcp4725_streamFlush_(Mcp4725_Stream *stream){
+        while(stream->pending || stream->phase){
+            if(stream->pending){
+                i2c_txAckWait(stream->i2c);
+                mcp4725_streamAck_(stream);
+            } else {
+                mcp4725_streamTick(stream);
+            }
+        }
+    }
+
+/*******************************************************************************
+*
+* @brief This function stops the pacing timer, completes the frame in flight
+*        and closes the bus.
+*
+* @param stream: Stream context.
+*
+******************************************************************************/
+    static void mcp4725_streamStop(Mcp4725_Stream *stream){
+        timer_setConfig(stream->timer, 0);
+        //A tick latched before the timer stopped must not interleave with the flush
+        u32 mie = csr_read_clear(mstatus, MSTATUS_MIE) & MSTATUS_MIE;
+        mcp4725_streamFlush_(stream);
+        if(mie) csr_set(mstatus, MSTATUS_MIE);
+        i2c_masterStopBlocking(stream->i2c);
+    }
+
+/*******************************************************************************
+*
+* @brief This function measures the maximum sustained sample rate. A ramp is
+*        sent back to back on the opened bus to get the bus limited rate, and
+*        the same ramp is pushed through mcp4725_streamTick, called back to back
+*        with the late calls retried, to get the rate reachable through the
+*        tick path. The DAC output is left at zero.
+*
+* @param reg: I2C peripheral register base address.
+* @param address: 7-bit DAC address.
+* @param clockHz: Frequency of mcycle (ex: SYSTEM_CLINT_HZ).
+* @param count: Number of samples sent for each measurement.
+* @param rate: Filled with the measured rates.
+*
+* @return 0 on success, -1 if the DAC did not acknowledge.
+*
+******************************************************************************/
+    static int mcp4725_measureMaxRate(u32 reg, u8 address, u32 clockHz, u32 count, Mcp4725_Rate *rate){
+        u16 ramp[2][16];
+        Mcp4725_Stream stream;
+
+        if(count == 0) return -1;
+        for(u32 i = 0; i < 16; i++){
+            ramp[0][i] = i << 8;
+            ramp[1][i] = (15 - i) << 8;
+        }
+
+        if(mcp4725_open_(reg, address)) return -1;
+        u32 startCycle = csr_read(mcycle);
+        for(u32 i = 0; i < count; i++){
+            if(mcp4725_sendSample_(reg, (i << 8) & MCP4725_VALUE_MASK)){
+                i2c_masterStopBlocking(reg);
+                return -1;
+            }
+        }
+        u32 cycles = csr_read(mcycle) - startCycle;
+        rate->busRate = (u32)((u64)clockHz * count / (cycles ? cycles : 1));
+
+        //Timer is not started, the ticks are issued back to back
+        mcp4725_streamInit(&stream, reg, 0, address, ramp[0], ramp[1], 16);
+        startCycle = csr_read(mcycle);
+        while(stream.samples < count){
+            if(mcp4725_streamBuffer(&stream)) mcp4725_streamCommit(&stream);
+            mcp4725_streamTick(&stream);
+        }
+        mcp4725_streamFlush_(&stream);
+        cycles = csr_read(mcycle) - startCycle;
+        rate->tickRate = (u32)((u64)clockHz * count / (cycles ? cycles : 1));
+
+        mcp4725_sendSample_(reg, 0);
+        i2c_masterStopBlocking(reg);
+        return stream.nacks ? -1 : 0;
+    }
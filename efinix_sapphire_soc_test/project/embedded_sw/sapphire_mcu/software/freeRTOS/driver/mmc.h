@@ -103,6 +103,7 @@
 										  //operate in supplied voltage range. Reserved bits shall be set to '0'.
 
 #define SD_CMD_APP_SET_BUS_WIDTH	    6
+#define SD_CMD_APP_SET_WR_BLK_ERASE_COUNT 23 //Sets the number of write blocks to be pre-erased before writing.
 #define SD_CMD_ERASE_WR_BLK_START	    32 //Sets the address of the first write block to be erased.
 #define SD_CMD_ERASE_WR_BLK_END		    33 //Sets the address of the last write block of the continuous range to be erased.
 #define SD_CMD_APP_SEND_OP_COND		    41 //Sends host capcity support infocmation and activate card's intialization process.
@@ -112,6 +113,7 @@
 #define MMC_MODE_4BIT		            BIT(29)
 #define MMC_MODE_1BIT		            BIT(28)
 #define MMC_MODE_SPI		            BIT(27)
+#define MMC_MODE_HS		                (1u<<0) //High-Speed (SDR25) selected with CMD6
 
 //Response Format
 #define MMC_RSP_PRESENT                 (1 << 0)
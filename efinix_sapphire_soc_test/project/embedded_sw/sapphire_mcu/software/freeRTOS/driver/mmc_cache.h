@@ -0,0 +1,445 @@
+/*******************************************************************************
+*
+* @file mmc_cache.h
+*
+* @brief Header file for a write-back block cache between the MMC operations
+*        (mmc->cfg->ops->send_cmd) and their users. Cached blocks are found
+*        through a hash table and evicted in LRU order. Written blocks are kept
+*        dirty and written back in batches sorted by block number, adjacent
+*        blocks being coalesced into CMD25 multi-block writes. A miss following
+*        a sequential read fetches MMC_CACHE_READ_AHEAD blocks at once.
+*
+*        Requests of half the cache size or more bypass it, so that large
+*        streaming transfers do not wipe the cached metadata out.
+*
+* Functions:
+* - mmc_cache_init: Initializes an empty cache over an MMC/SD card.
+* - mmc_cache_read: Reads blocks through the cache.
+* - mmc_cache_write: Writes blocks through the cache.
+* - mmc_cache_flush: Writes every dirty block back to the card.
+* - mmc_cache_invalidate: Flushes and drops every cached block.
+* - mmc_cache_get_stats: Returns the cache statistics.
+*
+******************************************************************************/
+
+#pragma once
+
+#include <string.h>
+#include "type.h"
+#include "mmc.h"
+
+#ifndef MMC_CACHE_BLOCKS
+#define MMC_CACHE_BLOCKS			32		// cached blocks
+#endif
+#ifndef MMC_CACHE_READ_AHEAD
+#define MMC_CACHE_READ_AHEAD		8		// blocks fetched on a sequential miss
+#endif
+#define MMC_CACHE_HASH				64		// hash buckets, power of two
+#define MMC_CACHE_BATCH				8		// maximum blocks per command issued by the cache
+#define MMC_CACHE_NONE				0xFFFF
+
+/*******************************************************************************
+*
+* @brief Structure holding the state of a cached block.
+*
+******************************************************************************/
+struct mmc_cache_entry {
+	u32 lba;					/* Block number */
+	u16 hash_next;				/* Next entry of the same hash bucket */
+	u16 prev;					/* Previous entry in LRU order (more recently used) */
+	u16 next;					/* Next entry in LRU order (less recently used) */
+	u8 valid;					/* Entry holds a block */
+	u8 dirty;					/* Block modified and not written back yet */
+};
+
+/*******************************************************************************
+*
+* @brief Structure holding the cache statistics.
+*
+******************************************************************************/
+struct mmc_cache_stats {
+	u32 hits;					/* Blocks served from the cache */
+	u32 misses;					/* Blocks read from the card */
+	u32 read_ahead;				/* Blocks fetched ahead of the requests */
+	u32 bypass;					/* Requests too large for the cache */
+	u32 evictions;				/* Valid blocks dropped to make room */
+	u32 writeback_blocks;		/* Dirty blocks written back */
+	u32 writeback_cmds;			/* Write commands issued for them */
+};
+
+/*******************************************************************************
+*
+* @brief Structure holding a block cache.
+*
+******************************************************************************/
+struct mmc_cache {
+	struct mmc *mmc;
+	struct mmc_cache_entry entry[MMC_CACHE_BLOCKS];
+	u16 hash[MMC_CACHE_HASH];	/* First entry of each bucket */
+	u16 mru;					/* Most recently used entry */
+	u16 lru;					/* Least recently used entry, next victim */
+	u32 next_lba;				/* Block following the last read, for sequential detection */
+	struct mmc_cache_stats stats;
+	u32 data[MMC_CACHE_BLOCKS][BLOCK_SIZE/4];	/* Block contents */
+	u32 stage[MMC_CACHE_BATCH][BLOCK_SIZE/4];	/* Contiguous buffer of multi-block commands */
+};
+
+/*******************************************************************************
+*
+* @brief This function initializes an empty cache over an MMC/SD card.
+*
+* @param c    Pointer to the cache structure.
+* @param mmc  Pointer to the MMC structure, initialized by its probe function.
+*
+******************************************************************************/
+static void mmc_cache_init(struct mmc_cache *c, struct mmc *mmc)
+{
+	c->mmc = mmc;
+	for(u32 i=0; i<MMC_CACHE_HASH; i++)
+		c->hash[i] = MMC_CACHE_NONE;
+	for(u32 i=0; i<MMC_CACHE_BLOCKS; i++) {
+		c->entry[i].valid = 0;
+		c->entry[i].dirty = 0;
+		c->entry[i].hash_next = MMC_CACHE_NONE;
+		c->entry[i].prev = i == 0 ? MMC_CACHE_NONE : i-1;
+		c->entry[i].next = i == MMC_CACHE_BLOCKS-1 ? MMC_CACHE_NONE : i+1;
+	}
+	c->mru = 0;
+	c->lru = MMC_CACHE_BLOCKS-1;
+	c->next_lba = 0xFFFFFFFF;
+	memset(&c->stats, 0, sizeof(c->stats));
+}
+
+/*******************************************************************************
+*
+* @brief This function reads or writes contiguous blocks through the MMC operations.
+*
+******************************************************************************/
+static int mmc_cache_io_(struct mmc_cache *c, u32 lba, u32 count, void *buf, u32 flags)
+{
+	struct mmc *mmc = c->mmc;
+	struct mmc_cmd cmd;
+	struct mmc_data data;
+
+	if(flags == MMC_DATA_WRITE)
+		cmd.cmdidx = count > 1 ? MMC_CMD_WRITE_MULTIPLE_BLOCK : MMC_CMD_WRITE_SINGLE_BLOCK;
+	else
+		cmd.cmdidx = count > 1 ? MMC_CMD_READ_MULTIPLE_BLOCK : MMC_CMD_READ_SINGLE_BLOCK;
+	cmd.cmdarg = mmc->high_capacity ? lba : lba * BLOCK_SIZE;
+	cmd.resp_type = MMC_RSP_R1;
+
+	data.dest = (char *)buf;
+	data.blocks = count;
+	data.blocksize = BLOCK_SIZE;
+	data.flags = flags;
+
+	return mmc->cfg->ops->send_cmd(mmc,&cmd,&data);
+}
+
+/*******************************************************************************
+*
+* @brief This function returns the hash bucket of a block.
+*
+******************************************************************************/
+static u32 mmc_cache_hash_(u32 lba)
+{
+	return (lba ^ (lba >> 6)) & (MMC_CACHE_HASH-1);
+}
+
+/*******************************************************************************
+*
+* @brief This function looks a block up.
+*
+* @return Index of its entry, MMC_CACHE_NONE if it is not cached.
+*
+******************************************************************************/
+static u32 mmc_cache_lookup_(struct mmc_cache *c, u32 lba)
+{
+	u32 i = c->hash[mmc_cache_hash_(lba)];
+	while(i != MMC_CACHE_NONE && c->entry[i].lba != lba)
+		i = c->entry[i].hash_next;
+	return i;
+}
+
+/*******************************************************************************
+*
+* @brief This function moves an entry to the most recently used position.
+*
+******************************************************************************/
+static void mmc_cache_touch_(struct mmc_cache *c, u32 i)
+{
+	struct mmc_cache_entry *e = &c->entry[i];
+
+	if(c->mru == i) return;
+	//Unlink, it is not the MRU so it has a previous entry
+	c->entry[e->prev].next = e->next;
+	if(e->next != MMC_CACHE_NONE)
+		c->entry[e->next].prev = e->prev;
+	else
+		c->lru = e->prev;
+	//Insert at the head
+	e->prev = MMC_CACHE_NONE;
+	e->next = c->mru;
+	c->entry[c->mru].prev = i;
+	c->mru = i;
+}
+
+/*******************************************************************************
+*
+* @brief This function drops an entry, without writing it back, and makes it the
+*        next victim.
+*
+******************************************************************************/
+static void mmc_cache_drop_(struct mmc_cache *c, u32 i)
+{
+	struct mmc_cache_entry *e = &c->entry[i];
+	u16 *p = &c->hash[mmc_cache_hash_(e->lba)];
+
+	if(!e->valid) return;
+	while(*p != i) p = &c->entry[*p].hash_next;
+	*p = e->hash_next;
+	e->valid = 0;
+	e->dirty = 0;
+
+	//Move to the LRU position
+	if(c->lru == i) return;
+	if(e->prev != MMC_CACHE_NONE)
+		c->entry[e->prev].next = e->next;
+	else
+		c->mru = e->next;
+	c->entry[e->next].prev = e->prev;
+	e->next = MMC_CACHE_NONE;
+	e->prev = c->lru;
+	c->entry[c->lru].next = i;
+	c->lru = i;
+}
+
+/*******************************************************************************
+*
+* @brief This function writes every dirty block back to the card, sorted by block
+*        number, adjacent blocks being written with a single multi-block command.
+*
+* @param c  Pointer to the cache structure.
+* @return   0 on success, -1 on failure (the failed blocks stay dirty).
+*
+******************************************************************************/
+static int mmc_cache_flush(struct mmc_cache *c)
+{
+	u16 list[MMC_CACHE_BLOCKS];
+	u32 n = 0;
+	int ret = 0;
+
+	//Insertion sort of the dirty entries by block number
+	for(u32 i=0; i<MMC_CACHE_BLOCKS; i++) {
+		if(!c->entry[i].dirty) continue;
+		u32 k = n++;
+		while(k && c->entry[list[k-1]].lba > c->entry[i].lba) {
+			list[k] = list[k-1];
+			k--;
+		}
+		list[k] = i;
+	}
+
+	for(u32 k=0; k<n;) {
+		u32 run = 1;
+		while(k+run < n && run < MMC_CACHE_BATCH &&
+			  c->entry[list[k+run]].lba == c->entry[list[k]].lba + run)
+			run++;
+
+		for(u32 j=0; j<run; j++)
+			memcpy(c->stage[j], c->data[list[k+j]], BLOCK_SIZE);
+		if(mmc_cache_io_(c, c->entry[list[k]].lba, run, c->stage, MMC_DATA_WRITE)) {
+			ret = -1;
+		} else {
+			for(u32 j=0; j<run; j++)
+				c->entry[list[k+j]].dirty = 0;
+			c->stats.writeback_blocks += run;
+		}
+		c->stats.writeback_cmds++;
+		k += run;
+	}
+
+	return ret;
+}
+
+/*******************************************************************************
+*
+* @brief This function assigns the least recently used entry to a block, writing
+*        the dirty blocks back if that entry is dirty.
+*
+* @return Index of the entry, MMC_CACHE_NONE if the write-back failed (the dirty
+*         blocks stay cached).
+*
+******************************************************************************/
+static u32 mmc_cache_alloc_(struct mmc_cache *c, u32 lba)
+{
+	u32 i = c->lru;
+	struct mmc_cache_entry *e = &c->entry[i];
+	u32 h = mmc_cache_hash_(lba);
+
+	if(e->valid) {
+		if(e->dirty && mmc_cache_flush(c)) return MMC_CACHE_NONE;
+		mmc_cache_drop_(c, i);
+		c->stats.evictions++;
+	}
+
+	e->lba = lba;
+	e->valid = 1;
+	e->dirty = 0;
+	e->hash_next = c->hash[h];
+	c->hash[h] = i;
+	mmc_cache_touch_(c, i);
+	return i;
+}
+
+/*******************************************************************************
+*
+* @brief This function reads blocks through the cache. Missing blocks are fetched
+*        by runs, extended to MMC_CACHE_READ_AHEAD blocks when the read follows
+*        the previous one.
+*
+* @param c      Pointer to the cache structure.
+* @param lba    First block to read.
+* @param count  Number of blocks to read.
+* @param buf    Destination buffer.
+* @return       0 on success, -1 on failure.
+*
+******************************************************************************/
+static int mmc_cache_read(struct mmc_cache *c, u32 lba, u32 count, char *buf)
+{
+	u16 slots[MMC_CACHE_BATCH];
+	u32 sequential = lba == c->next_lba;
+
+	c->next_lba = lba + count;
+
+	if(count >= MMC_CACHE_BLOCKS/2) {
+		c->stats.bypass++;
+		if(mmc_cache_io_(c, lba, count, buf, MMC_DATA_READ)) return -1;
+		//Dirty blocks are more recent than the card
+		for(u32 i=0; i<MMC_CACHE_BLOCKS; i++) {
+			struct mmc_cache_entry *e = &c->entry[i];
+			if(e->dirty && e->lba - lba < count)
+				memcpy(buf + (e->lba - lba) * BLOCK_SIZE, c->data[i], BLOCK_SIZE);
+		}
+		return 0;
+	}
+
+	for(u32 n=0; n<count;) {
+		u32 i = mmc_cache_lookup_(c, lba+n);
+		if(i != MMC_CACHE_NONE) {
+			memcpy(buf + n*BLOCK_SIZE, c->data[i], BLOCK_SIZE);
+			mmc_cache_touch_(c, i);
+			c->stats.hits++;
+			n++;
+			continue;
+		}
+
+		u32 wanted = count - n;
+		u32 run = wanted;
+		if(sequential && run < MMC_CACHE_READ_AHEAD) run = MMC_CACHE_READ_AHEAD;
+		if(run > MMC_CACHE_BATCH) run = MMC_CACHE_BATCH;
+		for(u32 k=1; k<run; k++) {
+			if(mmc_cache_lookup_(c, lba+n+k) != MMC_CACHE_NONE) {
+				run = k;
+				break;
+			}
+		}
+
+		//Entries first, as an eviction may write back through the stage buffer
+		for(u32 k=0; k<run; k++) {
+			slots[k] = mmc_cache_alloc_(c, lba+n+k);
+			if(slots[k] == MMC_CACHE_NONE) {
+				while(k--) mmc_cache_drop_(c, slots[k]);
+				return -1;
+			}
+		}
+		if(mmc_cache_io_(c, lba+n, run, c->stage, MMC_DATA_READ)) {
+			for(u32 k=0; k<run; k++)
+				mmc_cache_drop_(c, slots[k]);
+			return -1;
+		}
+
+		for(u32 k=0; k<run; k++) {
+			memcpy(c->data[slots[k]], c->stage[k], BLOCK_SIZE);
+			if(k < wanted) memcpy(buf + (n+k)*BLOCK_SIZE, c->stage[k], BLOCK_SIZE);
+		}
+		if(run > wanted) {
+			c->stats.read_ahead += run - wanted;
+			run = wanted;
+		}
+		c->stats.misses += run;
+		n += run;
+	}
+
+	return 0;
+}
+
+/*******************************************************************************
+*
+* @brief This function writes blocks through the cache. The blocks are only marked
+*        dirty, they reach the card on eviction or mmc_cache_flush.
+*
+* @param c      Pointer to the cache structure.
+* @param lba    First block to write.
+* @param count  Number of blocks to write.
+* @param buf    Source buffer.
+* @return       0 on success, -1 on failure (an eviction could not write back;
+*               the blocks before the failing one are cached).
+*
+******************************************************************************/
+static int mmc_cache_write(struct mmc_cache *c, u32 lba, u32 count, const char *buf)
+{
+	if(count >= MMC_CACHE_BLOCKS/2) {
+		c->stats.bypass++;
+		//The cached copies become stale
+		for(u32 n=0; n<count; n++) {
+			u32 i = mmc_cache_lookup_(c, lba+n);
+			if(i != MMC_CACHE_NONE) mmc_cache_drop_(c, i);
+		}
+		return mmc_cache_io_(c, lba, count, (void *)buf, MMC_DATA_WRITE);
+	}
+
+	for(u32 n=0; n<count; n++) {
+		u32 i = mmc_cache_lookup_(c, lba+n);
+		if(i == MMC_CACHE_NONE) {
+			i = mmc_cache_alloc_(c, lba+n);
+			if(i == MMC_CACHE_NONE) return -1;
+		} else
+			mmc_cache_touch_(c, i);
+		memcpy(c->data[i], buf + n*BLOCK_SIZE, BLOCK_SIZE);
+		c->entry[i].dirty = 1;
+	}
+
+	return 0;
+}
+
+/*******************************************************************************
+*
+* @brief This function writes the dirty blocks back and drops every cached block,
+*        for instance after the card was accessed without the cache.
+*
+* @param c  Pointer to the cache structure.
+* @return   0 on success, -1 if the write-back failed (nothing is dropped then).
+*
+******************************************************************************/
+static int mmc_cache_invalidate(struct mmc_cache *c)
+{
+	if(mmc_cache_flush(c)) return -1;
+	for(u32 i=0; i<MMC_CACHE_BLOCKS; i++)
+		mmc_cache_drop_(c, i);
+	c->next_lba = 0xFFFFFFFF;
+	return 0;
+}
+
+/*******************************************************************************
+*
+* @brief This function returns the cache statistics.
+*
+* @param c      Pointer to the cache structure.
+* @param stats  Filled with the statistics since mmc_cache_init.
+*
+******************************************************************************/
+static void mmc_cache_get_stats(struct mmc_cache *c, struct mmc_cache_stats *stats)
+{
+	*stats = c->stats;
+}
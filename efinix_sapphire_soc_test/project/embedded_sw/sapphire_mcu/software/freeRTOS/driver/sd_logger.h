@@ -0,0 +1,378 @@
+/*******************************************************************************
+*
+* @file sd_logger.h
+*
+* @brief Header file for a sustained-write data logger on an SD card. The log
+*        region is erased ahead of time (CMD32/CMD33/CMD38) so that the card
+*        does not have to erase while it is written. The data is then streamed
+*        in aligned chunks of several blocks, each written with one CMD25
+*        (auto CMD12) preceded by an ACMD23 pre-erase hint.
+*
+*        The producer fills a ring of chunk buffers in DDR with sd_logger_push,
+*        possibly from an interrupt. The consumer writes the full buffers to
+*        the card with sd_logger_poll. The worst-case and average latency of
+*        the chunk writes are recorded: the ring must hold at least the data
+*        produced during the worst-case latency.
+*
+* Functions:
+* - sd_logger_init: Initializes a logger over a region of the card.
+* - sd_logger_erase: Erases a range of blocks.
+* - sd_logger_start: Pre-erases the whole log region.
+* - sd_logger_push: Appends data to the ring.
+* - sd_logger_poll: Writes the full buffers of the ring to the card.
+* - sd_logger_flush: Pads and writes the partial buffer, then every pending one.
+* - sd_logger_report: Prints the write latency statistics.
+*
+******************************************************************************/
+
+#pragma once
+
+#include <string.h>
+#include "type.h"
+#include "bsp.h"
+#include "mmc.h"
+
+#ifndef SD_LOGGER_ERASE_BLOCKS
+#define SD_LOGGER_ERASE_BLOCKS		8192	// blocks per erase command (4MB, a typical allocation unit)
+#endif
+#define SD_LOGGER_ERASE_TIMEOUT_US	5000000	// busy time allowed per erase command
+#define SD_LOGGER_WRITE_TIMEOUT_US	500000	// busy time allowed per chunk write
+#define SD_LOGGER_STATE_TRAN		4		// card status CURRENT_STATE of the transfer state
+#define SD_LOGGER_READY_FOR_DATA	0x100	// card status READY_FOR_DATA bit
+
+/*******************************************************************************
+*
+* @brief Structure holding the logger statistics. Latencies are measured from the
+*        ACMD23 of a chunk until the card is back to the transfer state.
+*
+******************************************************************************/
+struct sd_logger_stats {
+	u32 chunks;					/* Chunks written */
+	u32 last_us;				/* Latency of the last chunk */
+	u32 worst_us;				/* Worst chunk latency */
+	u64 total_us;				/* Sum of the chunk latencies, for the average */
+	u32 overruns;				/* Pushes dropped because the ring was full */
+	u32 errors;					/* Failed chunk writes */
+};
+
+/*******************************************************************************
+*
+* @brief Structure holding a data logger.
+*
+******************************************************************************/
+struct sd_logger {
+	struct mmc *mmc;
+	u32 start;					/* First block of the log region, chunk aligned */
+	u32 end;					/* Block following the log region */
+	u32 next;					/* Next block to write */
+	char *ring;					/* Chunk buffers */
+	u32 chunk_blocks;			/* Blocks per chunk */
+	u32 count;					/* Number of chunk buffers */
+	u32 fill;					/* Bytes already in the buffer being filled */
+	volatile u32 filled;		/* Buffers filled, free running */
+	volatile u32 written;		/* Buffers written, free running */
+	struct sd_logger_stats stats;
+};
+
+/*******************************************************************************
+*
+* @brief This function initializes a logger over a region of the card.
+*
+* @param log           Pointer to the logger structure.
+* @param mmc           Pointer to the MMC structure, in transfer state.
+* @param start         First block of the log region, rounded up to a chunk boundary.
+* @param blocks        Number of blocks of the log region.
+* @param ring          Word aligned buffer of count x chunk_blocks blocks.
+* @param chunk_blocks  Blocks per chunk, power of two.
+* @param count         Number of chunk buffers, 2 or more.
+*
+******************************************************************************/
+static void sd_logger_init(struct sd_logger *log, struct mmc *mmc, u32 start, u32 blocks,
+						   char *ring, u32 chunk_blocks, u32 count)
+{
+	log->mmc = mmc;
+	log->end = start + blocks;
+	log->start = (start + chunk_blocks - 1) & ~(chunk_blocks - 1);
+	log->next = log->start;
+	log->ring = ring;
+	log->chunk_blocks = chunk_blocks;
+	log->count = count;
+	log->fill = 0;
+	log->filled = 0;
+	log->written = 0;
+	memset(&log->stats, 0, sizeof(log->stats));
+}
+
+/*******************************************************************************
+*
+* @brief This function converts a difference of CLINT ticks to microseconds.
+*        Chunks are timed on the low 32 bits of the timer, which is enough for
+*        the command timeouts, so the conversion never overflows.
+*
+******************************************************************************/
+static u32 sd_logger_us_(u32 ticks)
+{
+	return (u32)((u64)ticks * 1000000 / BSP_CLINT_HZ);
+}
+
+/*******************************************************************************
+*
+* @brief This function sends a command without data through the MMC operations.
+*
+******************************************************************************/
+static int sd_logger_cmd_(struct sd_logger *log, u32 idx, u32 arg, u32 resp_type, u32 *response)
+{
+	struct mmc *mmc = log->mmc;
+	struct mmc_cmd cmd;
+
+	cmd.cmdidx = idx;
+	cmd.cmdarg = arg;
+	cmd.resp_type = resp_type;
+
+	if(mmc->cfg->ops->send_cmd(mmc,&cmd,0))
+		return -1;
+	if(response)
+		*response = cmd.response[0];
+	return 0;
+}
+
+/*******************************************************************************
+*
+* @brief This function polls the card status with CMD13 until the card is ready
+*        for data in the transfer state.
+*
+******************************************************************************/
+static int sd_logger_wait_ready_(struct sd_logger *log, u32 timeout_us)
+{
+	u32 status;
+	u32 t = clint_getTimeLow(BSP_CLINT);
+
+	while(1) {
+		if(sd_logger_cmd_(log,MMC_CMD_SEND_STATUS,log->mmc->rca<<16,MMC_RSP_R1,&status) == 0 &&
+		   (status & SD_LOGGER_READY_FOR_DATA) && ((status>>9)&0xF) == SD_LOGGER_STATE_TRAN)
+			return 0;
+		if(sd_logger_us_(clint_getTimeLow(BSP_CLINT) - t) > timeout_us)
+			return -1;
+	}
+}
+
+/*******************************************************************************
+*
+* @brief This function erases a range of blocks with CMD32, CMD33 and CMD38, then
+*        waits for the end of the erase.
+*
+* @param log     Pointer to the logger structure.
+* @param lba     First block to erase.
+* @param blocks  Number of blocks to erase.
+* @return        Returns 0 upon successful erase, -1 otherwise.
+*
+******************************************************************************/
+static int sd_logger_erase(struct sd_logger *log, u32 lba, u32 blocks)
+{
+	u32 unit = log->mmc->high_capacity ? 1 : BLOCK_SIZE;
+
+	if(blocks == 0)
+		return 0;
+	if(sd_logger_cmd_(log,SD_CMD_ERASE_WR_BLK_START,lba*unit,MMC_RSP_R1,0))
+		return -1;
+	if(sd_logger_cmd_(log,SD_CMD_ERASE_WR_BLK_END,(lba+blocks-1)*unit,MMC_RSP_R1,0))
+		return -1;
+	if(sd_logger_cmd_(log,MMC_CMD_ERASE,0,MMC_RSP_R1b,0))
+		return -1;
+
+	return sd_logger_wait_ready_(log,SD_LOGGER_ERASE_TIMEOUT_US);
+}
+
+/*******************************************************************************
+*
+* @brief This function pre-erases the whole log region, SD_LOGGER_ERASE_BLOCKS at a
+*        time, and rewinds the logger to its start. It can take several seconds on
+*        large regions and should be called before the acquisition starts.
+*
+* @param log  Pointer to the logger structure.
+* @return     Returns 0 upon successful erase, -1 otherwise.
+*
+******************************************************************************/
+static int sd_logger_start(struct sd_logger *log)
+{
+	u32 lba, n;
+
+	for(lba=log->start; lba<log->end; lba+=n) {
+		n = log->end - lba;
+		if(n > SD_LOGGER_ERASE_BLOCKS)
+			n = SD_LOGGER_ERASE_BLOCKS;
+		if(sd_logger_erase(log,lba,n)) {
+			bsp_printf("Err : SD erase failed at block %d\r\n",lba);
+			return -1;
+		}
+	}
+
+	log->next = log->start;
+	log->fill = 0;
+	log->filled = 0;
+	log->written = 0;
+	return 0;
+}
+
+/*******************************************************************************
+*
+* @brief This function appends data to the ring. A buffer becomes pending once it
+*        is full. The data that does not fit in the ring is dropped and counted as
+*        an overrun. Single producer, it can be called from an interrupt.
+*
+* @param log    Pointer to the logger structure.
+* @param data   Data to append.
+* @param bytes  Number of bytes.
+* @return       Number of bytes appended.
+*
+******************************************************************************/
+static u32 sd_logger_push(struct sd_logger *log, const void *data, u32 bytes)
+{
+	const char *src = data;
+	u32 chunk_bytes = log->chunk_blocks * BLOCK_SIZE;
+	u32 done = 0;
+
+	while(done < bytes) {
+		if(log->filled - log->written >= log->count) {
+			log->stats.overruns++;
+			break;
+		}
+
+		u32 n = chunk_bytes - log->fill;
+		if(n > bytes - done)
+			n = bytes - done;
+		memcpy(log->ring + (log->filled % log->count) * chunk_bytes + log->fill, src + done, n);
+		log->fill += n;
+		done += n;
+
+		if(log->fill == chunk_bytes) {
+			log->fill = 0;
+			log->filled++;
+		}
+	}
+
+	return done;
+}
+
+/*******************************************************************************
+*
+* @brief This function writes one chunk buffer with ACMD23 and CMD25, and records its
+*        latency.
+*
+******************************************************************************/
+static int sd_logger_write_chunk_(struct sd_logger *log, char *buf)
+{
+	struct mmc *mmc = log->mmc;
+	struct mmc_cmd cmd;
+	struct mmc_data data;
+	u32 t, us;
+	int ret;
+
+	if(log->next + log->chunk_blocks > log->end)
+		return -1;
+
+	t = clint_getTimeLow(BSP_CLINT);
+
+	//Pre-erase hint, valid for the next multi-block write only
+	ret = sd_logger_cmd_(log,MMC_CMD_APP_CMD,mmc->rca<<16,MMC_RSP_R1,0);
+	if(ret == 0)
+		ret = sd_logger_cmd_(log,SD_CMD_APP_SET_WR_BLK_ERASE_COUNT,log->chunk_blocks,MMC_RSP_R1,0);
+
+	if(ret == 0) {
+		cmd.cmdidx = log->chunk_blocks > 1 ? MMC_CMD_WRITE_MULTIPLE_BLOCK : MMC_CMD_WRITE_SINGLE_BLOCK;
+		cmd.cmdarg = mmc->high_capacity ? log->next : log->next * BLOCK_SIZE;
+		cmd.resp_type = MMC_RSP_R1;
+
+		data.src = buf;
+		data.blocks = log->chunk_blocks;
+		data.blocksize = BLOCK_SIZE;
+		data.flags = MMC_DATA_WRITE;
+
+		ret = mmc->cfg->ops->send_cmd(mmc,&cmd,&data);
+	}
+
+	//The card programs the chunk after the stop command
+	if(ret == 0)
+		ret = sd_logger_wait_ready_(log,SD_LOGGER_WRITE_TIMEOUT_US);
+
+	if(ret) {
+		log->stats.errors++;
+		return -1;
+	}
+
+	us = sd_logger_us_(clint_getTimeLow(BSP_CLINT) - t);
+	log->stats.chunks++;
+	log->stats.last_us = us;
+	log->stats.total_us += us;
+	if(us > log->stats.worst_us)
+		log->stats.worst_us = us;
+
+	log->next += log->chunk_blocks;
+	return 0;
+}
+
+/*******************************************************************************
+*
+* @brief This function writes the full buffers of the ring to the card, in order.
+*
+* @param log  Pointer to the logger structure.
+* @return     Number of chunks written, or -1 on write error or when the log region
+*             is full. The failed chunk stays pending.
+*
+******************************************************************************/
+static int sd_logger_poll(struct sd_logger *log)
+{
+	u32 chunk_bytes = log->chunk_blocks * BLOCK_SIZE;
+	int n = 0;
+
+	while(log->written != log->filled) {
+		if(sd_logger_write_chunk_(log,log->ring + (log->written % log->count) * chunk_bytes))
+			return -1;
+		log->written++;
+		n++;
+	}
+
+	return n;
+}
+
+/*******************************************************************************
+*
+* @brief This function pads the partial buffer with zeros, then writes it along with
+*        every pending buffer. The producer must be stopped.
+*
+* @param log  Pointer to the logger structure.
+* @return     Returns 0 upon successful write, -1 otherwise.
+*
+******************************************************************************/
+static int sd_logger_flush(struct sd_logger *log)
+{
+	u32 chunk_bytes = log->chunk_blocks * BLOCK_SIZE;
+
+	if(log->fill && log->filled - log->written < log->count) {
+		memset(log->ring + (log->filled % log->count) * chunk_bytes + log->fill, 0, chunk_bytes - log->fill);
+		log->fill = 0;
+		log->filled++;
+	}
+
+	return sd_logger_poll(log) < 0 ? -1 : 0;
+}
+
+/*******************************************************************************
+*
+* @brief This function prints the write latency statistics, and the throughput
+*        sustained by the card at the average latency.
+*
+* @param log  Pointer to the logger structure.
+*
+******************************************************************************/
+static void sd_logger_report(struct sd_logger *log)
+{
+	struct sd_logger_stats *s = &log->stats;
+	u32 avg = s->chunks ? (u32)(s->total_us / s->chunks) : 0;
+	u32 kbps = avg ? (u32)((u64)log->chunk_blocks * BLOCK_SIZE * 1000 / avg) : 0;
+
+	bsp_printf("SD logger: %d chunks of %d blocks, %d errors, %d overruns\r\n",
+			   s->chunks,log->chunk_blocks,s->errors,s->overruns);
+	bsp_printf("SD logger: latency avg %d us, worst %d us, last %d us, %d KB/s\r\n",
+			   avg,s->worst_us,s->last_us,kbps);
+}
@@ -0,0 +1,361 @@
+/*******************************************************************************
+*
+* @file sd_trace.h
+*
+* @brief Header file for a zero-print tracer of the SD controller. Each command is
+*        recorded into a RAM ring with its index, argument, response, error bits
+*        and timestamps: start, response and end of the data phase. Controller
+*        events (clock and bus changes, user markers) are recorded in the same
+*        ring. Per command latency histograms are kept on the side.
+*
+*        Nothing is printed while tracing. The ring and the histograms are
+*        printed on demand with sd_trace_dump and sd_trace_hist_dump, so that the
+*        card busy time can be observed without perturbing it.
+*
+*        The tracer is built when SD_TRACE_EN is defined, otherwise the SD_TRACE_*
+*        hooks of the driver compile to nothing. Timestamps are CLINT ticks.
+*
+* Functions:
+* - sd_trace_clear: Empties the ring and the histograms.
+* - sd_trace_data: Marks the next command as carrying data blocks.
+* - sd_trace_begin: Records the start of a command.
+* - sd_trace_resp: Records the response of the command in flight.
+* - sd_trace_end: Records the end of the data phase of the command in flight.
+* - sd_trace_event: Records a controller event.
+* - sd_trace_dump: Prints the ring, oldest entry first.
+* - sd_trace_hist_dump: Prints the latency histograms.
+*
+******************************************************************************/
+
+#pragma once
+
+#include "type.h"
+
+// Error bits of an entry
+#define SD_TRACE_ERR_CMD_TIMEOUT	0x01
+#define SD_TRACE_ERR_CMD_CRC		0x02
+#define SD_TRACE_ERR_CMD_END_BIT	0x04
+#define SD_TRACE_ERR_CMD_INDEX		0x08
+#define SD_TRACE_ERR_DATA_CRC		0x10
+
+// Error bits from the interrupt status structure
+#define SD_TRACE_INT_ERR(s)			(((s).command_timeout_error ? SD_TRACE_ERR_CMD_TIMEOUT : 0) | \
+									 ((s).command_crc_error ? SD_TRACE_ERR_CMD_CRC : 0) | \
+									 ((s).command_end_bit_error ? SD_TRACE_ERR_CMD_END_BIT : 0) | \
+									 ((s).command_index_error ? SD_TRACE_ERR_CMD_INDEX : 0) | \
+									 ((s).data_crc_error ? SD_TRACE_ERR_DATA_CRC : 0))
+
+// Controller events
+#define SD_TRACE_EV_CLOCK			0		// value: clock in KHz
+#define SD_TRACE_EV_BUS				1		// value: host control register
+#define SD_TRACE_EV_USER			2		// value: free, for application markers
+
+#ifdef SD_TRACE_EN
+
+#include <string.h>
+#include "bsp.h"
+
+#ifndef SD_TRACE_DEPTH
+#define SD_TRACE_DEPTH				64		// ring entries, power of two
+#endif
+#define SD_TRACE_HIST_SLOTS			8		// commands with a histogram
+#define SD_TRACE_BUCKETS			24		// bucket n holds 2^n to 2^(n+1)-1 ticks, the last one the rest
+
+// Entry flags
+#define SD_TRACE_F_APP				0x01	// application command (ACMD)
+#define SD_TRACE_F_DATA				0x02	// command with a data phase
+#define SD_TRACE_F_RESP				0x04	// response received
+#define SD_TRACE_F_DONE				0x08	// entry complete
+#define SD_TRACE_F_EVENT			0x10	// controller event, idx holds the event code
+
+/*******************************************************************************
+*
+* @brief Structure holding one trace entry.
+*
+******************************************************************************/
+struct sd_trace_entry {
+	u8 idx;						/* Command index, or event code */
+	u8 flags;					/* SD_TRACE_F_* */
+	u8 err;						/* SD_TRACE_ERR_* */
+	u8 reserved;
+	u32 blocks;					/* Data blocks */
+	u32 arg;					/* Command argument, or event value */
+	u32 resp;					/* Response bits 31:0 */
+	u32 start;					/* Command written to the controller */
+	u32 resp_time;				/* Command complete */
+	u32 end;					/* Transfer complete, or command complete without data */
+};
+
+/*******************************************************************************
+*
+* @brief Structure holding the latency histogram of one command.
+*
+******************************************************************************/
+struct sd_trace_hist {
+	u8 key;						/* Command index, bit 6 for an ACMD */
+	u8 used;
+	u32 count;
+	u32 errors;
+	u32 max;					/* Ticks */
+	u64 total;					/* Ticks */
+	u32 bucket[SD_TRACE_BUCKETS];
+};
+
+/*******************************************************************************
+*
+* @brief Structure holding the tracer state.
+*
+******************************************************************************/
+struct sd_trace {
+	struct sd_trace_entry ring[SD_TRACE_DEPTH];
+	u32 head;					/* Entries recorded, free running */
+	struct sd_trace_entry *cur;	/* Command in flight */
+	u32 data_blocks;			/* Blocks of the next command */
+	u32 untracked;				/* Commands without a free histogram slot */
+	struct sd_trace_hist hist[SD_TRACE_HIST_SLOTS];
+};
+
+struct sd_trace SdTrace;		/* Global tracer state */
+
+/*******************************************************************************
+*
+* @brief This function empties the ring and the histograms.
+*
+******************************************************************************/
+static void sd_trace_clear(void)
+{
+	memset(&SdTrace, 0, sizeof(SdTrace));
+}
+
+/*******************************************************************************
+*
+* @brief This function allocates the next ring entry.
+*
+******************************************************************************/
+static struct sd_trace_entry *sd_trace_alloc_(void)
+{
+	struct sd_trace_entry *e = &SdTrace.ring[SdTrace.head & (SD_TRACE_DEPTH-1)];
+
+	SdTrace.head++;
+	memset(e, 0, sizeof(*e));
+	e->start = clint_getTimeLow(BSP_CLINT);
+	return e;
+}
+
+/*******************************************************************************
+*
+* @brief This function marks the next command as carrying data blocks.
+*
+* @param blocks  Number of data blocks.
+*
+******************************************************************************/
+static void sd_trace_data(u32 blocks)
+{
+	SdTrace.data_blocks = blocks;
+}
+
+/*******************************************************************************
+*
+* @brief This function records the start of a command.
+*
+* @param idx  Command index.
+* @param arg  Command argument.
+* @param app  Application command flag.
+*
+******************************************************************************/
+static void sd_trace_begin(u32 idx, u32 arg, u32 app)
+{
+	struct sd_trace_entry *e = sd_trace_alloc_();
+
+	e->idx = idx;
+	e->arg = arg;
+	e->flags = app ? SD_TRACE_F_APP : 0;
+	if(SdTrace.data_blocks) {
+		e->flags |= SD_TRACE_F_DATA;
+		e->blocks = SdTrace.data_blocks;
+		SdTrace.data_blocks = 0;
+	}
+	SdTrace.cur = e;
+}
+
+/*******************************************************************************
+*
+* @brief This function closes the command in flight and accounts its latency.
+*
+******************************************************************************/
+static void sd_trace_close_(struct sd_trace_entry *e)
+{
+	struct sd_trace_hist *h = 0;
+	u8 key = e->idx | ((e->flags & SD_TRACE_F_APP) ? 0x40 : 0);
+	u32 ticks, n;
+
+	e->end = clint_getTimeLow(BSP_CLINT);
+	e->flags |= SD_TRACE_F_DONE;
+	SdTrace.cur = 0;
+
+	for(n=0; n<SD_TRACE_HIST_SLOTS; n++) {
+		if(!SdTrace.hist[n].used) {
+			h = &SdTrace.hist[n];
+			h->used = 1;
+			h->key = key;
+			break;
+		}
+		if(SdTrace.hist[n].key == key) {
+			h = &SdTrace.hist[n];
+			break;
+		}
+	}
+	if(!h) {
+		SdTrace.untracked++;
+		return;
+	}
+
+	ticks = e->end - e->start;
+	for(n=0; n<SD_TRACE_BUCKETS-1 && (ticks >> (n+1)); n++);
+	h->bucket[n]++;
+	h->count++;
+	h->total += ticks;
+	if(ticks > h->max) h->max = ticks;
+	if(e->err) h->errors++;
+}
+
+/*******************************************************************************
+*
+* @brief This function records the response of the command in flight. A command
+*        without data, or failed, is complete.
+*
+* @param resp  Response bits 31:0.
+* @param err   SD_TRACE_ERR_* bits.
+*
+******************************************************************************/
+static void sd_trace_resp(u32 resp, u32 err)
+{
+	struct sd_trace_entry *e = SdTrace.cur;
+
+	if(!e) return;
+	e->resp_time = clint_getTimeLow(BSP_CLINT);
+	e->resp = resp;
+	e->err |= err;
+	e->flags |= SD_TRACE_F_RESP;
+	if(!(e->flags & SD_TRACE_F_DATA) || err)
+		sd_trace_close_(e);
+}
+
+/*******************************************************************************
+*
+* @brief This function records the end of the data phase of the command in flight.
+*
+* @param err  SD_TRACE_ERR_* bits.
+*
+******************************************************************************/
+static void sd_trace_end(u32 err)
+{
+	struct sd_trace_entry *e = SdTrace.cur;
+
+	if(!e) return;
+	e->err |= err;
+	sd_trace_close_(e);
+}
+
+/*******************************************************************************
+*
+* @brief This function records a controller event.
+*
+* @param code   SD_TRACE_EV_* code.
+* @param value  Event value.
+*
+******************************************************************************/
+static void sd_trace_event(u32 code, u32 value)
+{
+	struct sd_trace_entry *e = sd_trace_alloc_();
+
+	e->idx = code;
+	e->arg = value;
+	e->end = e->start;
+	e->flags = SD_TRACE_F_EVENT | SD_TRACE_F_DONE;
+}
+
+/*******************************************************************************
+*
+* @brief This function converts CLINT ticks to microseconds.
+*
+******************************************************************************/
+static u32 sd_trace_us_(u32 ticks)
+{
+	return (u32)((u64)ticks * 1000000 / BSP_CLINT_HZ);
+}
+
+/*******************************************************************************
+*
+* @brief This function prints the ring, oldest entry first. Times are relative to
+*        the oldest entry, latencies are from the start of the command.
+*
+******************************************************************************/
+static void sd_trace_dump(void)
+{
+	static const char *events[] = { "CLOCK", "BUS", "USER" };
+	u32 n = SdTrace.head < SD_TRACE_DEPTH ? SdTrace.head : SD_TRACE_DEPTH;
+	u32 first = SdTrace.head - n;
+	u32 t0 = SdTrace.ring[first & (SD_TRACE_DEPTH-1)].start;
+
+	bsp_printf("SD trace: %d entries\r\n", n);
+	for(u32 i=first; i!=SdTrace.head; i++) {
+		struct sd_trace_entry *e = &SdTrace.ring[i & (SD_TRACE_DEPTH-1)];
+
+		if(e->flags & SD_TRACE_F_EVENT) {
+			bsp_printf("%d us EV %s %d\r\n", sd_trace_us_(e->start - t0),
+					   e->idx < 3 ? events[e->idx] : "?", e->arg);
+			continue;
+		}
+
+		bsp_printf("%d us %s%d arg 0x%x resp 0x%x blk %d rsp %d us end %d us err 0x%x%s\r\n",
+				   sd_trace_us_(e->start - t0), (e->flags & SD_TRACE_F_APP) ? "ACMD" : "CMD", e->idx,
+				   e->arg, e->resp, e->blocks,
+				   (e->flags & SD_TRACE_F_RESP) ? sd_trace_us_(e->resp_time - e->start) : 0,
+				   (e->flags & SD_TRACE_F_DONE) ? sd_trace_us_(e->end - e->start) : 0,
+				   e->err, (e->flags & SD_TRACE_F_DONE) ? "" : " (in flight)");
+	}
+}
+
+/*******************************************************************************
+*
+* @brief This function prints the latency histograms. Each bucket is printed with
+*        its upper bound in microseconds, rounded up. Empty buckets are skipped.
+*
+******************************************************************************/
+static void sd_trace_hist_dump(void)
+{
+	for(u32 n=0; n<SD_TRACE_HIST_SLOTS; n++) {
+		struct sd_trace_hist *h = &SdTrace.hist[n];
+
+		if(!h->used) continue;
+		bsp_printf("%s%d: %d cmds, %d errors, avg %d us, max %d us\r\n",
+				   (h->key & 0x40) ? "ACMD" : "CMD", h->key & 0x3F, h->count, h->errors,
+				   sd_trace_us_((u32)(h->total / h->count)), sd_trace_us_(h->max));
+		for(u32 b=0; b<SD_TRACE_BUCKETS; b++) {
+			if(!h->bucket[b]) continue;
+			if(b == SD_TRACE_BUCKETS-1)
+				bsp_printf("  >= %d us: %d\r\n", sd_trace_us_(1u << b), h->bucket[b]);
+			else
+				bsp_printf("  < %d us: %d\r\n", (u32)(((u64)(2u << b) * 1000000 + BSP_CLINT_HZ - 1) / BSP_CLINT_HZ), h->bucket[b]);
+		}
+	}
+	if(SdTrace.untracked)
+		bsp_printf("%d commands without histogram\r\n", SdTrace.untracked);
+}
+
+#define SD_TRACE_DATA(blocks)			sd_trace_data(blocks)
+#define SD_TRACE_BEGIN(idx,arg,app)		sd_trace_begin(idx,arg,app)
+#define SD_TRACE_RESP(resp,err)			sd_trace_resp(resp,err)
+#define SD_TRACE_END(err)				sd_trace_end(err)
+#define SD_TRACE_EVENT(code,value)		sd_trace_event(code,value)
+
+#else
+
+#define SD_TRACE_DATA(blocks)
+#define SD_TRACE_BEGIN(idx,arg,app)
+#define SD_TRACE_RESP(resp,err)
+#define SD_TRACE_END(err)
+#define SD_TRACE_EVENT(code,value)
+
+#endif
@@ -44,6 +44,11 @@
  * - spiFlash_exit4ByteAddr_: Exit 4-byte addressing based on Manufacturer ID
  * - spiFlash_exit4ByteAddr: Exit 4-byte addressing by reading Manufacturer ID beforehand 
  * - spiFlash_exit4ByteAddr_withGpioCs: Exit 4-byte addressing by reading Manufacturer ID beforehand with gpio chip select 
+ * - spiFlash_readStatus: Read the Status Register.
+ * - spiFlash_writeEnable: Set Write Enable Latch.
+ * - spiFlash_waitReady: Wait until the Write In Progress bit is cleared.
+ * - spiFlash_erase4k: Erase the 4 KB sector holding a flash address.
+ * - spiFlash_m2f: Program memory content into (erased) flash, page by page.
  *
  ******************************************************************************/
 #pragma once
@@ -55,6 +60,9 @@
 
 #define MX25_QUAD_ENABLE_BIT        0x40
 #define MX25_WRITE_ENABLE_LATCH_BIT 0x02
+#define SPI_FLASH_WIP_BIT           0x01
+#define SPI_FLASH_PAGE_SIZE         256
+#define SPI_FLASH_SECTOR_SIZE       4096
 
     
 /*******************************************************************************
@@ -594,3 +602,103 @@
         spiFlash_diselect(spi,cs);
     }
 
+/*******************************************************************************
+*
+* @brief This function read the Status Register with Chip Select.
+*
+* @param spi SPI port base address
+* @param cs 32-bit bitwise chip select setting
+*
+* @return 8-bit Status Register value
+*
+******************************************************************************/
+    static u8 spiFlash_readStatus(u32 spi, u32 cs){
+        spiFlash_select(spi,cs);
+        spi_write(spi, 0x05);
+        u8 status = spi_read(spi);
+        spiFlash_diselect(spi,cs);
+        return status;
+    }
+
+/*******************************************************************************
+*
+* @brief This function set the Write Enable Latch with Chip Select. It has to be
+*        issued before every erase or program command.
+*
+* @param spi SPI port base address
+* @param cs 32-bit bitwise chip select setting
+*
+******************************************************************************/
+    static void spiFlash_writeEnable(u32 spi, u32 cs){
+        spiFlash_select(spi,cs);
+        spi_write(spi, 0x06);
+        spiFlash_diselect(spi,cs);
+    }
+
+/*******************************************************************************
+*
+* @brief This function wait until the SPI Flash completes its current erase or
+*        program operation.
+*
+* @param spi SPI port base address
+* @param cs 32-bit bitwise chip select setting
+*
+******************************************************************************/
+    static void spiFlash_waitReady(u32 spi, u32 cs){
+        while(spiFlash_readStatus(spi, cs) & SPI_FLASH_WIP_BIT);
+    }
+
+/*******************************************************************************
+*
+* @brief This function erase the 4 KB sector holding flashAddress and wait for
+*        the completion.
+*
+* @param spi SPI port base address
+* @param cs 32-bit bitwise chip select setting
+* @param flashAddress Any flash address inside the sector to erase
+*
+******************************************************************************/
+    static void spiFlash_erase4k(u32 spi, u32 cs, u32 flashAddress){
+        spiFlash_writeEnable(spi, cs);
+        spiFlash_select(spi,cs);
+        spi_write(spi, 0x20);
+        spi_write(spi, flashAddress >> 16);
+        spi_write(spi, flashAddress >>  8);
+        spi_write(spi, flashAddress >>  0);
+        spiFlash_diselect(spi,cs);
+        spiFlash_waitReady(spi, cs);
+    }
+
+/*******************************************************************************
+*
+* @brief This function program data from memoryAddress to flashAddress of
+*        specific size with Chip Select. The transfer is split on the flash page
+*        boundaries, the target area has to be erased beforehand.
+*
+* @param spi SPI port base address
+* @param cs 32-bit bitwise chip select setting
+* @param flashAddress The flash address to write the data
+* @param memoryAddress The RAM address to read the data
+* @param size The size of data to copy
+*
+******************************************************************************/
+    static void spiFlash_m2f(u32 spi, u32 cs, u32 flashAddress, u32 memoryAddress, u32 size){
+        uint8_t *ram = (uint8_t *) memoryAddress;
+        while(size){
+            u32 chunk = SPI_FLASH_PAGE_SIZE - (flashAddress & (SPI_FLASH_PAGE_SIZE-1));
+            if(chunk > size) chunk = size;
+            spiFlash_writeEnable(spi, cs);
+            spiFlash_select(spi,cs);
+            spi_write(spi, 0x02);
+            spi_write(spi, flashAddress >> 16);
+            spi_write(spi, flashAddress >>  8);
+            spi_write(spi, flashAddress >>  0);
+            for(u32 idx = 0;idx < chunk;idx++){
+                spi_write(spi, *ram++);
+            }
+            spiFlash_diselect(spi,cs);
+            spiFlash_waitReady(spi, cs);
+            flashAddress += chunk;
+            size -= chunk;
+        }
+    }
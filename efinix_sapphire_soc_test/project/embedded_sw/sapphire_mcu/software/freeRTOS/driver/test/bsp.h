@@ -0,0 +1,15 @@
+/*******************************************************************************
+*
+* @file bsp.h
+*
+* @brief Host stand-in for the bsp.h of the target, for the driver tests built
+*        with the host compiler. Only the printing used by the drivers under
+*        test is provided.
+*
+******************************************************************************/
+#pragma once
+
+#include <stdio.h>
+
+#define bsp_print(s)        puts(s)
+#define bsp_printf          printf
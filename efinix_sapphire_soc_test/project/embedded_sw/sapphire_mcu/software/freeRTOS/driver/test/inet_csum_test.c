@@ -0,0 +1,143 @@
+/*******************************************************************************
+*
+* @file inet_csum_test.c
+*
+* @brief Host test of inet_csum.h against a byte-wise reference of RFC 1071.
+*        Every length from 0 to 4096 bytes is checked at the offsets 0 to 7 of
+*        an aligned buffer, on random data and on 0xFF bytes (longest carry
+*        chains), for inet_csum_ref, inet_csum_add32 (aligned offsets only),
+*        inet_csum_add, inet_csum_combine at a random split, and the
+*        inet_csum_update16 / inet_csum_update32 incremental updates.
+*
+*        Build and run from this directory with the host compiler:
+*
+*        gcc -O2 -I. inet_csum_test.c -o inet_csum_test && ./inet_csum_test
+*
+*        The target bsp.h is replaced by the stand-in of this directory, the
+*        other headers are the ones of the driver directory.
+*
+******************************************************************************/
+#include <stdio.h>
+#include <string.h>
+#include "../inet_csum.h"
+
+#define TEST_MAX_LENGTH     4096
+#define TEST_MAX_OFFSET     8
+#define TEST_ROUNDS         4
+
+static u8 buffer[TEST_MAX_LENGTH + TEST_MAX_OFFSET] __attribute__((aligned(8)));
+static u32 seed = 1;
+static u32 errors = 0;
+
+/*******************************************************************************
+*
+* @brief xorshift32, so that a failure can be reproduced on any host.
+*
+******************************************************************************/
+static u32 test_random(void)
+{
+	seed ^= seed << 13;
+	seed ^= seed >> 17;
+	seed ^= seed << 5;
+	return seed;
+}
+
+/*******************************************************************************
+*
+* @brief Reference sum: big endian 16 bits words taken byte by byte, an odd last
+*        byte padded with 0, folded to 16 bits.
+*
+******************************************************************************/
+static u32 test_reference(const u8 *p, u32 len)
+{
+	u64 acc = 0;
+
+	for(u32 i=0; i<len; i++)
+		acc += (i & 1) ? p[i] : (u32)p[i] << 8;
+	while(acc >> 16)
+		acc = (acc & 0xFFFF) + (acc >> 16);
+	return (u32)acc;
+}
+
+/*******************************************************************************
+*
+* @brief Ones-complement equality: 0x0000 and 0xFFFF are both zero.
+*
+******************************************************************************/
+static int test_same(u32 a, u32 b)
+{
+	return a == b || (a ^ b) == 0xFFFF;
+}
+
+static void test_check(const char *name, u32 got, u32 expected, u32 offset, u32 len)
+{
+	if(test_same(got, expected))
+		return;
+	if(errors++ < 10)
+		printf("%s offset %u length %u: 0x%x, expected 0x%x\n", name, offset, len, got, expected);
+}
+
+/*******************************************************************************
+*
+* @brief Checks every kernel on the bytes at the offset, for the length.
+*
+******************************************************************************/
+static void test_buffer(u32 offset, u32 len)
+{
+	u8 *p = buffer + offset;
+	u32 ref = test_reference(p, len);
+
+	test_check("inet_csum_ref", inet_csum_ref(p, len, 0), ref, offset, len);
+	test_check("inet_csum_add", inet_csum_add(p, len, 0), ref, offset, len);
+	if(!(offset & 3))
+		test_check("inet_csum_add32", inet_csum_add32(p, len, 0), ref, offset, len);
+
+	//A non zero starting sum is carried through
+	u32 start = test_random() & 0xFFFF;
+	test_check("inet_csum_add (sum)", inet_csum_add(p, len, start), inet_csum_fold(ref + start), offset, len);
+
+	u32 split = len ? test_random() % (len + 1) : 0;
+	u32 sum = inet_csum_combine(inet_csum_add(p, split, 0), inet_csum_add(p + split, len - split, 0), split);
+	test_check("inet_csum_combine", sum, ref, offset, len);
+
+	if(len < 8)
+		return;
+
+	//16 bits word at an even position, then 32 bits word at an even position
+	u32 csum = inet_csum_finish(ref);
+	u32 at = (test_random() % (len - 1)) & ~1;
+	u32 old = (p[at] << 8) | p[at+1];
+	u32 new = test_random() & 0xFFFF;
+	p[at] = new >> 8;
+	p[at+1] = new;
+	u32 expected = inet_csum_finish(test_reference(p, len));
+	csum = inet_csum_update16(csum, old, new);
+	test_check("inet_csum_update16", csum, expected, offset, len);
+
+	at = (test_random() % (len - 3)) & ~1;
+	old = ((u32)p[at] << 24) | (p[at+1] << 16) | (p[at+2] << 8) | p[at+3];
+	new = test_random();
+	p[at] = new >> 24;
+	p[at+1] = new >> 16;
+	p[at+2] = new >> 8;
+	p[at+3] = new;
+	expected = inet_csum_finish(test_reference(p, len));
+	test_check("inet_csum_update32", inet_csum_update32(csum, old, new), expected, offset, len);
+}
+
+int main(void)
+{
+	for(u32 round=0; round<TEST_ROUNDS; round++) {
+		for(u32 offset=0; offset<TEST_MAX_OFFSET; offset++) {
+			for(u32 len=0; len<=TEST_MAX_LENGTH; len++) {
+				if(round == 0)
+					memset(buffer, 0xFF, sizeof(buffer));
+				else
+					for(u32 i=0; i<offset+len; i++) buffer[i] = test_random();
+				test_buffer(offset, len);
+			}
+		}
+	}
+	printf("inet_csum: %u errors\n", errors);
+	return errors ? 1 : 0;
+}
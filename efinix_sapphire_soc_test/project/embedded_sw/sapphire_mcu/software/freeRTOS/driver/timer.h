@@ -39,6 +39,10 @@
 #define TIMER_LIMIT     0x04
 #define TIMER_VALUE     0x08
 
+#define TIMER_CONFIG_WITHOUT_PRESCALER  (1 << 0)
+#define TIMER_CONFIG_WITH_PRESCALER     (1 << 1)
+#define TIMER_CONFIG_SELF_RESTART       (1 << 16)
+
 /*******************************************************************************
 *
 * @brief This function reads a 32-bit value from the timer configuration register.
@@ -32,6 +32,7 @@
 * - data_cache_invalidate_all: Invalidate the entire data cache.
 * - data_cache_invalidate_address: Invalidate cache lines corresponding
 *                                  to the given memory address.
+* - data_cache_invalidate_range: Invalidate the cache lines of a memory range.
 * - instruction_cache_invalidate: Invalidate the entire instruction cache.
 *
 ******************************************************************************/
@@ -53,5 +54,32 @@
     );                                         \
 })
 
+//Size of a data cache line in bytes
+#ifndef DATA_CACHE_LINE_BYTES
+#define DATA_CACHE_LINE_BYTES 64
+#endif
+
+//Range size above which invalidating the whole data cache is cheaper than
+//walking its lines (about the size of the data cache)
+#ifndef DATA_CACHE_INVALIDATE_RANGE_MAX
+#define DATA_CACHE_INVALIDATE_RANGE_MAX 4096
+#endif
+
+//Invalidate the data cache lines covering [address, address+bytes[, or the
+//whole data cache when the range is larger than DATA_CACHE_INVALIDATE_RANGE_MAX.
+//The data cache is write-through, no data is lost by the invalidation.
+static inline void data_cache_invalidate_range(const void *address, unsigned int bytes){
+    if(bytes == 0) return;
+    if(bytes > DATA_CACHE_INVALIDATE_RANGE_MAX) {
+        data_cache_invalidate_all();
+        return;
+    }
+    unsigned int line = (unsigned int) address & ~(DATA_CACHE_LINE_BYTES-1);
+    unsigned int end = (unsigned int) address + bytes;
+    for(; line < end; line += DATA_CACHE_LINE_BYTES) {
+        data_cache_invalidate_address(line);
+    }
+}
+
 //Invalidate the whole instruction cache
 #define instruction_cache_invalidate() asm("fence.i");